@@ -0,0 +1,9 @@
+#include <sys/inotify.h>
+
+int main()
+{
+    int fd;
+
+    fd = inotify_init ();
+    inotify_add_watch (fd, ".", IN_CREATE);
+}
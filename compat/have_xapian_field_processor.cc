@@ -0,0 +1,17 @@
+#include <xapian.h>
+
+class TestFieldProcessor : public Xapian::FieldProcessor {
+public:
+    Xapian::Query operator() (const std::string &str)
+    {
+	return Xapian::Query (str);
+    }
+};
+
+int main()
+{
+    Xapian::QueryParser parser;
+    TestFieldProcessor processor;
+
+    parser.add_boolean_prefix ("test", &processor);
+}
@@ -36,22 +36,76 @@
 
 #pragma GCC visibility push(hidden)
 
+struct visible _notmuch_query_cache;
+typedef struct _notmuch_query_cache notmuch_query_cache_t;
+
+struct visible _notmuch_thread_id_cache;
+typedef struct _notmuch_thread_id_cache notmuch_thread_id_cache_t;
+
+struct visible _notmuch_thread_aliases;
+typedef struct _notmuch_thread_aliases notmuch_thread_aliases_t;
+
+struct visible _notmuch_directory_listings;
+typedef struct _notmuch_directory_listings notmuch_directory_listings_t;
+
 struct _notmuch_database {
     notmuch_bool_t exception_reported;
 
     char *path;
 
+    unsigned int version;
     notmuch_bool_t needs_upgrade;
     notmuch_database_mode_t mode;
     int atomic_nesting;
     Xapian::Database *xapian_db;
 
+    /* Batch mode, (see notmuch_database_begin_batch). While a batch
+     * is open, atomic sections share one Xapian transaction, which
+     * is only committed once one of the limits is reached. */
+    notmuch_bool_t in_batch;
+    notmuch_bool_t in_transaction;
+    unsigned int batch_max_messages;
+    size_t batch_max_bytes;
+    unsigned int batch_max_seconds;
+    unsigned int batch_messages;
+    size_t batch_bytes;
+    time_t batch_start;
+
     unsigned int last_doc_id;
     uint64_t last_thread_id;
 
+    /* The revision of the last change to the tags of any message,
+     * (see _notmuch_database_next_revision). */
+    unsigned long revision;
+
     Xapian::QueryParser *query_parser;
     Xapian::TermGenerator *term_gen;
+
+    /* Limits on the bytes of body text indexed per MIME part and per
+     * message, (0 for no limit). */
+    size_t index_max_part_bytes;
+    size_t index_max_message_bytes;
     Xapian::ValueRangeProcessor *value_range_processor;
+    Xapian::ValueRangeProcessor *revision_range_processor;
+#if HAVE_XAPIAN_FIELD_PROCESSOR
+    Xapian::FieldProcessor *thread_field_processor;
+#endif
+
+    /* Recently parsed query strings, (see query.cc). */
+    notmuch_query_cache_t *query_cache;
+
+    /* The thread IDs of recently seen message IDs, (see
+     * _resolve_message_id_to_thread_id). */
+    notmuch_thread_id_cache_t *thread_id_cache;
+
+    /* The recorded thread merges, (see _merge_threads), or NULL until
+     * first needed. */
+    notmuch_thread_aliases_t *thread_aliases;
+
+    /* The listings of the files of directories that are being read
+     * or changed, (see _notmuch_directory_files_get), or NULL for a
+     * read-only database. */
+    notmuch_directory_listings_t *directory_listings;
 };
 
 /* Return the list of terms from the given iterator matching a prefix.
@@ -65,6 +119,61 @@ _notmuch_database_get_terms_with_prefix (void *ctx, Xapian::TermIterator &i,
 					 Xapian::TermIterator &end,
 					 const char *prefix);
 
+/* Forget anything cached about the message with ID 'message_id', (as
+ * when its document is deleted). */
+void
+_notmuch_database_forget_message_id (notmuch_database_t *notmuch,
+				     const char *message_id);
+
+/* Return the ID of the thread into which the thread 'thread_id' has
+ * been merged, (or 'thread_id' itself if it hasn't been).
+ *
+ * The returned string belongs to either 'thread_id' or the database
+ * and must not be modified or freed. */
+const char *
+_notmuch_database_resolve_thread_id (notmuch_database_t *notmuch,
+				     const char *thread_id);
+
+/* Was the thread 'thread_id' merged into another thread, or another
+ * thread into it? If not, every message of the thread has 'thread_id'
+ * as its thread term and THREAD_ID value, and no other message
+ * does. */
+notmuch_bool_t
+_notmuch_database_thread_is_merged (notmuch_database_t *notmuch,
+				    const char *thread_id);
+
+/* Append to 'terms' the thread term of each thread whose messages
+ * belong to the thread 'thread_id', (the thread itself and all the
+ * threads merged into it). */
+void
+_notmuch_database_get_thread_terms (notmuch_database_t *notmuch,
+				    const char *thread_id,
+				    std::vector<std::string> &terms);
+
+/* directory.cc */
+
+notmuch_directory_listings_t *
+_notmuch_directory_listings_create (void *ctx);
+
+/* message.cc */
+
+notmuch_message_t *
+_notmuch_message_create_unattached (const void *talloc_owner,
+				    notmuch_database_t *notmuch,
+				    const char *message_id,
+				    Xapian::TermGenerator *term_gen,
+				    notmuch_private_status_t *status_ret);
+
+/* query.cc */
+
+notmuch_query_cache_t *
+_notmuch_query_cache_create (void *ctx);
+
+/* Forget every query in 'cache', (after a change to the database that
+ * changes how some query strings parse). */
+void
+_notmuch_query_cache_clear (notmuch_query_cache_t *cache);
+
 #pragma GCC visibility pop
 
 #endif
@@ -36,7 +36,7 @@ typedef struct {
     const char *prefix;
 } prefix_t;
 
-#define NOTMUCH_DATABASE_VERSION 1
+#define NOTMUCH_DATABASE_VERSION 3
 
 #define STRINGIFY(s) _SUB_STRINGIFY(s)
 #define _SUB_STRINGIFY(s) #s
@@ -80,13 +80,40 @@ typedef struct {
  *		        STRING is the name of a file within that
  *		        directory for this mail message.
  *
- *    A mail document also has two values:
+ *    A mail document also has the following values:
  *
  *	TIMESTAMP:	The time_t value corresponding to the message's
  *			Date header.
  *
  *	MESSAGE_ID:	The unique ID of the mail mess (see "id" above)
  *
+ *	FROM:		The value of the From header
+ *
+ *	SUBJECT:	The value of the Subject header
+ *
+ *	DATE:		The original text of the Date header
+ *
+ *	THREAD_ID:	The ID of the thread to which the mail belongs
+ *			(see "thread" above). Like the thread term,
+ *			this is not rewritten when the thread is
+ *			merged into another, so it may name a thread
+ *			with an alias, (see "thread_alias_*" below).
+ *
+ *    And a mail document added or whose tags have changed since
+ *    revisions were introduced also has this value:
+ *
+ *	REVISION:	The revision of its addition or of the last
+ *			change to its tags, (see "revision" below),
+ *			serialised with Xapian::sortable_serialise so
+ *			that the "lastmod:" range search can find the
+ *			messages changed since a given revision.
+ *
+ *    The FROM, SUBJECT and DATE values (added in database version 2)
+ *    allow notmuch_message_get_header to answer for these headers
+ *    without opening the message file. The THREAD_ID value (added in
+ *    database version 3) allows thread searches to have Xapian
+ *    return a single message per thread.
+ *
  * In addition, terms from the content of the message are added with
  * "from", "to", "attachment", and "subject" prefixes for use by the
  * user in searching. Similarly, terms from the path of the mail
@@ -117,10 +144,28 @@ typedef struct {
  *		            document, and STRING is the name of this
  *		            directory within that parent.
  *
- * All directory documents have a single value:
+ * All directory documents have the following value:
  *
  *	TIMESTAMP:	The mtime of the directory (at last scan)
  *
+ * And directory documents may also have this value:
+ *
+ *	SUBDIRECTORIES:	The names of the subdirectories of the
+ *			directory, as of a given mtime, (see
+ *			notmuch_directory_set_subdirectories). This
+ *			is the mtime as a base-10 ASCII integer,
+ *			followed by each name preceded by a '/'.
+ *
+ *	FILES:		The files of the directory, (see
+ *			_notmuch_directory_files_get). This is the
+ *			number of files as a base-10 ASCII integer,
+ *			followed by "/<name>/<doc-id>" for each file,
+ *			in order of name, where <doc-id> is the
+ *			document ID of its message in base-10 ASCII.
+ *			A directory without this value has never
+ *			been listed, (or was changed since, outside
+ *			of a batch, or in a batch that hasn't ended).
+ *
  * The data portion of a directory document contains the path of the
  * directory (relative to the database path).
  *
@@ -141,6 +186,11 @@ typedef struct {
  *			changes are made to the database (such as by
  *			indexing new fields).
  *
+ *	revision	The revision of the last change to the tags
+ *			of any message, as a base-10 ASCII integer.
+ *			Each change to the tags of a message takes the
+ *			next revision, (see the REVISION value above).
+ *
  *	last_thread_id	The last thread ID generated. This is stored
  *			as a 16-byte hexadecimal ASCII representation
  *			of a 64-bit unsigned integer. The first ID
@@ -168,6 +218,28 @@ typedef struct {
  *			descendant messages that reference this common
  *			parent can be recognized as belonging to the
  *			same thread.
+ *
+ *	thread_alias_*	A thread that was merged into another. Any
+ *			particular name is formed by concatenating
+ *			"thread_alias_" with the thread ID of the
+ *			merged thread, and the value is the thread ID
+ *			it was merged into, (which may itself have
+ *			been merged into yet another thread later).
+ *
+ *			Rather than rewriting every message of a
+ *			thread when a new message joins it to another
+ *			thread, we only store one of these. Searches
+ *			for thread terms, (see ThreadFieldProcessor),
+ *			and the construction of threads follow these
+ *			aliases to the final thread, so the messages
+ *			of a merged thread keep their old thread term
+ *			until notmuch_database_compact_threads moves
+ *			them, (and clears the metadata value).
+ *
+ *			A Xapian without field processors can't
+ *			expand thread terms as they are parsed, so
+ *			without one, merges move the messages at once
+ *			and no aliases are stored.
  */
 
 /* With these prefix values we follow the conventions published here:
@@ -309,6 +381,33 @@ find_doc_ids (notmuch_database_t *notmuch,
     talloc_free (term);
 }
 
+#if HAVE_XAPIAN_FIELD_PROCESSOR
+/* Parses the value of a "thread:" term into the thread terms of
+ * every thread whose messages belong to that thread, (see
+ * _notmuch_database_get_thread_terms), so that a search for a thread
+ * also finds the messages of the threads merged into it. As this
+ * happens within the query parser, the term may be quoted, loved,
+ * hated or negated like any other. */
+class ThreadFieldProcessor : public Xapian::FieldProcessor {
+    notmuch_database_t *notmuch;
+
+public:
+    ThreadFieldProcessor (notmuch_database_t *notmuch_)
+	: notmuch (notmuch_) { }
+
+    Xapian::Query operator() (const std::string &thread_id)
+    {
+	std::vector<std::string> terms;
+
+	_notmuch_database_get_thread_terms (notmuch, thread_id.c_str (),
+					    terms);
+
+	return Xapian::Query (Xapian::Query::OP_OR,
+			      terms.begin (), terms.end ());
+    }
+};
+#endif
+
 notmuch_private_status_t
 _notmuch_database_find_unique_doc_id (notmuch_database_t *notmuch,
 				      const char *prefix_name,
@@ -575,6 +674,214 @@ _notmuch_database_ensure_writable (notmuch_database_t *notmuch)
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* The number of message IDs whose thread IDs are remembered by each
+ * database, (see _resolve_message_id_to_thread_id). */
+#define NOTMUCH_THREAD_ID_CACHE_SIZE 4096
+
+typedef struct _notmuch_thread_id_cache_entry {
+    char *message_id;
+    char *thread_id;
+
+    /* The document of the message, or 0 if the message isn't in the
+     * database, (and 'thread_id' was only reserved for it in the
+     * database metadata). */
+    Xapian::docid doc_id;
+
+    /* Neighbours in the list of all entries, most recently used
+     * first. */
+    struct _notmuch_thread_id_cache_entry *prev;
+    struct _notmuch_thread_id_cache_entry *next;
+
+    /* Neighbours in the list of entries with the same thread ID. */
+    struct _notmuch_thread_id_cache_entry *thread_prev;
+    struct _notmuch_thread_id_cache_entry *thread_next;
+} notmuch_thread_id_cache_entry_t;
+
+/* A cache of the thread IDs of recently seen message IDs.
+ *
+ * When adding many messages, (as notmuch new and imports do), the
+ * same few ancestors are referenced over and over again, and each
+ * reference would otherwise cost a database lookup to resolve. */
+struct _notmuch_thread_id_cache {
+    /* Maps a message ID to its notmuch_thread_id_cache_entry_t. */
+    GHashTable *entries;
+
+    /* Maps a thread ID to the first of its entries. */
+    GHashTable *threads;
+
+    /* The entries, from most to least recently used. */
+    notmuch_thread_id_cache_entry_t *head;
+    notmuch_thread_id_cache_entry_t *tail;
+};
+
+static int
+_notmuch_thread_id_cache_destructor (notmuch_thread_id_cache_t *cache)
+{
+    g_hash_table_unref (cache->entries);
+    g_hash_table_unref (cache->threads);
+
+    return 0;
+}
+
+/* Create an empty cache of thread IDs, with 'ctx' as its talloc
+ * owner.
+ *
+ * Returns NULL on out-of-memory. */
+static notmuch_thread_id_cache_t *
+_notmuch_thread_id_cache_create (void *ctx)
+{
+    notmuch_thread_id_cache_t *cache;
+
+    cache = talloc (ctx, notmuch_thread_id_cache_t);
+    if (unlikely (cache == NULL))
+	return NULL;
+
+    cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->threads = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->head = NULL;
+    cache->tail = NULL;
+
+    talloc_set_destructor (cache, _notmuch_thread_id_cache_destructor);
+
+    return cache;
+}
+
+static void
+_notmuch_thread_id_cache_remove (notmuch_thread_id_cache_t *cache,
+				 notmuch_thread_id_cache_entry_t *entry)
+{
+    if (entry->prev)
+	entry->prev->next = entry->next;
+    else
+	cache->head = entry->next;
+
+    if (entry->next)
+	entry->next->prev = entry->prev;
+    else
+	cache->tail = entry->prev;
+
+    if (entry->thread_next)
+	entry->thread_next->thread_prev = entry->thread_prev;
+
+    if (entry->thread_prev)
+	entry->thread_prev->thread_next = entry->thread_next;
+    else if (entry->thread_next)
+	g_hash_table_replace (cache->threads, entry->thread_next->thread_id,
+			      entry->thread_next);
+    else
+	g_hash_table_remove (cache->threads, entry->thread_id);
+
+    g_hash_table_remove (cache->entries, entry->message_id);
+
+    talloc_free (entry);
+}
+
+/* Return the cache entry for 'message_id', (marking it as the most
+ * recently used), or NULL if it's not in the cache. */
+static notmuch_thread_id_cache_entry_t *
+_notmuch_thread_id_cache_lookup (notmuch_thread_id_cache_t *cache,
+				 const char *message_id)
+{
+    notmuch_thread_id_cache_entry_t *entry;
+
+    if (cache == NULL)
+	return NULL;
+
+    entry = (notmuch_thread_id_cache_entry_t *)
+	g_hash_table_lookup (cache->entries, message_id);
+    if (entry == NULL || entry == cache->head)
+	return entry;
+
+    entry->prev->next = entry->next;
+    if (entry->next)
+	entry->next->prev = entry->prev;
+    else
+	cache->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = cache->head;
+    cache->head->prev = entry;
+    cache->head = entry;
+
+    return entry;
+}
+
+/* Remember that 'message_id' belongs to 'thread_id', (and is the
+ * message of document 'doc_id', or 0 if it isn't in the database),
+ * evicting the least recently used entry if the cache is full. */
+static void
+_notmuch_thread_id_cache_add (notmuch_thread_id_cache_t *cache,
+			      const char *message_id,
+			      const char *thread_id,
+			      Xapian::docid doc_id)
+{
+    notmuch_thread_id_cache_entry_t *entry, *first;
+
+    if (cache == NULL)
+	return;
+
+    entry = (notmuch_thread_id_cache_entry_t *)
+	g_hash_table_lookup (cache->entries, message_id);
+    if (entry)
+	_notmuch_thread_id_cache_remove (cache, entry);
+    else if (g_hash_table_size (cache->entries) >= NOTMUCH_THREAD_ID_CACHE_SIZE)
+	_notmuch_thread_id_cache_remove (cache, cache->tail);
+
+    entry = talloc (cache, notmuch_thread_id_cache_entry_t);
+    if (unlikely (entry == NULL))
+	return;
+
+    entry->message_id = talloc_strdup (entry, message_id);
+    entry->thread_id = talloc_strdup (entry, thread_id);
+    entry->doc_id = doc_id;
+
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+	cache->head->prev = entry;
+    else
+	cache->tail = entry;
+    cache->head = entry;
+
+    first = (notmuch_thread_id_cache_entry_t *)
+	g_hash_table_lookup (cache->threads, thread_id);
+    entry->thread_prev = NULL;
+    entry->thread_next = first;
+    if (first)
+	first->thread_prev = entry;
+    g_hash_table_replace (cache->threads, entry->thread_id, entry);
+
+    g_hash_table_insert (cache->entries, entry->message_id, entry);
+}
+
+/* Forget every message ID cached as belonging to 'thread_id', (as
+ * when the thread is merged into another). */
+static void
+_notmuch_thread_id_cache_forget_thread (notmuch_thread_id_cache_t *cache,
+					const char *thread_id)
+{
+    notmuch_thread_id_cache_entry_t *entry;
+
+    if (cache == NULL)
+	return;
+
+    while ((entry = (notmuch_thread_id_cache_entry_t *)
+	    g_hash_table_lookup (cache->threads, thread_id)))
+	_notmuch_thread_id_cache_remove (cache, entry);
+}
+
+void
+_notmuch_database_forget_message_id (notmuch_database_t *notmuch,
+				     const char *message_id)
+{
+    notmuch_thread_id_cache_entry_t *entry;
+
+    entry = _notmuch_thread_id_cache_lookup (notmuch->thread_id_cache,
+					     message_id);
+    if (entry)
+	_notmuch_thread_id_cache_remove (notmuch->thread_id_cache, entry);
+}
+
 notmuch_database_t *
 notmuch_database_open (const char *path,
 		       notmuch_database_mode_t mode)
@@ -614,6 +921,17 @@ notmuch_database_open (const char *path,
     notmuch->needs_upgrade = FALSE;
     notmuch->mode = mode;
     notmuch->atomic_nesting = 0;
+    notmuch->in_batch = FALSE;
+    notmuch->in_transaction = FALSE;
+    notmuch->index_max_part_bytes = 0;
+    notmuch->index_max_message_bytes = 0;
+    notmuch->thread_aliases = NULL;
+    notmuch->directory_listings = NULL;
+    notmuch->revision = 0;
+    notmuch->revision_range_processor = NULL;
+#if HAVE_XAPIAN_FIELD_PROCESSOR
+    notmuch->thread_field_processor = NULL;
+#endif
     try {
 	string last_thread_id;
 
@@ -621,6 +939,7 @@ notmuch_database_open (const char *path,
 	    notmuch->xapian_db = new Xapian::WritableDatabase (xapian_path,
 							       Xapian::DB_CREATE_OR_OPEN);
 	    version = notmuch_database_get_version (notmuch);
+	    notmuch->version = version;
 
 	    if (version > NOTMUCH_DATABASE_VERSION) {
 		fprintf (stderr,
@@ -640,6 +959,7 @@ notmuch_database_open (const char *path,
 	} else {
 	    notmuch->xapian_db = new Xapian::Database (xapian_path);
 	    version = notmuch_database_get_version (notmuch);
+	    notmuch->version = version;
 	    if (version > NOTMUCH_DATABASE_VERSION)
 	    {
 		fprintf (stderr,
@@ -653,6 +973,8 @@ notmuch_database_open (const char *path,
 	}
 
 	notmuch->last_doc_id = notmuch->xapian_db->get_lastdocid ();
+	notmuch->revision = strtoul (notmuch->xapian_db->get_metadata ("revision").c_str (),
+				     NULL, 10);
 	last_thread_id = notmuch->xapian_db->get_metadata ("last_thread_id");
 	if (last_thread_id.empty ()) {
 	    notmuch->last_thread_id = 0;
@@ -670,15 +992,27 @@ notmuch_database_open (const char *path,
 	notmuch->term_gen = new Xapian::TermGenerator;
 	notmuch->term_gen->set_stemmer (Xapian::Stem ("english"));
 	notmuch->value_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_TIMESTAMP);
+	notmuch->revision_range_processor = new Xapian::NumberValueRangeProcessor (NOTMUCH_VALUE_REVISION, "lastmod:");
+#if HAVE_XAPIAN_FIELD_PROCESSOR
+	notmuch->thread_field_processor = new ThreadFieldProcessor (notmuch);
+#endif
 
 	notmuch->query_parser->set_default_op (Xapian::Query::OP_AND);
 	notmuch->query_parser->set_database (*notmuch->xapian_db);
 	notmuch->query_parser->set_stemmer (Xapian::Stem ("english"));
 	notmuch->query_parser->set_stemming_strategy (Xapian::QueryParser::STEM_SOME);
+	notmuch->query_parser->add_valuerangeprocessor (notmuch->revision_range_processor);
 	notmuch->query_parser->add_valuerangeprocessor (notmuch->value_range_processor);
 
 	for (i = 0; i < ARRAY_SIZE (BOOLEAN_PREFIX_EXTERNAL); i++) {
 	    prefix_t *prefix = &BOOLEAN_PREFIX_EXTERNAL[i];
+#if HAVE_XAPIAN_FIELD_PROCESSOR
+	    if (strcmp (prefix->name, "thread") == 0) {
+		notmuch->query_parser->add_boolean_prefix (
+		    prefix->name, notmuch->thread_field_processor);
+		continue;
+	    }
+#endif
 	    notmuch->query_parser->add_boolean_prefix (prefix->name,
 						       prefix->prefix);
 	}
@@ -687,6 +1021,12 @@ notmuch_database_open (const char *path,
 	    prefix_t *prefix = &PROBABILISTIC_PREFIX[i];
 	    notmuch->query_parser->add_prefix (prefix->name, prefix->prefix);
 	}
+
+	notmuch->query_cache = _notmuch_query_cache_create (notmuch);
+	notmuch->thread_id_cache = _notmuch_thread_id_cache_create (notmuch);
+	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+	    notmuch->directory_listings =
+		_notmuch_directory_listings_create (notmuch);
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred opening database: %s\n",
 		 error.get_msg().c_str());
@@ -705,6 +1045,9 @@ notmuch_database_open (const char *path,
 void
 notmuch_database_close (notmuch_database_t *notmuch)
 {
+    /* Whatever a batch has collected so far is complete. */
+    notmuch_database_end_batch (notmuch);
+
     try {
 	if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
 	    (static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))->flush ();
@@ -719,9 +1062,78 @@ notmuch_database_close (notmuch_database_t *notmuch)
     delete notmuch->query_parser;
     delete notmuch->xapian_db;
     delete notmuch->value_range_processor;
+    delete notmuch->revision_range_processor;
+#if HAVE_XAPIAN_FIELD_PROCESSOR
+    delete notmuch->thread_field_processor;
+#endif
     talloc_free (notmuch);
 }
 
+static int
+_notmuch_database_reader_destructor (notmuch_database_t *reader)
+{
+    delete reader->xapian_db;
+
+    return 0;
+}
+
+/* Open an additional, read-only handle onto the same database as
+ * 'notmuch', for use from a different thread of execution, (a
+ * Xapian::Database object must never be used by two threads at
+ * once).
+ *
+ * The reader supports finding documents and reading messages, but has
+ * no query parser. It is closed when 'ctx' is freed.
+ *
+ * Returns NULL on error.
+ */
+notmuch_database_t *
+_notmuch_database_open_reader (void *ctx, notmuch_database_t *notmuch)
+{
+    notmuch_database_t *reader;
+    char *xapian_path;
+
+    reader = talloc_zero (ctx, notmuch_database_t);
+    if (unlikely (reader == NULL))
+	return NULL;
+
+    reader->path = talloc_strdup (reader, notmuch->path);
+    reader->version = notmuch->version;
+    reader->mode = NOTMUCH_DATABASE_MODE_READ_ONLY;
+    reader->last_doc_id = notmuch->last_doc_id;
+    reader->last_thread_id = notmuch->last_thread_id;
+    reader->index_max_part_bytes = notmuch->index_max_part_bytes;
+    reader->index_max_message_bytes = notmuch->index_max_message_bytes;
+
+    xapian_path = talloc_asprintf (reader, "%s/.notmuch/xapian",
+				   notmuch->path);
+
+    try {
+	reader->xapian_db = new Xapian::Database (xapian_path);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred opening database: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (reader);
+	return NULL;
+    }
+
+    talloc_set_destructor (reader, _notmuch_database_reader_destructor);
+
+    talloc_free (xapian_path);
+
+    return reader;
+}
+
+void
+notmuch_database_set_index_limits (notmuch_database_t *notmuch,
+				   size_t max_part_bytes,
+				   size_t max_message_bytes)
+{
+    notmuch->index_max_part_bytes = max_part_bytes;
+    notmuch->index_max_message_bytes = max_message_bytes;
+}
+
 const char *
 notmuch_database_get_path (notmuch_database_t *notmuch)
 {
@@ -751,6 +1163,31 @@ notmuch_database_get_version (notmuch_database_t *notmuch)
     return version;
 }
 
+unsigned long
+notmuch_database_get_revision (notmuch_database_t *notmuch)
+{
+    return notmuch->revision;
+}
+
+/* Take the next revision for a change to the tags of a message, (see
+ * the REVISION value in the schema above). */
+unsigned long
+_notmuch_database_next_revision (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+    char revision[32];
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    notmuch->revision++;
+
+    snprintf (revision, sizeof (revision), "%lu", notmuch->revision);
+
+    db->set_metadata ("revision", revision);
+
+    return notmuch->revision;
+}
+
 notmuch_bool_t
 notmuch_database_needs_upgrade (notmuch_database_t *notmuch)
 {
@@ -898,8 +1335,105 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	}
     }
 
+    /* Before version 2, the From, Subject and Date headers were only
+     * available by opening the message file. Copy them into document
+     * values so that notmuch_message_get_header can answer from the
+     * database.
+     */
+    if (version < 2) {
+	notmuch_query_t *query = notmuch_query_create (notmuch, "");
+	notmuch_messages_t *messages;
+	notmuch_message_t *message;
+	notmuch_message_file_t *message_file;
+	const char *filename;
+
+	count = 0;
+	total = notmuch_query_count_messages (query);
+
+	for (messages = notmuch_query_search_messages (query);
+	     notmuch_messages_valid (messages);
+	     notmuch_messages_move_to_next (messages))
+	{
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    message = notmuch_messages_get (messages);
+
+	    filename = notmuch_message_get_filename (message);
+	    message_file = NULL;
+	    if (filename)
+		message_file = notmuch_message_file_open (filename);
+	    if (message_file) {
+		notmuch_message_file_restrict_headers (message_file,
+						       "date",
+						       "from",
+						       "subject",
+						       (char *) NULL);
+		_notmuch_message_set_header_values (
+		    message,
+		    notmuch_message_file_get_header (message_file, "date"),
+		    notmuch_message_file_get_header (message_file, "from"),
+		    notmuch_message_file_get_header (message_file, "subject"));
+		_notmuch_message_sync (message);
+		notmuch_message_file_close (message_file);
+	    }
+
+	    notmuch_message_destroy (message);
+
+	    count++;
+	}
+
+	notmuch_query_destroy (query);
+    }
+
+    /* Before version 3, the thread ID was only available as a term.
+     * Copy it into the THREAD_ID value of each message. */
+    if (version < 3) {
+	notmuch_query_t *query = notmuch_query_create (notmuch, "");
+	const char *prefix = _find_prefix ("thread");
+	Xapian::TermIterator t, t_end;
+
+	count = 0;
+	total = notmuch_query_count_messages (query);
+	notmuch_query_destroy (query);
+
+	t_end = notmuch->xapian_db->allterms_end (prefix);
+
+	for (t = notmuch->xapian_db->allterms_begin (prefix);
+	     t != t_end;
+	     t++)
+	{
+	    Xapian::PostingIterator p, p_end;
+	    std::string term = *t;
+
+	    p_end = notmuch->xapian_db->postlist_end (term);
+
+	    for (p = notmuch->xapian_db->postlist_begin (term);
+		 p != p_end;
+		 p++)
+	    {
+		Xapian::Document document;
+
+		if (do_progress_notify) {
+		    progress_notify (closure, (double) count / total);
+		    do_progress_notify = 0;
+		}
+
+		document = find_document_for_doc_id (notmuch, *p);
+		document.add_value (NOTMUCH_VALUE_THREAD_ID,
+				    term.substr (strlen (prefix)));
+		db->replace_document (*p, document);
+
+		count++;
+	    }
+	}
+    }
+
     db->set_metadata ("version", STRINGIFY (NOTMUCH_DATABASE_VERSION));
     db->flush ();
+    notmuch->version = NOTMUCH_DATABASE_VERSION;
 
     /* Now that the upgrade is complete we can remove the old data
      * and documents that are no longer needed. */
@@ -977,15 +1511,14 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
-notmuch_status_t
-notmuch_database_begin_atomic (notmuch_database_t *notmuch)
+static notmuch_status_t
+_notmuch_database_begin_transaction (notmuch_database_t *notmuch)
 {
-    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY ||
-	notmuch->atomic_nesting > 0)
-	goto DONE;
-
     try {
-	(static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))->begin_transaction (false);
+	/* A batch is committed to disk at its end, while a lone
+	 * atomic section is left for Xapian to flush when it sees
+	 * fit. */
+	(static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))->begin_transaction (notmuch->in_batch);
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred beginning transaction: %s.\n",
 		 error.get_msg().c_str());
@@ -993,23 +1526,19 @@ notmuch_database_begin_atomic (notmuch_database_t *notmuch)
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
-DONE:
-    notmuch->atomic_nesting++;
+    notmuch->in_transaction = TRUE;
+    notmuch->batch_messages = 0;
+    notmuch->batch_bytes = 0;
+    notmuch->batch_start = time (NULL);
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
-notmuch_status_t
-notmuch_database_end_atomic (notmuch_database_t *notmuch)
+static notmuch_status_t
+_notmuch_database_commit_transaction (notmuch_database_t *notmuch)
 {
     Xapian::WritableDatabase *db;
 
-    if (notmuch->atomic_nesting == 0)
-	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
-
-    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY ||
-	notmuch->atomic_nesting > 1)
-	goto DONE;
-
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
     try {
 	db->commit_transaction ();
@@ -1018,7 +1547,7 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
 	 * non-flushed commit, even if the flush threshold is 1.
 	 * However, we rely on flushing to test atomicity. */
 	const char *thresh = getenv ("XAPIAN_FLUSH_THRESHOLD");
-	if (thresh && atoi (thresh) == 1)
+	if (thresh && atoi (thresh) == 1 && ! notmuch->in_batch)
 	    db->commit ();
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred committing transaction: %s.\n",
@@ -1027,46 +1556,170 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
-DONE:
-    notmuch->atomic_nesting--;
+    notmuch->in_transaction = FALSE;
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
-/* We allow the user to use arbitrarily long paths for directories. But
- * we have a term-length limit. So if we exceed that, we'll use the
- * SHA-1 of the path for the database term.
- *
- * Note: This function may return the original value of 'path'. If it
- * does not, then the caller is responsible to free() the returned
- * value.
- */
-const char *
-_notmuch_database_get_directory_db_path (const char *path)
+/* Whether the open batch has reached one of its limits, (as does
+ * every atomic section when testing with XAPIAN_FLUSH_THRESHOLD=1,
+ * so that test/atomicity still sees a commit after each one). */
+static notmuch_bool_t
+_notmuch_database_batch_is_full (notmuch_database_t *notmuch)
 {
-    int term_len = strlen (_find_prefix ("directory")) + strlen (path);
+    const char *thresh;
 
-    if (term_len > NOTMUCH_TERM_MAX)
-	return notmuch_sha1_of_string (path);
-    else
-	return path;
+    if (notmuch->batch_max_messages &&
+	notmuch->batch_messages >= notmuch->batch_max_messages)
+	return TRUE;
+
+    if (notmuch->batch_max_bytes &&
+	notmuch->batch_bytes >= notmuch->batch_max_bytes)
+	return TRUE;
+
+    if (notmuch->batch_max_seconds &&
+	time (NULL) - notmuch->batch_start >=
+	(time_t) notmuch->batch_max_seconds)
+	return TRUE;
+
+    thresh = getenv ("XAPIAN_FLUSH_THRESHOLD");
+    if (thresh && atoi (thresh) == 1)
+	return TRUE;
+
+    return FALSE;
 }
 
-/* Given a path, split it into two parts: the directory part is all
- * components except for the last, and the basename is that last
- * component. Getting the return-value for either part is optional
- * (the caller can pass NULL).
- *
- * The original 'path' can represent either a regular file or a
- * directory---the splitting will be carried out in the same way in
- * either case. Trailing slashes on 'path' will be ignored, and any
- * cases of multiple '/' characters appearing in series will be
- * treated as a single '/'.
- *
- * Allocation (if any) will have 'ctx' as the talloc owner. But
- * pointers will be returned within the original path string whenever
- * possible.
- *
- * Note: If 'path' is non-empty and contains no non-trailing slash,
+notmuch_status_t
+notmuch_database_begin_atomic (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status;
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY ||
+	notmuch->atomic_nesting > 0 ||
+	notmuch->in_transaction)
+	goto DONE;
+
+    status = _notmuch_database_begin_transaction (notmuch);
+    if (status)
+	return status;
+
+DONE:
+    notmuch->atomic_nesting++;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_end_atomic (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status;
+
+    if (notmuch->atomic_nesting == 0)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY ||
+	notmuch->atomic_nesting > 1)
+	goto DONE;
+
+    if (notmuch->in_batch) {
+	notmuch->batch_messages++;
+	if (! _notmuch_database_batch_is_full (notmuch))
+	    goto DONE;
+    }
+
+    status = _notmuch_database_commit_transaction (notmuch);
+    if (status)
+	return status;
+
+DONE:
+    notmuch->atomic_nesting--;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_begin_batch (notmuch_database_t *notmuch,
+			      unsigned int max_messages,
+			      size_t max_bytes,
+			      unsigned int max_seconds)
+{
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    notmuch->in_batch = TRUE;
+    notmuch->batch_max_messages = max_messages;
+    notmuch->batch_max_bytes = max_bytes;
+    notmuch->batch_max_seconds = max_seconds;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_end_batch (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status;
+
+    if (! notmuch->in_batch)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    if (notmuch->atomic_nesting > 0)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    /* The listings of the directories whose files changed during the
+     * batch are only written now, (see _notmuch_directory_files_get),
+     * together with the last of the changes. */
+    if (! notmuch->in_transaction) {
+	status = _notmuch_database_begin_transaction (notmuch);
+	if (status)
+	    return status;
+    }
+
+    status = _notmuch_database_write_directory_files (notmuch);
+    if (status)
+	return status;
+
+    status = _notmuch_database_commit_transaction (notmuch);
+    if (status)
+	return status;
+
+    notmuch->in_batch = FALSE;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* We allow the user to use arbitrarily long paths for directories. But
+ * we have a term-length limit. So if we exceed that, we'll use the
+ * SHA-1 of the path for the database term.
+ *
+ * Note: This function may return the original value of 'path'. If it
+ * does not, then the caller is responsible to free() the returned
+ * value.
+ */
+const char *
+_notmuch_database_get_directory_db_path (const char *path)
+{
+    int term_len = strlen (_find_prefix ("directory")) + strlen (path);
+
+    if (term_len > NOTMUCH_TERM_MAX)
+	return notmuch_sha1_of_string (path);
+    else
+	return path;
+}
+
+/* Given a path, split it into two parts: the directory part is all
+ * components except for the last, and the basename is that last
+ * component. Getting the return-value for either part is optional
+ * (the caller can pass NULL).
+ *
+ * The original 'path' can represent either a regular file or a
+ * directory---the splitting will be carried out in the same way in
+ * either case. Trailing slashes on 'path' will be ignored, and any
+ * cases of multiple '/' characters appearing in series will be
+ * treated as a single '/'.
+ *
+ * Allocation (if any) will have 'ctx' as the talloc owner. But
+ * pointers will be returned within the original path string whenever
+ * possible.
+ *
+ * Note: If 'path' is non-empty and contains no non-trailing slash,
  * (that is, consists of a filename with no parent directory), then
  * the directory returned will be an empty string. However, if 'path'
  * is an empty string, then both directory and basename will be
@@ -1172,31 +1825,49 @@ _notmuch_database_get_directory_path (void *ctx,
 
 /* Given a legal 'filename' for the database, (either relative to
  * database path or absolute with initial components identical to
- * database path), return a new string (with 'ctx' as the talloc
- * owner) suitable for use as a direntry term value.
+ * database path), find the document ID of its directory and its
+ * basename, (a new string with 'ctx' as the talloc owner).
  *
  * The necessary directory documents will be created in the database
  * as needed.
  */
 notmuch_status_t
-_notmuch_database_filename_to_direntry (void *ctx,
-					notmuch_database_t *notmuch,
-					const char *filename,
-					char **direntry)
+_notmuch_database_split_filename (void *ctx,
+				  notmuch_database_t *notmuch,
+				  const char *filename,
+				  unsigned int *directory_id,
+				  const char **basename)
 {
-    const char *relative, *directory, *basename;
-    Xapian::docid directory_id;
+    const char *relative, *directory;
     notmuch_status_t status;
 
     relative = _notmuch_database_relative_path (notmuch, filename);
 
     status = _notmuch_database_split_path (ctx, relative,
-					   &directory, &basename);
+					   &directory, basename);
     if (status)
 	return status;
 
-    status = _notmuch_database_find_directory_id (notmuch, directory,
-						  &directory_id);
+    return _notmuch_database_find_directory_id (notmuch, directory,
+						directory_id);
+}
+
+/* Given a legal 'filename' for the database, return a new string
+ * (with 'ctx' as the talloc owner) suitable for use as a direntry
+ * term value, (see _notmuch_database_split_filename).
+ */
+notmuch_status_t
+_notmuch_database_filename_to_direntry (void *ctx,
+					notmuch_database_t *notmuch,
+					const char *filename,
+					char **direntry)
+{
+    const char *basename;
+    unsigned int directory_id;
+    notmuch_status_t status;
+
+    status = _notmuch_database_split_filename (ctx, notmuch, filename,
+					       &directory_id, &basename);
     if (status)
 	return status;
 
@@ -1325,16 +1996,26 @@ _resolve_message_id_to_thread_id (notmuch_database_t *notmuch,
 				  const char *message_id)
 {
     notmuch_message_t *message;
+    notmuch_thread_id_cache_entry_t *entry;
     string thread_id_string;
     const char *thread_id;
     char *metadata_key;
     Xapian::WritableDatabase *db;
 
+    entry = _notmuch_thread_id_cache_lookup (notmuch->thread_id_cache,
+					     message_id);
+    if (entry)
+	return talloc_strdup (ctx, entry->thread_id);
+
     message = notmuch_database_find_message (notmuch, message_id);
 
     if (message) {
 	thread_id = talloc_steal (ctx, notmuch_message_get_thread_id (message));
 
+	_notmuch_thread_id_cache_add (notmuch->thread_id_cache, message_id,
+				      thread_id,
+				      _notmuch_message_get_doc_id (message));
+
 	notmuch_message_destroy (message);
 
 	return thread_id;
@@ -1354,23 +2035,232 @@ _resolve_message_id_to_thread_id (notmuch_database_t *notmuch,
 	thread_id = _notmuch_database_generate_thread_id (notmuch);
 	db->set_metadata (metadata_key, thread_id);
     } else {
-	thread_id = thread_id_string.c_str();
+	thread_id = _notmuch_database_resolve_thread_id (
+	    notmuch, thread_id_string.c_str());
     }
 
+    _notmuch_thread_id_cache_add (notmuch->thread_id_cache, message_id,
+				  thread_id, 0);
+
     talloc_free (metadata_key);
 
     return talloc_strdup (ctx, thread_id);
 }
 
+/* The thread merges recorded in the database metadata, (see
+ * "thread_alias_*" above), as loaded on first use. */
+struct _notmuch_thread_aliases {
+    /* Maps the ID of each merged thread to the thread ID it was
+     * merged into. */
+    GHashTable *parents;
+
+    /* Maps the ID of each thread that others were merged into, (and
+     * which wasn't merged away itself), to a GPtrArray of the IDs of
+     * all of those threads. */
+    GHashTable *members;
+};
+
+static int
+_notmuch_thread_aliases_destructor (notmuch_thread_aliases_t *aliases)
+{
+    g_hash_table_unref (aliases->parents);
+    g_hash_table_unref (aliases->members);
+
+    return 0;
+}
+
+static void
+_free_ptr_array_for_g_hash (void *ptr)
+{
+    g_ptr_array_free ((GPtrArray *) ptr, TRUE);
+}
+
+/* Follow the aliases of 'thread_id' to the thread it was finally
+ * merged into.
+ *
+ * We stop after as many steps as there are aliases, so that a cycle
+ * in corrupted metadata can't hang us. */
+static const char *
+_notmuch_thread_aliases_resolve (notmuch_thread_aliases_t *aliases,
+				 const char *thread_id)
+{
+    unsigned int steps = g_hash_table_size (aliases->parents);
+    const char *parent;
+
+    while (steps-- &&
+	   (parent = (const char *) g_hash_table_lookup (aliases->parents,
+							  thread_id)))
+	thread_id = parent;
+
+    return thread_id;
+}
+
+/* Add 'thread_id', (with the threads merged into it), to the members
+ * of the thread 'root_thread_id'. Both must be owned by 'aliases'. */
+static void
+_notmuch_thread_aliases_add_member (notmuch_thread_aliases_t *aliases,
+				    const char *root_thread_id,
+				    const char *thread_id)
+{
+    GPtrArray *members, *merged;
+    unsigned int i;
+
+    members = (GPtrArray *) g_hash_table_lookup (aliases->members,
+						 root_thread_id);
+    if (members == NULL) {
+	members = g_ptr_array_new ();
+	g_hash_table_insert (aliases->members, (char *) root_thread_id,
+			     members);
+    }
+
+    g_ptr_array_add (members, (char *) thread_id);
+
+    merged = (GPtrArray *) g_hash_table_lookup (aliases->members, thread_id);
+    if (merged) {
+	for (i = 0; i < merged->len; i++)
+	    g_ptr_array_add (members, g_ptr_array_index (merged, i));
+	g_hash_table_remove (aliases->members, thread_id);
+    }
+}
+
+/* Return the thread merges of 'notmuch', loading them from the
+ * database metadata on first use.
+ *
+ * Returns NULL on out-of-memory. */
+static notmuch_thread_aliases_t *
+_notmuch_database_get_thread_aliases (notmuch_database_t *notmuch)
+{
+    const char *prefix = NOTMUCH_METADATA_THREAD_ALIAS_PREFIX;
+    notmuch_thread_aliases_t *aliases;
+    Xapian::TermIterator i, end;
+    GList *l, *keys;
+
+    if (notmuch->thread_aliases)
+	return notmuch->thread_aliases;
+
+    aliases = talloc (notmuch, notmuch_thread_aliases_t);
+    if (unlikely (aliases == NULL))
+	return NULL;
+
+    aliases->parents = g_hash_table_new (g_str_hash, g_str_equal);
+    aliases->members = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      NULL,
+					      _free_ptr_array_for_g_hash);
+    talloc_set_destructor (aliases, _notmuch_thread_aliases_destructor);
+
+    try {
+	end = notmuch->xapian_db->metadata_keys_end (prefix);
+
+	for (i = notmuch->xapian_db->metadata_keys_begin (prefix);
+	     i != end;
+	     i++)
+	{
+	    std::string thread_id = notmuch->xapian_db->get_metadata (*i);
+
+	    if (thread_id.empty ())
+		continue;
+
+	    g_hash_table_insert (aliases->parents,
+				 talloc_strdup (aliases,
+						(*i).c_str () + strlen (prefix)),
+				 talloc_strdup (aliases, thread_id.c_str ()));
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading thread aliases: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+    }
+
+    /* The keys come in no useful order, so we can only gather the
+     * members of each thread once all aliases are known. */
+    keys = g_hash_table_get_keys (aliases->parents);
+    for (l = keys; l; l = l->next) {
+	const char *thread_id = (const char *) l->data;
+
+	_notmuch_thread_aliases_add_member (
+	    aliases, _notmuch_thread_aliases_resolve (aliases, thread_id),
+	    thread_id);
+    }
+    g_list_free (keys);
+
+    notmuch->thread_aliases = aliases;
+
+    return aliases;
+}
+
+const char *
+_notmuch_database_resolve_thread_id (notmuch_database_t *notmuch,
+				     const char *thread_id)
+{
+    notmuch_thread_aliases_t *aliases;
+
+    aliases = _notmuch_database_get_thread_aliases (notmuch);
+    if (unlikely (aliases == NULL))
+	return thread_id;
+
+    return _notmuch_thread_aliases_resolve (aliases, thread_id);
+}
+
+notmuch_bool_t
+_notmuch_database_thread_is_merged (notmuch_database_t *notmuch,
+				    const char *thread_id)
+{
+    notmuch_thread_aliases_t *aliases;
+
+    aliases = _notmuch_database_get_thread_aliases (notmuch);
+    if (unlikely (aliases == NULL))
+	return FALSE;
+
+    return (g_hash_table_lookup (aliases->parents, thread_id) != NULL ||
+	    g_hash_table_lookup (aliases->members, thread_id) != NULL);
+}
+
+void
+_notmuch_database_get_thread_terms (notmuch_database_t *notmuch,
+				    const char *thread_id,
+				    std::vector<std::string> &terms)
+{
+    const char *prefix = _find_prefix ("thread");
+    notmuch_thread_aliases_t *aliases;
+    GPtrArray *members = NULL;
+    unsigned int i;
+
+    aliases = _notmuch_database_get_thread_aliases (notmuch);
+    if (aliases) {
+	thread_id = _notmuch_thread_aliases_resolve (aliases, thread_id);
+	members = (GPtrArray *) g_hash_table_lookup (aliases->members,
+						     thread_id);
+    }
+
+    terms.push_back (std::string (prefix) + thread_id);
+
+    if (members) {
+	for (i = 0; i < members->len; i++)
+	    terms.push_back (std::string (prefix) +
+			     (const char *) g_ptr_array_index (members, i));
+    }
+}
+
+static char *
+_get_metadata_thread_alias_key (void *ctx, const char *thread_id)
+{
+    return talloc_asprintf (ctx, NOTMUCH_METADATA_THREAD_ALIAS_PREFIX "%s",
+			    thread_id);
+}
+
+/* Move each message of the thread 'loser_thread_id' into the thread
+ * 'winner_thread_id', and drop the alias of the former. */
 static notmuch_status_t
-_merge_threads (notmuch_database_t *notmuch,
-		const char *winner_thread_id,
-		const char *loser_thread_id)
+_notmuch_database_compact_thread (notmuch_database_t *notmuch,
+				  const char *winner_thread_id,
+				  const char *loser_thread_id)
 {
+    Xapian::WritableDatabase *db;
     Xapian::PostingIterator loser, loser_end;
     notmuch_message_t *message = NULL;
     notmuch_private_status_t private_status;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+    char *metadata_key;
 
     find_doc_ids (notmuch, "thread", loser_thread_id, &loser, &loser_end);
 
@@ -1391,6 +2281,11 @@ _merge_threads (notmuch_database_t *notmuch,
 	message = NULL;
     }
 
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    metadata_key = _get_metadata_thread_alias_key (notmuch, loser_thread_id);
+    db->set_metadata (metadata_key, "");
+    talloc_free (metadata_key);
+
   DONE:
     if (message)
 	notmuch_message_destroy (message);
@@ -1398,6 +2293,145 @@ _merge_threads (notmuch_database_t *notmuch,
     return ret;
 }
 
+/* Merge the thread 'loser_thread_id' into 'winner_thread_id'.
+ *
+ * Rather than moving each message of the losing thread, (which can
+ * be thousands of documents for a long mailing-list thread), we
+ * record an alias, (see "thread_alias_*" above), so the time taken
+ * doesn't depend on the size of either thread. The messages are
+ * moved later, by notmuch_database_compact_threads, (or at once,
+ * without Xapian field processors to expand the thread terms of
+ * searches). */
+static notmuch_status_t
+_merge_threads (notmuch_database_t *notmuch,
+		const char *winner_thread_id,
+		const char *loser_thread_id)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_thread_aliases_t *aliases;
+    char *metadata_key;
+
+    aliases = _notmuch_database_get_thread_aliases (notmuch);
+    if (unlikely (aliases == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    winner_thread_id = _notmuch_thread_aliases_resolve (aliases,
+							winner_thread_id);
+    loser_thread_id = _notmuch_thread_aliases_resolve (aliases,
+						       loser_thread_id);
+    if (strcmp (winner_thread_id, loser_thread_id) == 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    _notmuch_thread_id_cache_forget_thread (notmuch->thread_id_cache,
+					    loser_thread_id);
+
+#if ! HAVE_XAPIAN_FIELD_PROCESSOR
+    return _notmuch_database_compact_thread (notmuch, winner_thread_id,
+					     loser_thread_id);
+#endif
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    metadata_key = _get_metadata_thread_alias_key (notmuch, loser_thread_id);
+    db->set_metadata (metadata_key, winner_thread_id);
+    talloc_free (metadata_key);
+
+    /* Parsed queries with a term of either thread are now out of
+     * date, (see ThreadFieldProcessor). */
+    if (notmuch->query_cache)
+	_notmuch_query_cache_clear (notmuch->query_cache);
+
+    winner_thread_id = talloc_strdup (aliases, winner_thread_id);
+    loser_thread_id = talloc_strdup (aliases, loser_thread_id);
+
+    g_hash_table_insert (aliases->parents, (char *) loser_thread_id,
+			 (char *) winner_thread_id);
+    _notmuch_thread_aliases_add_member (aliases, winner_thread_id,
+					loser_thread_id);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_compact_threads (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_thread_aliases_t *aliases;
+    notmuch_status_t ret, ret2;
+    GList *l, *keys = NULL;
+    char *metadata_key;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    aliases = _notmuch_database_get_thread_aliases (notmuch);
+    if (unlikely (aliases == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    keys = g_hash_table_get_keys (aliases->parents);
+
+    /* First point each alias straight at its final thread, so that
+     * any one of them can then be dropped without breaking the chain
+     * of another. */
+    ret = notmuch_database_begin_atomic (notmuch);
+    if (ret)
+	goto DONE;
+
+    try {
+	for (l = keys; l; l = l->next) {
+	    const char *thread_id = (const char *) l->data;
+
+	    metadata_key = _get_metadata_thread_alias_key (notmuch, thread_id);
+	    db->set_metadata (metadata_key,
+			      _notmuch_thread_aliases_resolve (aliases,
+							       thread_id));
+	    talloc_free (metadata_key);
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred compacting threads: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    ret2 = notmuch_database_end_atomic (notmuch);
+    if (ret == NOTMUCH_STATUS_SUCCESS)
+	ret = ret2;
+
+    for (l = keys; l && ret == NOTMUCH_STATUS_SUCCESS; l = l->next) {
+	const char *thread_id = (const char *) l->data;
+
+	ret = notmuch_database_begin_atomic (notmuch);
+	if (ret)
+	    break;
+
+	try {
+	    ret = _notmuch_database_compact_thread (
+		notmuch, _notmuch_thread_aliases_resolve (aliases, thread_id),
+		thread_id);
+	} catch (const Xapian::Error &error) {
+	    fprintf (stderr, "A Xapian exception occurred compacting threads: %s.\n",
+		     error.get_msg().c_str());
+	    notmuch->exception_reported = TRUE;
+	    ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	}
+
+	ret2 = notmuch_database_end_atomic (notmuch);
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = ret2;
+    }
+
+  DONE:
+    g_list_free (keys);
+
+    /* Whatever remains is read back on next use. */
+    talloc_free (notmuch->thread_aliases);
+    notmuch->thread_aliases = NULL;
+
+    return ret;
+}
+
 static void
 _my_talloc_free_for_g_hash (void *ptr)
 {
@@ -1548,6 +2582,7 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
 				notmuch_message_file_t *message_file)
 {
     notmuch_status_t status;
+    notmuch_thread_id_cache_entry_t *entry;
     const char *message_id, *thread_id = NULL;
     char *metadata_key;
     string stored_id;
@@ -1558,7 +2593,12 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
     /* Check if we have already seen related messages to this one.
      * If we have then use the thread_id that we stored at that time.
      */
-    stored_id = notmuch->xapian_db->get_metadata (metadata_key);
+    entry = _notmuch_thread_id_cache_lookup (notmuch->thread_id_cache,
+					     message_id);
+    if (entry && entry->doc_id == 0)
+	stored_id = entry->thread_id;
+    else
+	stored_id = notmuch->xapian_db->get_metadata (metadata_key);
     if (! stored_id.empty()) {
         Xapian::WritableDatabase *db;
 
@@ -1567,7 +2607,8 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
 	/* Clear the metadata for this message ID. We don't need it
 	 * anymore. */
         db->set_metadata (metadata_key, "");
-        thread_id = stored_id.c_str();
+        thread_id = _notmuch_database_resolve_thread_id (notmuch,
+							 stored_id.c_str());
 
         _notmuch_message_add_term (message, "thread", thread_id);
     }
@@ -1591,39 +2632,84 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
 	_notmuch_message_add_term (message, "thread", thread_id);
     }
 
+    /* Later messages of the same thread are likely to refer to this
+     * one. */
+    _notmuch_thread_id_cache_add (notmuch->thread_id_cache, message_id,
+				  thread_id,
+				  _notmuch_message_get_doc_id (message));
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
-notmuch_status_t
-notmuch_database_add_message (notmuch_database_t *notmuch,
-			      const char *filename,
-			      notmuch_message_t **message_ret)
-{
+/* A file read by _notmuch_indexed_file_read, (and perhaps indexed
+ * by notmuch_indexer_index_file), waiting to be added to the
+ * database.
+ *
+ * The object itself is always allocated by the thread that owns the
+ * database, (see notmuch_indexed_file_create), and everything an
+ * indexer allocates hangs off it. An indexer thread never allocates
+ * or frees a chunk without a talloc parent, as those are all linked
+ * into talloc's single NULL context once notmuch enables null
+ * tracking, and talloc has no locking. */
+struct visible _notmuch_indexed_file {
+    char *filename;
     notmuch_message_file_t *message_file;
-    notmuch_message_t *message = NULL;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS, ret2;
-    notmuch_private_status_t private_status;
+    char *message_id;
+    const char *date, *from, *subject;
+    size_t size;
 
-    const char *date, *header;
-    const char *from, *to, *subject;
-    char *message_id = NULL;
+    /* The message with its contents indexed, but not yet in the
+     * database, (or NULL if the contents still need indexing). */
+    notmuch_message_t *message;
+};
 
-    if (message_ret)
-	*message_ret = NULL;
+struct _notmuch_indexer {
+    notmuch_database_t *reader;
+    Xapian::TermGenerator *term_gen;
+};
 
-    ret = _notmuch_database_ensure_writable (notmuch);
-    if (ret)
-	return ret;
+notmuch_indexed_file_t *
+notmuch_indexed_file_create (const char *filename)
+{
+    notmuch_indexed_file_t *indexed;
+
+    indexed = talloc (NULL, notmuch_indexed_file_t);
+    if (unlikely (indexed == NULL))
+	return NULL;
+
+    indexed->filename = talloc_strdup (indexed, filename);
+    if (unlikely (indexed->filename == NULL)) {
+	talloc_free (indexed);
+	return NULL;
+    }
+
+    indexed->message_file = NULL;
+    indexed->message_id = NULL;
+    indexed->date = NULL;
+    indexed->from = NULL;
+    indexed->subject = NULL;
+    indexed->size = 0;
+    indexed->message = NULL;
 
-    message_file = notmuch_message_file_open (filename);
+    return indexed;
+}
+
+/* Read the headers of the message file of 'indexed' and determine
+ * its message ID. Nothing in the database is touched, and everything
+ * allocated is owned by 'indexed'. */
+static notmuch_status_t
+_notmuch_indexed_file_read (notmuch_indexed_file_t *indexed)
+{
+    notmuch_message_file_t *message_file;
+    const char *header, *to;
+    char *message_id = NULL;
+
+    message_file = _notmuch_message_file_open_ctx (indexed, indexed->filename);
     if (message_file == NULL)
 	return NOTMUCH_STATUS_FILE_ERROR;
+    indexed->message_file = message_file;
 
-    /* Adding a message may change many documents.  Do this all
-     * atomically. */
-    ret = notmuch_database_begin_atomic (notmuch);
-    if (ret)
-	goto DONE;
+    _notmuch_message_file_get_contents (message_file, &indexed->size);
 
     notmuch_message_file_restrict_headers (message_file,
 					   "date",
@@ -1635,70 +2721,154 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 					   "to",
 					   (char *) NULL);
 
-    try {
-	/* Before we do any real work, (especially before doing a
-	 * potential SHA-1 computation on the entire file's contents),
-	 * let's make sure that what we're looking at looks like an
-	 * actual email message.
-	 */
-	from = notmuch_message_file_get_header (message_file, "from");
-	subject = notmuch_message_file_get_header (message_file, "subject");
-	to = notmuch_message_file_get_header (message_file, "to");
-
-	if ((from == NULL || *from == '\0') &&
-	    (subject == NULL || *subject == '\0') &&
-	    (to == NULL || *to == '\0'))
-	{
-	    ret = NOTMUCH_STATUS_FILE_NOT_EMAIL;
-	    goto DONE;
-	}
+    /* Before we do any real work, (especially before doing a
+     * potential SHA-1 computation on the entire file's contents),
+     * let's make sure that what we're looking at looks like an
+     * actual email message.
+     */
+    indexed->from = notmuch_message_file_get_header (message_file, "from");
+    indexed->subject = notmuch_message_file_get_header (message_file, "subject");
+    to = notmuch_message_file_get_header (message_file, "to");
 
-	/* Now that we're sure it's mail, the first order of business
-	 * is to find a message ID (or else create one ourselves). */
+    if ((indexed->from == NULL || *indexed->from == '\0') &&
+	(indexed->subject == NULL || *indexed->subject == '\0') &&
+	(to == NULL || *to == '\0'))
+    {
+	return NOTMUCH_STATUS_FILE_NOT_EMAIL;
+    }
 
-	header = notmuch_message_file_get_header (message_file, "message-id");
-	if (header && *header != '\0') {
-	    message_id = _parse_message_id (message_file, header, NULL);
+    /* Now that we're sure it's mail, the first order of business
+     * is to find a message ID (or else create one ourselves). */
 
-	    /* So the header value isn't RFC-compliant, but it's
-	     * better than no message-id at all. */
-	    if (message_id == NULL)
-		message_id = talloc_strdup (message_file, header);
+    header = notmuch_message_file_get_header (message_file, "message-id");
+    if (header && *header != '\0') {
+	message_id = _parse_message_id (message_file, header, NULL);
 
-	    /* If a message ID is too long, substitute its sha1 instead. */
-	    if (message_id && strlen (message_id) > NOTMUCH_MESSAGE_ID_MAX) {
-		char *compressed = _message_id_compressed (message_file,
-							   message_id);
-		talloc_free (message_id);
-		message_id = compressed;
-	    }
+	/* So the header value isn't RFC-compliant, but it's
+	 * better than no message-id at all. */
+	if (message_id == NULL)
+	    message_id = talloc_strdup (message_file, header);
+
+	/* If a message ID is too long, substitute its sha1 instead. */
+	if (message_id && strlen (message_id) > NOTMUCH_MESSAGE_ID_MAX) {
+	    char *compressed = _message_id_compressed (message_file,
+						       message_id);
+	    talloc_free (message_id);
+	    message_id = compressed;
 	}
+    }
 
-	if (message_id == NULL ) {
-	    /* No message-id at all, let's generate one by taking a
-	     * hash over the file's contents. */
-	    char *sha1 = notmuch_sha1_of_file (filename);
+    if (message_id == NULL ) {
+	/* No message-id at all, let's generate one by taking a
+	 * hash over the file's contents, (which are already read
+	 * in). */
+	size_t size;
+	const char *contents = _notmuch_message_file_get_contents (message_file,
+								   &size);
+	char *sha1 = notmuch_sha1_of_buffer (contents, size);
+
+	/* If that failed too, something is really wrong. Give up. */
+	if (sha1 == NULL)
+	    return NOTMUCH_STATUS_FILE_ERROR;
+
+	message_id = talloc_asprintf (message_file,
+				      "notmuch-sha1-%s", sha1);
+	free (sha1);
+    }
 
-	    /* If that failed too, something is really wrong. Give up. */
-	    if (sha1 == NULL) {
-		ret = NOTMUCH_STATUS_FILE_ERROR;
-		goto DONE;
-	    }
+    indexed->message_id = talloc_steal (indexed, message_id);
+
+    indexed->date = notmuch_message_file_get_header (message_file, "date");
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_add_message (notmuch_database_t *notmuch,
+			      const char *filename,
+			      notmuch_message_t **message_ret)
+{
+    notmuch_indexed_file_t *indexed;
+    notmuch_status_t ret;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    indexed = notmuch_indexed_file_create (filename);
+    if (indexed == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    return notmuch_database_add_indexed_file (notmuch, indexed, message_ret);
+}
+
+notmuch_status_t
+notmuch_database_add_indexed_file (notmuch_database_t *notmuch,
+				   notmuch_indexed_file_t *indexed,
+				   notmuch_message_t **message_ret)
+{
+    notmuch_message_t *message = NULL;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS, ret2;
+    notmuch_private_status_t private_status;
+    notmuch_bool_t contents_indexed = FALSE;
 
-	    message_id = talloc_asprintf (message_file,
-					  "notmuch-sha1-%s", sha1);
-	    free (sha1);
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret) {
+	notmuch_indexed_file_destroy (indexed);
+	return ret;
+    }
+
+    /* A file no indexer has read is read here. */
+    if (indexed->message_file == NULL) {
+	ret = _notmuch_indexed_file_read (indexed);
+	if (ret) {
+	    notmuch_indexed_file_destroy (indexed);
+	    return ret;
 	}
+    }
+
+    /* Adding a message may change many documents.  Do this all
+     * atomically. */
+    ret = notmuch_database_begin_atomic (notmuch);
+    if (ret) {
+	notmuch_indexed_file_destroy (indexed);
+	return ret;
+    }
 
+    try {
 	/* Now that we have a message ID, we get a message object,
 	 * (which may or may not reference an existing document in the
-	 * database). */
-
-	message = _notmuch_message_create_for_message_id (notmuch,
-							  message_id,
-							  &private_status);
+	 * database). If the message is new and an indexer has already
+	 * done the work, we use its message. */
+	if (indexed->message) {
+	    message = notmuch_database_find_message (notmuch,
+						     indexed->message_id);
+	    private_status = NOTMUCH_PRIVATE_STATUS_SUCCESS;
+	}
 
-	talloc_free (message_id);
+	if (indexed->message && message == NULL) {
+	    message = indexed->message;
+	    indexed->message = NULL;
+
+	    private_status = _notmuch_message_attach (message, notmuch);
+	    if (private_status) {
+		notmuch_message_destroy (message);
+		message = NULL;
+	    } else {
+		private_status = NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND;
+		contents_indexed = TRUE;
+	    }
+	} else if (message == NULL) {
+	    message = _notmuch_message_create_for_message_id (notmuch,
+							      indexed->message_id,
+							      &private_status);
+	}
 
 	if (message == NULL) {
 	    ret = COERCE_STATUS (private_status,
@@ -1706,26 +2876,33 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 	    goto DONE;
 	}
 
-	_notmuch_message_add_filename (message, filename);
+	_notmuch_message_add_filename (message, indexed->filename);
 
 	/* Is this a newly created message object? */
 	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
 	    _notmuch_message_add_term (message, "type", "mail");
 
 	    ret = _notmuch_database_link_message (notmuch, message,
-						  message_file);
+						  indexed->message_file);
 	    if (ret)
 		goto DONE;
 
-	    date = notmuch_message_file_get_header (message_file, "date");
-	    _notmuch_message_set_date (message, date);
+	    if (! contents_indexed) {
+		_notmuch_message_set_date (message, indexed->date);
+		_notmuch_message_set_header_values (message, indexed->date,
+						    indexed->from,
+						    indexed->subject);
 
-	    _notmuch_message_index_file (message, filename);
+		_notmuch_message_index_file (message, indexed->message_file);
+	    }
 	} else {
 	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
 	}
 
 	_notmuch_message_sync (message);
+
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    notmuch->batch_bytes += indexed->size;
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred adding message: %s.\n",
 		 error.get_msg().c_str());
@@ -1743,8 +2920,7 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 	    notmuch_message_destroy (message);
     }
 
-    if (message_file)
-	notmuch_message_file_close (message_file);
+    notmuch_indexed_file_destroy (indexed);
 
     ret2 = notmuch_database_end_atomic (notmuch);
     if ((ret == NOTMUCH_STATUS_SUCCESS ||
@@ -1755,6 +2931,127 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
     return ret;
 }
 
+void
+notmuch_indexed_file_destroy (notmuch_indexed_file_t *indexed)
+{
+    talloc_free (indexed);
+}
+
+static int
+_notmuch_indexer_destructor (notmuch_indexer_t *indexer)
+{
+    delete indexer->term_gen;
+
+    return 0;
+}
+
+notmuch_indexer_t *
+notmuch_indexer_create (notmuch_database_t *notmuch)
+{
+    notmuch_indexer_t *indexer;
+
+    /* Set up GMime before any indexer can run in another thread. */
+    _notmuch_index_init ();
+
+    indexer = talloc (NULL, notmuch_indexer_t);
+    if (unlikely (indexer == NULL))
+	return NULL;
+
+    indexer->term_gen = NULL;
+    talloc_set_destructor (indexer, _notmuch_indexer_destructor);
+
+    indexer->reader = _notmuch_database_open_reader (indexer, notmuch);
+    if (indexer->reader == NULL) {
+	talloc_free (indexer);
+	return NULL;
+    }
+
+    try {
+	indexer->term_gen = new Xapian::TermGenerator;
+	indexer->term_gen->set_stemmer (Xapian::Stem ("english"));
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred creating indexer: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (indexer);
+	return NULL;
+    }
+
+    return indexer;
+}
+
+/* Return TRUE if the indexer's view of the database, (as of the most
+ * recent commit), already has a message with ID 'message_id'. In case
+ * of doubt, returns FALSE. */
+static notmuch_bool_t
+_notmuch_indexer_message_exists (notmuch_indexer_t *indexer,
+				 const char *message_id)
+{
+    Xapian::Database *db = indexer->reader->xapian_db;
+
+    try {
+	db->reopen ();
+	return db->term_exists (std::string (_find_prefix ("id")) +
+				message_id);
+    } catch (const Xapian::Error &error) {
+	return FALSE;
+    }
+}
+
+notmuch_status_t
+notmuch_indexer_index_file (notmuch_indexer_t *indexer,
+			    notmuch_indexed_file_t *indexed)
+{
+    notmuch_message_t *message;
+    notmuch_private_status_t private_status;
+    notmuch_status_t ret;
+
+    ret = _notmuch_indexed_file_read (indexed);
+    if (ret)
+	return ret;
+
+    /* Read the headers needed to link the message into its thread
+     * now, so that adding it leaves only lookups to be done. */
+    notmuch_message_file_get_header (indexed->message_file, "in-reply-to");
+    notmuch_message_file_get_header (indexed->message_file, "references");
+
+    /* Files of messages already in the database, (as when a file is
+     * renamed), only add a filename, so there's nothing to index. */
+    if (_notmuch_indexer_message_exists (indexer, indexed->message_id))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    try {
+	message = _notmuch_message_create_unattached (indexed,
+						      indexer->reader,
+						      indexed->message_id,
+						      indexer->term_gen,
+						      &private_status);
+	if (message == NULL)
+	    return COERCE_STATUS (private_status,
+				  "Unexpected status value from _notmuch_message_create_unattached");
+
+	_notmuch_message_set_date (message, indexed->date);
+	_notmuch_message_set_header_values (message, indexed->date,
+					    indexed->from, indexed->subject);
+
+	_notmuch_message_index_file (message, indexed->message_file);
+
+	indexed->message = message;
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred indexing message: %s.\n",
+		 error.get_msg().c_str());
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return ret;
+}
+
+void
+notmuch_indexer_destroy (notmuch_indexer_t *indexer)
+{
+    talloc_free (indexer);
+}
+
 notmuch_status_t
 notmuch_database_remove_message (notmuch_database_t *notmuch,
 				 const char *filename)
@@ -1780,29 +3077,39 @@ notmuch_database_find_message_by_filename (notmuch_database_t *notmuch,
 {
     void *local;
     const char *prefix = _find_prefix ("file-direntry");
-    char *direntry, *term;
+    const char *basename;
+    char *term;
+    unsigned int directory_id, doc_id = 0;
     Xapian::PostingIterator i, end;
     notmuch_message_t *message = NULL;
+    notmuch_private_status_t private_status;
     notmuch_status_t status;
 
     local = talloc_new (notmuch);
 
     try {
-	status = _notmuch_database_filename_to_direntry (local, notmuch,
-							 filename, &direntry);
+	status = _notmuch_database_split_filename (local, notmuch, filename,
+						   &directory_id, &basename);
 	if (status)
-	    return NULL;
+	    goto DONE;
 
-	term = talloc_asprintf (local, "%s%s", prefix, direntry);
+	/* The listing of the directory saves looking up the term of
+	 * each of its files in turn. */
+	if (! _notmuch_directory_files_lookup (notmuch, directory_id,
+					       basename, &doc_id))
+	{
+	    term = talloc_asprintf (local, "%s%u:%s", prefix,
+				    directory_id, basename);
 
-	find_doc_ids_for_term (notmuch, term, &i, &end);
+	    find_doc_ids_for_term (notmuch, term, &i, &end);
 
-	if (i != end) {
-	    notmuch_private_status_t private_status;
+	    if (i != end)
+		doc_id = *i;
+	}
 
+	if (doc_id)
 	    message = _notmuch_message_create (notmuch, notmuch,
-					       *i, &private_status);
-	}
+					       doc_id, &private_status);
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "Error: A Xapian exception occurred finding message by filename: %s\n",
 		 error.get_msg().c_str());
@@ -1810,6 +3117,7 @@ notmuch_database_find_message_by_filename (notmuch_database_t *notmuch,
 	message = NULL;
     }
 
+  DONE:
     talloc_free (local);
 
     return message;
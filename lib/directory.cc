@@ -21,6 +21,8 @@
 #include "notmuch-private.h"
 #include "database-private.h"
 
+#include <glib.h> /* GHashTable, GTree */
+
 /* Create an iterator to iterate over the basenames of files (or
  * directories) that all share a common parent directory.
  */
@@ -145,6 +147,10 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 	    directory->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 				      Xapian::sortable_serialise (0));
 
+	    /* A new directory has no files yet, so starts off with an
+	     * (empty) listing of them. */
+	    directory->doc.add_value (NOTMUCH_VALUE_FILES, "0");
+
 	    directory->document_id = _notmuch_database_generate_doc_id (notmuch);
 	    db->replace_document (directory->document_id, directory->doc);
 	    talloc_free (local);
@@ -189,6 +195,9 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
 
     try {
+	/* Start from the current document, which may have had its
+	 * listing of files rewritten since this object was created. */
+	directory->doc = db->get_document (directory->document_id);
 	directory->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 				   Xapian::sortable_serialise (mtime));
 
@@ -201,6 +210,8 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
+    directory->mtime = mtime;
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
@@ -210,12 +221,644 @@ notmuch_directory_get_mtime (notmuch_directory_t *directory)
     return directory->mtime;
 }
 
+notmuch_status_t
+notmuch_directory_set_subdirectories (notmuch_directory_t *directory,
+				      time_t mtime,
+				      const char **names,
+				      unsigned int count)
+{
+    notmuch_database_t *notmuch = directory->notmuch;
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+    unsigned int i;
+    char *value;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    value = talloc_asprintf (directory, "%" PRId64, (int64_t) mtime);
+    for (i = 0; i < count; i++)
+	value = talloc_asprintf_append (value, "/%s", names[i]);
+
+    try {
+	directory->doc = db->get_document (directory->document_id);
+	directory->doc.add_value (NOTMUCH_VALUE_SUBDIRECTORIES, value);
+
+	db->replace_document (directory->document_id, directory->doc);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred setting directory subdirectories: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (value);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (value);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_filenames_t *
+notmuch_directory_get_subdirectories (notmuch_directory_t *directory)
+{
+    notmuch_string_list_t *names;
+    std::string value;
+    const char *name, *end;
+    char *mtime_end;
+    int64_t mtime;
+
+    value = directory->doc.get_value (NOTMUCH_VALUE_SUBDIRECTORIES);
+    if (value.empty ())
+	return NULL;
+
+    /* The names are only those of the directory as it was at the
+     * stored mtime. */
+    mtime = strtoll (value.c_str (), &mtime_end, 10);
+    if (mtime_end == value.c_str () ||
+	(*mtime_end != '\0' && *mtime_end != '/') ||
+	mtime != (int64_t) directory->mtime)
+    {
+	return NULL;
+    }
+
+    names = _notmuch_string_list_create (directory);
+    if (unlikely (names == NULL))
+	return NULL;
+
+    for (name = mtime_end; *name == '/'; name = end) {
+	name++;
+	end = strchr (name, '/');
+	if (end == NULL)
+	    end = name + strlen (name);
+	_notmuch_string_list_append (names,
+				     talloc_strndup (names, name, end - name));
+    }
+
+    return _notmuch_filenames_create (directory, names);
+}
+
+/* The files of a directory, (see _notmuch_directory_files_get). */
+typedef struct _notmuch_directory_files {
+    Xapian::docid directory_id;
+
+    /* Maps the name of each file to the document ID of its
+     * message, in order of name, (so that the listing can be written
+     * out without sorting it first). */
+    GTree *doc_ids;
+
+    /* Whether files were added or removed since the listing was
+     * written to the directory document. */
+    notmuch_bool_t dirty;
+
+    /* Whether the directory document holds this listing, (as it was
+     * before the changes that made it 'dirty', if any). */
+    notmuch_bool_t stored;
+} notmuch_directory_files_t;
+
+struct _notmuch_directory_listings {
+    /* Maps a directory document ID to its notmuch_directory_files_t. */
+    GHashTable *by_id;
+};
+
+static int
+_notmuch_directory_files_destructor (notmuch_directory_files_t *files)
+{
+    g_tree_destroy (files->doc_ids);
+
+    return 0;
+}
+
+static gint
+_strcmp_for_g_tree (gconstpointer a, gconstpointer b,
+		    unused (gpointer user_data))
+{
+    return strcmp ((const char *) a, (const char *) b);
+}
+
+static notmuch_directory_files_t *
+_notmuch_directory_files_create (void *ctx, Xapian::docid directory_id)
+{
+    notmuch_directory_files_t *files;
+
+    files = talloc (ctx, notmuch_directory_files_t);
+    if (unlikely (files == NULL))
+	return NULL;
+
+    files->directory_id = directory_id;
+    files->doc_ids = g_tree_new_full (_strcmp_for_g_tree, NULL,
+				      g_free, NULL);
+    files->dirty = FALSE;
+    files->stored = FALSE;
+
+    talloc_set_destructor (files, _notmuch_directory_files_destructor);
+
+    return files;
+}
+
+static int
+_notmuch_directory_listings_destructor (notmuch_directory_listings_t *listings)
+{
+    g_hash_table_unref (listings->by_id);
+
+    return 0;
+}
+
+static void
+_talloc_free_for_g_hash (void *ptr)
+{
+    talloc_free (ptr);
+}
+
+notmuch_directory_listings_t *
+_notmuch_directory_listings_create (void *ctx)
+{
+    notmuch_directory_listings_t *listings;
+
+    listings = talloc (ctx, notmuch_directory_listings_t);
+    if (unlikely (listings == NULL))
+	return NULL;
+
+    listings->by_id = g_hash_table_new_full (NULL, NULL, NULL,
+					     _talloc_free_for_g_hash);
+
+    talloc_set_destructor (listings, _notmuch_directory_listings_destructor);
+
+    return listings;
+}
+
+/* Parse the FILES value of a directory document, (see the schema in
+ * database.cc). Returns NULL if the value is empty or malformed. */
+static notmuch_directory_files_t *
+_notmuch_directory_files_parse (void *ctx,
+				Xapian::docid directory_id,
+				const std::string &value)
+{
+    notmuch_directory_files_t *files;
+    const char *s = value.c_str (), *name, *end;
+    unsigned long count, i, doc_id;
+    char *num_end;
+
+    if (value.empty ())
+	return NULL;
+
+    count = strtoul (s, &num_end, 10);
+    if (num_end == s)
+	return NULL;
+
+    files = _notmuch_directory_files_create (ctx, directory_id);
+    if (unlikely (files == NULL))
+	return NULL;
+
+    for (i = 0, s = num_end; i < count; i++, s = num_end) {
+	if (*s != '/')
+	    goto FAIL;
+	name = s + 1;
+	end = strchr (name, '/');
+	if (end == NULL)
+	    goto FAIL;
+	doc_id = strtoul (end + 1, &num_end, 10);
+	if (num_end == end + 1)
+	    goto FAIL;
+	g_tree_insert (files->doc_ids, g_strndup (name, end - name),
+		       GUINT_TO_POINTER (doc_id));
+    }
+
+    if (*s == '\0') {
+	files->stored = TRUE;
+	return files;
+    }
+
+  FAIL:
+    talloc_free (files);
+    return NULL;
+}
+
+static gboolean
+_append_name (gpointer key, unused (gpointer value), gpointer data)
+{
+    const char ***next = (const char ***) data;
+
+    *(*next)++ = (const char *) key;
+
+    return FALSE;
+}
+
+/* Return the names of the files of 'files' in order, (in an array
+ * with 'ctx' as the talloc owner, holding 'files' own strings). */
+static const char **
+_notmuch_directory_files_get_names (void *ctx,
+				    notmuch_directory_files_t *files,
+				    unsigned int *count)
+{
+    const char **names, **next;
+
+    *count = g_tree_nnodes (files->doc_ids);
+
+    names = talloc_array (ctx, const char *, *count);
+    if (unlikely (names == NULL))
+	return NULL;
+
+    next = names;
+    g_tree_foreach (files->doc_ids, _append_name, &next);
+
+    return names;
+}
+
+static gboolean
+_append_file (gpointer key, gpointer value, gpointer data)
+{
+    std::string *out = (std::string *) data;
+    char doc_id[16];
+
+    snprintf (doc_id, sizeof (doc_id), "/%u", GPOINTER_TO_UINT (value));
+    *out += '/';
+    *out += (const char *) key;
+    *out += doc_id;
+
+    return FALSE;
+}
+
+static std::string
+_notmuch_directory_files_serialize (notmuch_directory_files_t *files)
+{
+    char count[16];
+    std::string value;
+
+    snprintf (count, sizeof (count), "%d", g_tree_nnodes (files->doc_ids));
+    value = count;
+
+    g_tree_foreach (files->doc_ids, _append_file, &value);
+
+    return value;
+}
+
+static gboolean
+_notmuch_directory_files_is_clean (unused (gpointer key),
+				   gpointer value,
+				   unused (gpointer user_data))
+{
+    return ! ((notmuch_directory_files_t *) value)->dirty;
+}
+
+/* Start keeping 'files' in memory, (in place of any other listings
+ * that can simply be read back from their directory documents). */
+static void
+_notmuch_directory_files_keep (notmuch_database_t *notmuch,
+			       notmuch_directory_files_t *files)
+{
+    GHashTable *by_id = notmuch->directory_listings->by_id;
+
+    g_hash_table_foreach_remove (by_id, _notmuch_directory_files_is_clean,
+				 NULL);
+    g_hash_table_insert (by_id, GUINT_TO_POINTER (files->directory_id),
+			 files);
+}
+
+/* Return the listing of the files of the directory with document ID
+ * 'directory_id': the document ID of the message of each file, by
+ * name, as recorded with the directory document, (in its FILES
+ * value).
+ *
+ * This spares looking up the term of each file in turn. Within a
+ * batch, (see notmuch_database_begin_batch), the listing is kept up
+ * to date in memory as files are added and removed, and only written
+ * back to the directory document once, when the batch ends, (see
+ * _notmuch_database_write_directory_files). So the size of the
+ * directory is paid once per batch rather than once per commit. Any
+ * change to the files of the directory outside of a batch drops the
+ * listing, until notmuch_directory_get_child_files next builds it
+ * from the terms of the files within a batch.
+ *
+ * Returns NULL if the directory has no listing, or no batch is open,
+ * (which includes a read-only database).
+ */
+static notmuch_directory_files_t *
+_notmuch_directory_files_get (notmuch_database_t *notmuch,
+			      Xapian::docid directory_id)
+{
+    notmuch_directory_files_t *files;
+    std::string value;
+
+    if (notmuch->directory_listings == NULL || ! notmuch->in_batch ||
+	directory_id == 0)
+    {
+	return NULL;
+    }
+
+    files = (notmuch_directory_files_t *)
+	g_hash_table_lookup (notmuch->directory_listings->by_id,
+			     GUINT_TO_POINTER (directory_id));
+    if (files)
+	return files;
+
+    try {
+	value = notmuch->xapian_db->get_document (directory_id).get_value (NOTMUCH_VALUE_FILES);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred reading directory files: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+
+    files = _notmuch_directory_files_parse (notmuch->directory_listings,
+					    directory_id, value);
+    if (files)
+	_notmuch_directory_files_keep (notmuch, files);
+
+    return files;
+}
+
+/* Build the listing of the files of the directory with document ID
+ * 'directory_id' from the terms of its files, (for a directory that
+ * has none, see _notmuch_directory_files_get). */
+static notmuch_directory_files_t *
+_notmuch_directory_files_build (notmuch_database_t *notmuch,
+				Xapian::docid directory_id)
+{
+    notmuch_directory_files_t *files;
+    Xapian::TermIterator i, end;
+    Xapian::PostingIterator p;
+    char *prefix;
+    size_t prefix_len;
+
+    if (notmuch->directory_listings == NULL || ! notmuch->in_batch ||
+	directory_id == 0)
+    {
+	return NULL;
+    }
+
+    files = _notmuch_directory_files_create (notmuch->directory_listings,
+					     directory_id);
+    if (unlikely (files == NULL))
+	return NULL;
+
+    prefix = talloc_asprintf (files, "%s%u:", _find_prefix ("file-direntry"),
+			      directory_id);
+    prefix_len = strlen (prefix);
+
+    try {
+	end = notmuch->xapian_db->allterms_end ();
+	for (i = notmuch->xapian_db->allterms_begin (), i.skip_to (prefix);
+	     i != end; i++)
+	{
+	    const std::string &term = *i;
+
+	    if (strncmp (term.c_str (), prefix, prefix_len))
+		break;
+
+	    p = notmuch->xapian_db->postlist_begin (term);
+	    if (p != notmuch->xapian_db->postlist_end (term))
+		g_tree_insert (files->doc_ids,
+			       g_strdup (term.c_str () + prefix_len),
+			       GUINT_TO_POINTER (*p));
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred listing directory files: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (files);
+	return NULL;
+    }
+
+    files->dirty = TRUE;
+    _notmuch_directory_files_keep (notmuch, files);
+
+    return files;
+}
+
+/* Drop the listing of the directory with document ID 'directory_id',
+ * (from memory and from the directory document), after a change that
+ * it can't follow. */
+static void
+_notmuch_directory_files_drop (notmuch_database_t *notmuch,
+			       Xapian::docid directory_id)
+{
+    Xapian::WritableDatabase *db;
+    Xapian::Document doc;
+
+    g_hash_table_remove (notmuch->directory_listings->by_id,
+			 GUINT_TO_POINTER (directory_id));
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	doc = db->get_document (directory_id);
+	if (! doc.get_value (NOTMUCH_VALUE_FILES).empty ()) {
+	    doc.remove_value (NOTMUCH_VALUE_FILES);
+	    db->replace_document (directory_id, doc);
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred dropping directory files: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+    }
+}
+
+/* Mark 'files' as changed. The first change since the listing was
+ * written also removes it from the directory document, in the same
+ * transaction as the change, so that a commit before the end of the
+ * batch never leaves an out-of-date listing behind. */
+static void
+_notmuch_directory_files_touch (notmuch_database_t *notmuch,
+				notmuch_directory_files_t *files)
+{
+    Xapian::WritableDatabase *db;
+    Xapian::Document doc;
+
+    files->dirty = TRUE;
+
+    if (! files->stored)
+	return;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	doc = db->get_document (files->directory_id);
+	doc.remove_value (NOTMUCH_VALUE_FILES);
+	db->replace_document (files->directory_id, doc);
+	files->stored = FALSE;
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred dropping directory files: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+    }
+}
+
+/* Record in the listing of the directory with document ID
+ * 'directory_id', (if it has one), that its file 'basename' is one of
+ * the files of the message with document ID 'doc_id'. */
+void
+_notmuch_directory_files_add (notmuch_database_t *notmuch,
+			      unsigned int directory_id,
+			      const char *basename,
+			      unsigned int doc_id)
+{
+    notmuch_directory_files_t *files;
+
+    if (notmuch->directory_listings == NULL || directory_id == 0)
+	return;
+
+    if (! notmuch->in_batch || ! notmuch->in_transaction) {
+	_notmuch_directory_files_drop (notmuch, directory_id);
+	return;
+    }
+
+    files = _notmuch_directory_files_get (notmuch, directory_id);
+    if (files == NULL)
+	return;
+
+    g_tree_insert (files->doc_ids, g_strdup (basename),
+		   GUINT_TO_POINTER (doc_id));
+    _notmuch_directory_files_touch (notmuch, files);
+}
+
+/* Record in the listing of the directory with document ID
+ * 'directory_id', (if it has one), that its file 'basename' is gone. */
+void
+_notmuch_directory_files_remove (notmuch_database_t *notmuch,
+				 unsigned int directory_id,
+				 const char *basename)
+{
+    notmuch_directory_files_t *files;
+
+    if (notmuch->directory_listings == NULL || directory_id == 0)
+	return;
+
+    if (! notmuch->in_batch || ! notmuch->in_transaction) {
+	_notmuch_directory_files_drop (notmuch, directory_id);
+	return;
+    }
+
+    files = _notmuch_directory_files_get (notmuch, directory_id);
+    if (files == NULL)
+	return;
+
+    g_tree_remove (files->doc_ids, basename);
+    _notmuch_directory_files_touch (notmuch, files);
+}
+
+/* Find the document ID of the message of the file 'basename' of the
+ * directory with document ID 'directory_id' in the listing of the
+ * directory, (or 0 if there's no such file).
+ *
+ * Returns FALSE if the directory has no listing, in which case the
+ * caller must look for the term of the file instead. */
+notmuch_bool_t
+_notmuch_directory_files_lookup (notmuch_database_t *notmuch,
+				 unsigned int directory_id,
+				 const char *basename,
+				 unsigned int *doc_id)
+{
+    notmuch_directory_files_t *files;
+
+    files = _notmuch_directory_files_get (notmuch, directory_id);
+    if (files == NULL)
+	return FALSE;
+
+    *doc_id = GPOINTER_TO_UINT (g_tree_lookup (files->doc_ids, basename));
+
+    return TRUE;
+}
+
+/* Write each listing that has changed back to its directory
+ * document, (at the end of a batch, see
+ * _notmuch_directory_files_get).
+ *
+ * Note that a listing is written whole, so this costs as much as the
+ * files of each directory that changed, however few of them did. */
+notmuch_status_t
+_notmuch_database_write_directory_files (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_directory_files_t *files;
+    Xapian::Document doc;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (notmuch->directory_listings == NULL)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	g_hash_table_iter_init (&iter, notmuch->directory_listings->by_id);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+	    files = (notmuch_directory_files_t *) value;
+	    if (! files->dirty)
+		continue;
+
+	    doc = db->get_document (files->directory_id);
+	    doc.add_value (NOTMUCH_VALUE_FILES,
+			   _notmuch_directory_files_serialize (files));
+	    db->replace_document (files->directory_id, doc);
+
+	    files->dirty = FALSE;
+	    files->stored = TRUE;
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred writing directory files: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 notmuch_filenames_t *
 notmuch_directory_get_child_files (notmuch_directory_t *directory)
 {
+    notmuch_database_t *notmuch = directory->notmuch;
+    notmuch_directory_files_t *files = NULL;
+    notmuch_bool_t kept;
+    notmuch_string_list_t *list;
+    const char **names;
+    unsigned int count, i;
     char *term;
     notmuch_filenames_t *child_files;
 
+    /* Outside of a batch, (as always for a read-only database), the
+     * listing is read straight from the directory document. */
+    kept = (notmuch->directory_listings && notmuch->in_batch);
+    if (kept) {
+	files = _notmuch_directory_files_get (notmuch,
+					      directory->document_id);
+	if (files == NULL)
+	    files = _notmuch_directory_files_build (notmuch,
+						    directory->document_id);
+    } else {
+	files = _notmuch_directory_files_parse (directory,
+						directory->document_id,
+						directory->doc.get_value (NOTMUCH_VALUE_FILES));
+    }
+
+    if (files) {
+	list = _notmuch_string_list_create (directory);
+	if (unlikely (list == NULL))
+	    return NULL;
+
+	names = _notmuch_directory_files_get_names (list, files, &count);
+	if (unlikely (names == NULL))
+	    return NULL;
+
+	for (i = 0; i < count; i++)
+	    _notmuch_string_list_append (list, talloc_strdup (list, names[i]));
+
+	if (! kept)
+	    talloc_free (files);
+
+	return _notmuch_filenames_create (directory, list);
+    }
+
     term = talloc_asprintf (directory, "%s%u:",
 			    _find_prefix ("file-direntry"),
 			    directory->document_id);
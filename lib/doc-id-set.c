@@ -0,0 +1,371 @@
+/* doc-id-set.c - A compressed set of Xapian document IDs
+ *
+ * Copyright © 2011 Intel Corporation
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+/* A document ID set splits each 32-bit document ID into a 16-bit
+ * "key" and a 16-bit "low" part. All the IDs sharing a key live in a
+ * single container, and the containers are kept sorted by key.
+ *
+ * A container holding few IDs is a sorted array of their low parts,
+ * while a container holding many is a bitmap covering all 65536
+ * possible low parts. The switch happens where the two take the same
+ * space, so the memory used by a set is proportional to the number of
+ * IDs in it, (never to the largest ID in it, nor to the size of the
+ * database).
+ *
+ * So that several threads of execution can claim IDs from the same
+ * set at once, nothing is ever moved by a removal. Bitmap containers
+ * simply clear the bit, while array containers set a bit in a
+ * parallel "removed" bitmap. The removed entries are compacted away
+ * the next time an ID is added to the container.
+ */
+
+#define DOC_ID_SET_CONTAINER_BITS 65536
+
+/* The largest array container, (at this size it's as large as a
+ * bitmap container). */
+#define DOC_ID_SET_ARRAY_MAX 4096
+
+#define BITS_PER_WORD (sizeof (unsigned int) * CHAR_BIT)
+#define DOC_ID_SET_WORD(bit) ((bit) / BITS_PER_WORD)
+#define DOC_ID_SET_BIT(bit) ((bit) % BITS_PER_WORD)
+#define DOC_ID_SET_WORDS(bits) (((bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+#define DOC_ID_KEY(doc_id) ((doc_id) >> 16)
+#define DOC_ID_LOW(doc_id) ((doc_id) & 0xffff)
+
+typedef struct _notmuch_doc_id_container {
+    unsigned int key;
+
+    /* For an array container, the sorted low parts, (of which there
+     * are 'length', with room for 'size'), and a bitmap of which of
+     * them have been removed. Both are NULL for a bitmap container. */
+    uint16_t *values;
+    unsigned int *removed;
+    unsigned int length;
+    unsigned int size;
+
+    /* For a bitmap container, DOC_ID_SET_CONTAINER_BITS bits. */
+    unsigned int *bitmap;
+} notmuch_doc_id_container_t;
+
+struct _notmuch_doc_id_set {
+    notmuch_doc_id_container_t *containers;
+    unsigned int length;
+    unsigned int size;
+};
+
+/* Create a new, empty notmuch_doc_id_set_t object, with 'ctx' as its
+ * talloc owner.
+ *
+ * This function can return NULL in case of out-of-memory.
+ */
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create (const void *ctx)
+{
+    notmuch_doc_id_set_t *doc_ids;
+
+    doc_ids = talloc (ctx, notmuch_doc_id_set_t);
+    if (unlikely (doc_ids == NULL))
+	return NULL;
+
+    doc_ids->containers = NULL;
+    doc_ids->length = 0;
+    doc_ids->size = 0;
+
+    return doc_ids;
+}
+
+/* Return the index of the first container in 'doc_ids' with a key of
+ * at least 'key', (doc_ids->length if there is none). */
+static unsigned int
+_find_container (notmuch_doc_id_set_t *doc_ids, unsigned int key)
+{
+    unsigned int lo = 0, hi = doc_ids->length, mid;
+
+    /* Sets are usually built in order, so check the end first. */
+    if (hi && doc_ids->containers[hi - 1].key < key)
+	return hi;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (doc_ids->containers[mid].key < key)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/* Return the index of the first value in the array container 'c' of
+ * at least 'low', (c->length if there is none). */
+static unsigned int
+_find_value (notmuch_doc_id_container_t *c, unsigned int low)
+{
+    unsigned int lo = 0, hi = c->length, mid;
+
+    if (hi && c->values[hi - 1] < low)
+	return hi;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (c->values[mid] < low)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+static notmuch_bool_t
+_is_removed (notmuch_doc_id_container_t *c, unsigned int i)
+{
+    return (c->removed[DOC_ID_SET_WORD (i)] & (1u << DOC_ID_SET_BIT (i))) != 0;
+}
+
+/* Return the container with the given key, creating it (as an empty
+ * array container) if necessary. Returns NULL on out-of-memory. */
+static notmuch_doc_id_container_t *
+_get_container (notmuch_doc_id_set_t *doc_ids, unsigned int key)
+{
+    notmuch_doc_id_container_t *c;
+    unsigned int i;
+
+    i = _find_container (doc_ids, key);
+    if (i < doc_ids->length && doc_ids->containers[i].key == key)
+	return &doc_ids->containers[i];
+
+    if (doc_ids->length == doc_ids->size) {
+	unsigned int size = doc_ids->size ? 2 * doc_ids->size : 4;
+	c = talloc_realloc (doc_ids, doc_ids->containers,
+			    notmuch_doc_id_container_t, size);
+	if (unlikely (c == NULL))
+	    return NULL;
+	doc_ids->containers = c;
+	doc_ids->size = size;
+    }
+
+    memmove (&doc_ids->containers[i + 1], &doc_ids->containers[i],
+	     (doc_ids->length - i) * sizeof (notmuch_doc_id_container_t));
+    doc_ids->length++;
+
+    c = &doc_ids->containers[i];
+    c->key = key;
+    c->values = NULL;
+    c->removed = NULL;
+    c->length = 0;
+    c->size = 0;
+    c->bitmap = NULL;
+
+    return c;
+}
+
+/* Drop the removed entries from the array container 'c'. */
+static void
+_compact_array (notmuch_doc_id_container_t *c)
+{
+    unsigned int i, j, words;
+    notmuch_bool_t any = FALSE;
+
+    words = DOC_ID_SET_WORDS (c->size);
+    for (i = 0; i < words; i++) {
+	if (c->removed[i]) {
+	    any = TRUE;
+	    break;
+	}
+    }
+    if (! any)
+	return;
+
+    for (i = 0, j = 0; i < c->length; i++) {
+	if (! _is_removed (c, i))
+	    c->values[j++] = c->values[i];
+    }
+    c->length = j;
+
+    memset (c->removed, 0, words * sizeof (unsigned int));
+}
+
+/* Turn the array container 'c' into a bitmap container. */
+static notmuch_bool_t
+_convert_to_bitmap (notmuch_doc_id_set_t *doc_ids,
+		    notmuch_doc_id_container_t *c)
+{
+    unsigned int *bitmap;
+    unsigned int i, low;
+
+    bitmap = talloc_zero_array (doc_ids, unsigned int,
+				DOC_ID_SET_WORDS (DOC_ID_SET_CONTAINER_BITS));
+    if (unlikely (bitmap == NULL))
+	return FALSE;
+
+    for (i = 0; i < c->length; i++) {
+	if (_is_removed (c, i))
+	    continue;
+	low = c->values[i];
+	bitmap[DOC_ID_SET_WORD (low)] |= 1u << DOC_ID_SET_BIT (low);
+    }
+
+    talloc_free (c->values);
+    talloc_free (c->removed);
+    c->values = NULL;
+    c->removed = NULL;
+    c->length = 0;
+    c->size = 0;
+    c->bitmap = bitmap;
+
+    return TRUE;
+}
+
+/* Add 'doc_id' to 'doc_ids'.
+ *
+ * Adding IDs in ascending order is cheapest, (as when reading them
+ * from an MSet sorted by document ID), but any order works. This
+ * must not be called while other threads may be using the set.
+ *
+ * Returns FALSE on out-of-memory.
+ */
+notmuch_bool_t
+_notmuch_doc_id_set_add (notmuch_doc_id_set_t *doc_ids,
+			 unsigned int doc_id)
+{
+    notmuch_doc_id_container_t *c;
+    unsigned int low = DOC_ID_LOW (doc_id);
+    unsigned int i;
+
+    c = _get_container (doc_ids, DOC_ID_KEY (doc_id));
+    if (unlikely (c == NULL))
+	return FALSE;
+
+    if (c->bitmap) {
+	c->bitmap[DOC_ID_SET_WORD (low)] |= 1u << DOC_ID_SET_BIT (low);
+	return TRUE;
+    }
+
+    if (c->removed)
+	_compact_array (c);
+
+    i = _find_value (c, low);
+    if (i < c->length && c->values[i] == low)
+	return TRUE;
+
+    if (c->length == DOC_ID_SET_ARRAY_MAX) {
+	if (! _convert_to_bitmap (doc_ids, c))
+	    return FALSE;
+	c->bitmap[DOC_ID_SET_WORD (low)] |= 1u << DOC_ID_SET_BIT (low);
+	return TRUE;
+    }
+
+    if (c->length == c->size) {
+	unsigned int size = c->size ? 2 * c->size : 8;
+	uint16_t *values;
+	unsigned int *removed;
+
+	if (size > DOC_ID_SET_ARRAY_MAX)
+	    size = DOC_ID_SET_ARRAY_MAX;
+
+	values = talloc_realloc (doc_ids, c->values, uint16_t, size);
+	if (unlikely (values == NULL))
+	    return FALSE;
+	c->values = values;
+
+	removed = talloc_realloc (doc_ids, c->removed, unsigned int,
+				  DOC_ID_SET_WORDS (size));
+	if (unlikely (removed == NULL))
+	    return FALSE;
+	memset (removed, 0, DOC_ID_SET_WORDS (size) * sizeof (unsigned int));
+	c->removed = removed;
+
+	c->size = size;
+    }
+
+    memmove (&c->values[i + 1], &c->values[i],
+	     (c->length - i) * sizeof (uint16_t));
+    c->values[i] = low;
+    c->length++;
+
+    return TRUE;
+}
+
+/* Return the container holding 'doc_id', (or NULL if there is none),
+ * and set *index to the position of 'doc_id' within it, (or -1 if
+ * it's not present in an array container). */
+static notmuch_doc_id_container_t *
+_lookup (notmuch_doc_id_set_t *doc_ids, unsigned int doc_id, int *index)
+{
+    notmuch_doc_id_container_t *c;
+    unsigned int key = DOC_ID_KEY (doc_id);
+    unsigned int i;
+
+    i = _find_container (doc_ids, key);
+    if (i == doc_ids->length || doc_ids->containers[i].key != key)
+	return NULL;
+
+    c = &doc_ids->containers[i];
+    *index = -1;
+
+    if (c->bitmap)
+	return c;
+
+    i = _find_value (c, DOC_ID_LOW (doc_id));
+    if (i < c->length && c->values[i] == DOC_ID_LOW (doc_id))
+	*index = i;
+
+    return c;
+}
+
+/* Remove 'doc_id' from 'doc_ids', returning TRUE if it was present.
+ *
+ * This is atomic, so several threads of execution may claim doc IDs
+ * from the same set at once and each doc ID is claimed exactly once.
+ * (No IDs may be added to the set meanwhile.) */
+notmuch_bool_t
+_notmuch_doc_id_set_claim (notmuch_doc_id_set_t *doc_ids,
+			   unsigned int doc_id)
+{
+    notmuch_doc_id_container_t *c;
+    unsigned int *word;
+    unsigned int mask, old;
+    int i;
+
+    c = _lookup (doc_ids, doc_id, &i);
+    if (c == NULL)
+	return FALSE;
+
+    if (c->bitmap) {
+	word = &c->bitmap[DOC_ID_SET_WORD (DOC_ID_LOW (doc_id))];
+	mask = 1u << DOC_ID_SET_BIT (DOC_ID_LOW (doc_id));
+	old = __sync_fetch_and_and (word, ~mask);
+	return (old & mask) != 0;
+    }
+
+    if (i < 0)
+	return FALSE;
+
+    word = &c->removed[DOC_ID_SET_WORD (i)];
+    mask = 1u << DOC_ID_SET_BIT (i);
+    old = __sync_fetch_and_or (word, mask);
+
+    return (old & mask) == 0;
+}
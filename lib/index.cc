@@ -190,36 +190,196 @@ filter_reset (GMimeFilter *gmime_filter)
     filter->state = 0;
 }
 
+static GType notmuch_filter_discard_uuencode_type = 0;
+
+static void
+notmuch_filter_discard_uuencode_register (void)
+{
+    static const GTypeInfo info = {
+	sizeof (NotmuchFilterDiscardUuencodeClass),
+	NULL, /* base_class_init */
+	NULL, /* base_class_finalize */
+	(GClassInitFunc) notmuch_filter_discard_uuencode_class_init,
+	NULL, /* class_finalize */
+	NULL, /* class_data */
+	sizeof (NotmuchFilterDiscardUuencode),
+	0,    /* n_preallocs */
+	NULL, /* instance_init */
+	NULL  /* value_table */
+    };
+
+    notmuch_filter_discard_uuencode_type =
+	g_type_register_static (GMIME_TYPE_FILTER, "NotmuchFilterDiscardUuencode", &info, (GTypeFlags) 0);
+}
+
 /**
  * notmuch_filter_discard_uuencode_new:
  *
- * Returns: a new #NotmuchFilterDiscardUuencode filter.
+ * Returns: a new #NotmuchFilterDiscardUuencode filter, (the type
+ * being registered by _notmuch_index_init).
  **/
 static GMimeFilter *
 notmuch_filter_discard_uuencode_new (void)
 {
-    static GType type = 0;
     NotmuchFilterDiscardUuencode *filter;
 
-    if (!type) {
-	static const GTypeInfo info = {
-	    sizeof (NotmuchFilterDiscardUuencodeClass),
-	    NULL, /* base_class_init */
-	    NULL, /* base_class_finalize */
-	    (GClassInitFunc) notmuch_filter_discard_uuencode_class_init,
-	    NULL, /* class_finalize */
-	    NULL, /* class_data */
-	    sizeof (NotmuchFilterDiscardUuencode),
-	    0,    /* n_preallocs */
-	    NULL, /* instance_init */
-	    NULL  /* value_table */
-	};
-
-	type = g_type_register_static (GMIME_TYPE_FILTER, "NotmuchFilterDiscardUuencode", &info, (GTypeFlags) 0);
+    filter = (NotmuchFilterDiscardUuencode *) g_object_newv (notmuch_filter_discard_uuencode_type, 0, NULL);
+    filter->state = 0;
+
+    return (GMimeFilter *) filter;
+}
+
+typedef struct _NotmuchFilterIndexText NotmuchFilterIndexText;
+typedef struct _NotmuchFilterIndexTextClass NotmuchFilterIndexTextClass;
+
+/**
+ * NotmuchFilterIndexText:
+ *
+ * @parent_object: parent #GMimeFilter
+ * @message: the message whose body is being indexed
+ *
+ * A filter that indexes the text passing through it as part of the
+ * body of @message, and passes nothing on.
+ *
+ * Text is indexed as it arrives, so a part of any size is indexed
+ * without ever being held in memory as a whole. A word split between
+ * two chunks is held back, (with g_mime_filter_backup), until the
+ * rest of it arrives, so that term positions run on exactly as if the
+ * part had been indexed in one go.
+ **/
+struct _NotmuchFilterIndexText {
+    GMimeFilter parent_object;
+    notmuch_message_t *message;
+};
+
+struct _NotmuchFilterIndexTextClass {
+    GMimeFilterClass parent_class;
+};
+
+/* A "word" that's still unfinished after this many bytes is indexed
+ * in pieces rather than held back any longer. */
+#define INDEX_TEXT_MAX_BACKUP 4096
+
+static GMimeFilter *notmuch_filter_index_text_new (notmuch_message_t *message);
+
+static GMimeFilterClass *index_text_parent_class = NULL;
+
+static void
+notmuch_filter_index_text_finalize (GObject *object)
+{
+    G_OBJECT_CLASS (index_text_parent_class)->finalize (object);
+}
+
+static GMimeFilter *
+index_text_filter_copy (GMimeFilter *gmime_filter)
+{
+    NotmuchFilterIndexText *filter = (NotmuchFilterIndexText *) gmime_filter;
+
+    return notmuch_filter_index_text_new (filter->message);
+}
+
+static void
+index_text_filter_filter (GMimeFilter *gmime_filter, char *inbuf, size_t inlen, size_t prespace,
+			  char **outbuf, size_t *outlen, size_t *outprespace)
+{
+    NotmuchFilterIndexText *filter = (NotmuchFilterIndexText *) gmime_filter;
+    size_t len = inlen;
+
+    /* Index up to the last whitespace and keep the rest for later. */
+    while (len && ! g_ascii_isspace (inbuf[len - 1]))
+	len--;
+
+    /* Past INDEX_TEXT_MAX_BACKUP, break before the last character,
+     * (so as not to split a UTF-8 sequence between the pieces). */
+    if (len == 0 && inlen >= INDEX_TEXT_MAX_BACKUP) {
+	const char *last = g_utf8_find_prev_char (inbuf, inbuf + inlen);
+
+	len = last && last > inbuf ? last - inbuf : inlen;
     }
 
-    filter = (NotmuchFilterDiscardUuencode *) g_object_newv (type, 0, NULL);
-    filter->state = 0;
+    _notmuch_message_gen_body_terms (filter->message, inbuf, len);
+
+    if (len < inlen)
+	g_mime_filter_backup (gmime_filter, inbuf + len, inlen - len);
+
+    *outbuf = inbuf;
+    *outlen = 0;
+    *outprespace = prespace;
+}
+
+static void
+index_text_filter_complete (GMimeFilter *gmime_filter, char *inbuf, size_t inlen, size_t prespace,
+			    char **outbuf, size_t *outlen, size_t *outprespace)
+{
+    NotmuchFilterIndexText *filter = (NotmuchFilterIndexText *) gmime_filter;
+
+    if (inbuf && inlen)
+	_notmuch_message_gen_body_terms (filter->message, inbuf, inlen);
+
+    *outbuf = inbuf;
+    *outlen = 0;
+    *outprespace = prespace;
+}
+
+static void
+index_text_filter_reset (GMimeFilter *gmime_filter)
+{
+    (void) gmime_filter;
+}
+
+static void
+notmuch_filter_index_text_class_init (NotmuchFilterIndexTextClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GMimeFilterClass *filter_class = GMIME_FILTER_CLASS (klass);
+
+    index_text_parent_class = (GMimeFilterClass *) g_type_class_ref (GMIME_TYPE_FILTER);
+
+    object_class->finalize = notmuch_filter_index_text_finalize;
+
+    filter_class->copy = index_text_filter_copy;
+    filter_class->filter = index_text_filter_filter;
+    filter_class->complete = index_text_filter_complete;
+    filter_class->reset = index_text_filter_reset;
+}
+
+static GType notmuch_filter_index_text_type = 0;
+
+static void
+notmuch_filter_index_text_register (void)
+{
+    static const GTypeInfo info = {
+	sizeof (NotmuchFilterIndexTextClass),
+	NULL, /* base_class_init */
+	NULL, /* base_class_finalize */
+	(GClassInitFunc) notmuch_filter_index_text_class_init,
+	NULL, /* class_finalize */
+	NULL, /* class_data */
+	sizeof (NotmuchFilterIndexText),
+	0,    /* n_preallocs */
+	NULL, /* instance_init */
+	NULL  /* value_table */
+    };
+
+    notmuch_filter_index_text_type =
+	g_type_register_static (GMIME_TYPE_FILTER, "NotmuchFilterIndexText", &info, (GTypeFlags) 0);
+}
+
+/**
+ * notmuch_filter_index_text_new:
+ *
+ * @message: the message whose body is to be indexed
+ *
+ * Returns: a new #NotmuchFilterIndexText filter, (the type being
+ * registered by _notmuch_index_init).
+ **/
+static GMimeFilter *
+notmuch_filter_index_text_new (notmuch_message_t *message)
+{
+    NotmuchFilterIndexText *filter;
+
+    filter = (NotmuchFilterIndexText *) g_object_newv (notmuch_filter_index_text_type, 0, NULL);
+    filter->message = message;
 
     return (GMimeFilter *) filter;
 }
@@ -310,11 +470,9 @@ _index_mime_part (notmuch_message_t *message,
 		  GMimeObject *part)
 {
     GMimeStream *stream, *filter;
-    GMimeFilter *discard_uuencode_filter;
+    GMimeFilter *discard_uuencode_filter, *index_text_filter;
     GMimeDataWrapper *wrapper;
-    GByteArray *byte_array;
     GMimeContentDisposition *disposition;
-    char *body;
 
     if (! part) {
 	fprintf (stderr, "Warning: Not indexing empty mime part.\n");
@@ -375,62 +533,69 @@ _index_mime_part (notmuch_message_t *message,
 	return;
     }
 
-    byte_array = g_byte_array_new ();
+    /* Decode the part and index it as it goes, (nothing is left over
+     * to be written to the null stream at the end of the chain). */
+    _notmuch_message_begin_body_part (message);
 
-    stream = g_mime_stream_mem_new_with_byte_array (byte_array);
-    g_mime_stream_mem_set_owner (GMIME_STREAM_MEM (stream), FALSE);
+    stream = g_mime_stream_null_new ();
 
     filter = g_mime_stream_filter_new (stream);
     discard_uuencode_filter = notmuch_filter_discard_uuencode_new ();
+    index_text_filter = notmuch_filter_index_text_new (message);
 
     g_mime_stream_filter_add (GMIME_STREAM_FILTER (filter),
 			      discard_uuencode_filter);
+    g_mime_stream_filter_add (GMIME_STREAM_FILTER (filter),
+			      index_text_filter);
 
     wrapper = g_mime_part_get_content_object (GMIME_PART (part));
     if (wrapper)
 	g_mime_data_wrapper_write_to_stream (wrapper, filter);
 
+    g_mime_stream_flush (filter);
+
     g_object_unref (stream);
     g_object_unref (filter);
     g_object_unref (discard_uuencode_filter);
+    g_object_unref (index_text_filter);
+}
 
-    g_byte_array_append (byte_array, (guint8 *) "\0", 1);
-    body = (char *) g_byte_array_free (byte_array, FALSE);
-
-    if (body) {
-	_notmuch_message_gen_terms (message, NULL, body);
+/* Initialize GMime and register the filter types above, exactly
+ * once. Neither g_mime_init nor g_type_register_static may race with
+ * itself, so notmuch_indexer_create calls this before any indexer
+ * can run in another thread. */
+void
+_notmuch_index_init (void)
+{
+    static volatile gsize initialized = 0;
 
-	free (body);
+    if (g_once_init_enter (&initialized)) {
+	g_mime_init (0);
+	notmuch_filter_discard_uuencode_register ();
+	notmuch_filter_index_text_register ();
+	g_once_init_leave (&initialized, 1);
     }
 }
 
 notmuch_status_t
 _notmuch_message_index_file (notmuch_message_t *message,
-			     const char *filename)
+			     notmuch_message_file_t *message_file)
 {
     GMimeStream *stream = NULL;
     GMimeParser *parser = NULL;
     GMimeMessage *mime_message = NULL;
     InternetAddressList *addresses;
-    FILE *file = NULL;
-    const char *from, *subject;
+    const char *from, *subject, *contents;
+    size_t size;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
-    static int initialized = 0;
 
-    if (! initialized) {
-	g_mime_init (0);
-	initialized = 1;
-    }
-
-    file = fopen (filename, "r");
-    if (! file) {
-	fprintf (stderr, "Error opening %s: %s\n", filename, strerror (errno));
-	ret = NOTMUCH_STATUS_FILE_ERROR;
-	goto DONE;
-    }
+    _notmuch_index_init ();
 
-    /* Evil GMime steals my FILE* here so I won't fclose it. */
-    stream = g_mime_stream_file_new (file);
+    /* Parse the contents already read in for the headers rather
+     * than reading the file a second time, (GMime keeps a copy of
+     * its own). */
+    contents = _notmuch_message_file_get_contents (message_file, &size);
+    stream = g_mime_stream_mem_new_with_buffer (contents, size);
 
     parser = g_mime_parser_new_with_stream (stream);
 
@@ -449,7 +614,6 @@ _notmuch_message_index_file (notmuch_message_t *message,
 
     _index_mime_part (message, g_mime_message_get_mime_part (mime_message));
 
-  DONE:
     if (mime_message)
 	g_object_unref (mime_message);
 
@@ -26,6 +26,11 @@
 
 #include <glib.h> /* GHashTable */
 
+/* Files smaller than this are read rather than mapped into memory.
+ * (Most messages are, which also spares them the SIGBUS of a mapped
+ * file being truncated while it is parsed.) */
+#define MESSAGE_FILE_MAP_MIN (256 * 1024)
+
 typedef struct {
     char *str;
     size_t size;
@@ -33,8 +38,15 @@ typedef struct {
 } header_value_closure_t;
 
 struct _notmuch_message_file {
-    /* File object */
-    FILE *file;
+    /* The entire file, read (or mapped) into memory once and shared
+     * by the header parsing below, the MIME parser and the SHA-1
+     * fallback for messages without a Message-ID. */
+    const char *contents;
+    size_t size;
+    void *map;
+
+    /* Offset in 'contents' of the next line for the header parser. */
+    size_t offset;
 
     /* Header storage */
     int restrict_headers;
@@ -85,8 +97,42 @@ _notmuch_message_file_destructor (notmuch_message_file_t *message)
     if (message->headers)
 	g_hash_table_destroy (message->headers);
 
-    if (message->file)
-	fclose (message->file);
+    if (message->map)
+	munmap (message->map, message->size);
+
+    return 0;
+}
+
+/* Read the 'size' bytes of the file open as 'fd' into
+ * message->contents, (or fewer, if the file was truncated since).
+ *
+ * Returns -1, (with errno set), on a read error. */
+static int
+_notmuch_message_file_read (notmuch_message_file_t *message, int fd,
+			    size_t size)
+{
+    char *buf;
+    ssize_t len;
+
+    buf = talloc_array (message, char, size);
+    if (unlikely (buf == NULL)) {
+	errno = ENOMEM;
+	return -1;
+    }
+
+    message->contents = buf;
+    message->size = 0;
+
+    while (message->size < size) {
+	len = read (fd, buf + message->size, size - message->size);
+	if (len < 0 && errno == EINTR)
+	    continue;
+	if (len < 0)
+	    return -1;
+	if (len == 0)
+	    break;
+	message->size += len;
+    }
 
     return 0;
 }
@@ -97,6 +143,8 @@ notmuch_message_file_t *
 _notmuch_message_file_open_ctx (void *ctx, const char *filename)
 {
     notmuch_message_file_t *message;
+    struct stat st;
+    int fd = -1;
 
     message = talloc_zero (ctx, notmuch_message_file_t);
     if (unlikely (message == NULL))
@@ -104,10 +152,32 @@ _notmuch_message_file_open_ctx (void *ctx, const char *filename)
 
     talloc_set_destructor (message, _notmuch_message_file_destructor);
 
-    message->file = fopen (filename, "r");
-    if (message->file == NULL)
+    fd = open (filename, O_RDONLY);
+    if (fd < 0)
+	goto FAIL;
+
+    if (fstat (fd, &st) < 0)
 	goto FAIL;
 
+    /* mmap refuses empty files, which we can just as well represent
+     * by an empty string. */
+    if (st.st_size == 0) {
+	message->contents = "";
+    } else if (st.st_size < MESSAGE_FILE_MAP_MIN) {
+	if (_notmuch_message_file_read (message, fd, st.st_size) < 0)
+	    goto FAIL;
+    } else {
+	message->map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (message->map == MAP_FAILED) {
+	    message->map = NULL;
+	    goto FAIL;
+	}
+	message->contents = (const char *) message->map;
+	message->size = st.st_size;
+    }
+
+    close (fd);
+
     message->headers = g_hash_table_new_full (strcase_hash,
 					      strcase_equal,
 					      free,
@@ -120,6 +190,8 @@ _notmuch_message_file_open_ctx (void *ctx, const char *filename)
 
   FAIL:
     fprintf (stderr, "Error opening %s: %s\n", filename, strerror (errno));
+    if (fd >= 0)
+	close (fd);
     notmuch_message_file_close (message);
 
     return NULL;
@@ -137,6 +209,45 @@ notmuch_message_file_close (notmuch_message_file_t *message)
     talloc_free (message);
 }
 
+const char *
+_notmuch_message_file_get_contents (notmuch_message_file_t *message,
+				    size_t *size)
+{
+    *size = message->size;
+    return message->contents;
+}
+
+/* Copy the next line of the file, (including its newline, if any),
+ * into message->line, like getline does for a FILE*. Returns the
+ * length of the line or -1 at the end of the file. */
+static ssize_t
+_notmuch_message_file_next_line (notmuch_message_file_t *message)
+{
+    const char *start, *end;
+    size_t len;
+
+    if (message->offset >= message->size)
+	return -1;
+
+    start = message->contents + message->offset;
+    end = memchr (start, '\n', message->size - message->offset);
+    if (end)
+	len = end - start + 1;
+    else
+	len = message->size - message->offset;
+
+    if (len + 1 > message->line_size) {
+	message->line_size = len + 1 > 128 ? len + 1 : 128;
+	message->line = xrealloc (message->line, message->line_size);
+    }
+
+    memcpy (message->line, start, len);
+    message->line[len] = '\0';
+    message->offset += len;
+
+    return len;
+}
+
 void
 notmuch_message_file_restrict_headersv (notmuch_message_file_t *message,
 					va_list va_headers)
@@ -223,14 +334,10 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
     char *header, *decoded_value, *header_sofar, *combined_header;
     const char *s, *colon;
     int match, newhdr, hdrsofar, is_received;
-    static int initialized = 0;
 
     is_received = (strcmp(header_desired,"received") == 0);
 
-    if (! initialized) {
-	g_mime_init (0);
-	initialized = 1;
-    }
+    _notmuch_index_init ();
 
     message->parsing_started = 1;
 
@@ -249,9 +356,8 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
 
 #define NEXT_HEADER_LINE(closure)				\
     while (1) {							\
-	ssize_t bytes_read = getline (&message->line,		\
-				      &message->line_size,	\
-				      message->file);		\
+	ssize_t bytes_read;					\
+	bytes_read = _notmuch_message_file_next_line (message);	\
 	if (bytes_read == -1) {					\
 	    message->parsing_finished = 1;			\
 	    break;						\
@@ -360,14 +466,10 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
 	    return decoded_value;
     }
 
-    if (message->parsing_finished) {
-        fclose (message->file);
-        message->file = NULL;
-    }
-
     if (message->line)
 	free (message->line);
     message->line = NULL;
+    message->line_size = 0;
 
     if (message->value.size) {
 	free (message->value.str);
@@ -29,6 +29,13 @@ struct visible _notmuch_message {
     notmuch_database_t *notmuch;
     Xapian::docid doc_id;
     int frozen;
+    /* Whether the tags of the message changed since it was last
+     * synchronized to the database, (see _notmuch_message_sync). */
+    notmuch_bool_t modified;
+    /* The tags of the message when they were first changed while it
+     * was frozen, (so that thawing can tell whether they ended up
+     * changed at all). */
+    notmuch_string_list_t *frozen_tags;
     char *message_id;
     char *thread_id;
     char *in_reply_to;
@@ -42,8 +49,21 @@ struct visible _notmuch_message {
 
     Xapian::Document doc;
     Xapian::termcount termpos;
+
+    /* The term generator used by _notmuch_message_gen_terms, (the
+     * database's own, except while being indexed by a
+     * notmuch_indexer_t). */
+    Xapian::TermGenerator *term_gen;
+
+    /* How many more bytes of the body, (and of the current part of
+     * it), may be indexed, (see _notmuch_message_gen_body_terms). */
+    size_t body_bytes_left;
+    size_t part_bytes_left;
 };
 
+/* A limit of 0 on indexed bytes means there's no limit at all. */
+#define INDEX_LIMIT(limit) ((limit) ? (limit) : (size_t) -1)
+
 #define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
 
 struct maildir_flag_tag {
@@ -98,6 +118,8 @@ _notmuch_message_create_for_document (const void *talloc_owner,
     message->doc_id = doc_id;
 
     message->frozen = 0;
+    message->modified = FALSE;
+    message->frozen_tags = NULL;
     message->flags = 0;
 
     /* Each of these will be lazily created as needed. */
@@ -130,6 +152,11 @@ _notmuch_message_create_for_document (const void *talloc_owner,
     message->doc = doc;
     message->termpos = 0;
 
+    message->term_gen = notmuch->term_gen;
+
+    message->body_bytes_left = INDEX_LIMIT (notmuch->index_max_message_bytes);
+    message->part_bytes_left = INDEX_LIMIT (notmuch->index_max_part_bytes);
+
     return message;
 }
 
@@ -222,7 +249,7 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
     if (message)
 	return talloc_steal (notmuch, message);
 
-    term = talloc_asprintf (NULL, "%s%s",
+    term = talloc_asprintf (notmuch, "%s%s",
 			    _find_prefix ("id"), message_id);
     if (term == NULL) {
 	*status_ret = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
@@ -251,13 +278,97 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 						    doc_id, doc, status_ret);
 
     /* We want to inform the caller that we had to create a new
-     * document. */
-    if (*status_ret == NOTMUCH_PRIVATE_STATUS_SUCCESS)
+     * document. Adding it counts as a change, (so that its first
+     * sync gives it a revision, even without any tags). */
+    if (*status_ret == NOTMUCH_PRIVATE_STATUS_SUCCESS) {
 	*status_ret = NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND;
+	message->modified = TRUE;
+    }
 
     return message;
 }
 
+/* Create a new notmuch_message_t object for the message with ID
+ * 'message_id', for indexing outside of the thread that owns the
+ * database, (see notmuch_indexer_index_file).
+ *
+ * The new message has a document holding only the message ID, and no
+ * document ID. Its terms are generated with 'term_gen' rather than
+ * with the database's term generator, so several messages can be
+ * indexed at once as long as each has a term generator of its own.
+ * Nothing is read from or written to 'notmuch'.
+ *
+ * Before the message can be added to the database it must be given a
+ * document ID with _notmuch_message_attach.
+ *
+ * If an error occurs, this function will return NULL and *status
+ * will be set as appropriate.
+ */
+notmuch_message_t *
+_notmuch_message_create_unattached (const void *talloc_owner,
+				    notmuch_database_t *notmuch,
+				    const char *message_id,
+				    Xapian::TermGenerator *term_gen,
+				    notmuch_private_status_t *status_ret)
+{
+    notmuch_message_t *message;
+    Xapian::Document doc;
+    char *term;
+
+    /* This runs in indexer threads, so nothing may be allocated
+     * without a parent, (see notmuch_indexed_file_t). */
+    term = talloc_asprintf (talloc_owner, "%s%s",
+			    _find_prefix ("id"), message_id);
+    if (term == NULL) {
+	*status_ret = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
+	return NULL;
+    }
+
+    doc.add_term (term, 0);
+    talloc_free (term);
+
+    doc.add_value (NOTMUCH_VALUE_MESSAGE_ID, message_id);
+
+    message = _notmuch_message_create_for_document (talloc_owner, notmuch,
+						    0, doc, status_ret);
+    if (message)
+	message->term_gen = term_gen;
+
+    return message;
+}
+
+/* Give 'message', (created by _notmuch_message_create_unattached), a
+ * new document ID in 'notmuch' so that _notmuch_message_sync will add
+ * it to the database as a new document.
+ *
+ * The message then belongs to 'notmuch', (as with
+ * _notmuch_message_create_for_message_id), and generates any further
+ * terms with the database's term generator.
+ */
+notmuch_private_status_t
+_notmuch_message_attach (notmuch_message_t *message,
+			 notmuch_database_t *notmuch)
+{
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	INTERNAL_ERROR ("Failure to ensure database is writable.");
+
+    try {
+	message->doc_id = _notmuch_database_generate_doc_id (notmuch);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred creating message: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_PRIVATE_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    message->notmuch = notmuch;
+    message->term_gen = notmuch->term_gen;
+    message->modified = TRUE;
+    talloc_steal (notmuch, message);
+
+    return NOTMUCH_PRIVATE_STATUS_SUCCESS;
+}
+
 static char *
 _notmuch_message_get_term (notmuch_message_t *message,
 			   Xapian::TermIterator &i, Xapian::TermIterator &end,
@@ -309,10 +420,22 @@ _notmuch_message_ensure_metadata (notmuch_message_t *message)
     i = message->doc.termlist_begin ();
     end = message->doc.termlist_end ();
 
-    /* Get thread */
-    if (!message->thread_id)
+    /* Get thread, (which is the thread this message's thread was
+     * merged into, if any, rather than the one in its term). */
+    if (!message->thread_id) {
 	message->thread_id =
 	    _notmuch_message_get_term (message, i, end, thread_prefix);
+	if (message->thread_id) {
+	    const char *thread_id;
+
+	    thread_id = _notmuch_database_resolve_thread_id (message->notmuch,
+							     message->thread_id);
+	    if (thread_id != message->thread_id) {
+		talloc_free (message->thread_id);
+		message->thread_id = talloc_strdup (message, thread_id);
+	    }
+	}
+    }
 
     /* Get tags */
     assert (strcmp (thread_prefix, tag_prefix) < 0);
@@ -410,6 +533,35 @@ _notmuch_message_ensure_message_file (notmuch_message_t *message)
 const char *
 notmuch_message_get_header (notmuch_message_t *message, const char *header)
 {
+    Xapian::valueno slot = Xapian::BAD_VALUENO;
+
+    /* Headers used for thread summaries are stored in document
+     * values, so prefer those over opening the message file. */
+    if (strcasecmp (header, "from") == 0)
+	slot = NOTMUCH_VALUE_FROM;
+    else if (strcasecmp (header, "subject") == 0)
+	slot = NOTMUCH_VALUE_SUBJECT;
+    else if (strcasecmp (header, "date") == 0)
+	slot = NOTMUCH_VALUE_DATE;
+
+    if (slot != Xapian::BAD_VALUENO) {
+	try {
+	    std::string value = message->doc.get_value (slot);
+
+	    /* Since database version 2 every message has these values,
+	     * so an empty value means an empty (or missing) header.
+	     * Before that, an empty value just means it was never
+	     * recorded and we must fall back to the file. */
+	    if (! value.empty () || message->notmuch->version >= 2)
+		return talloc_strdup (message, value.c_str ());
+	} catch (Xapian::Error &error) {
+	    fprintf (stderr, "A Xapian exception occurred when reading header: %s\n",
+		     error.get_msg().c_str());
+	    message->notmuch->exception_reported = TRUE;
+	    return NULL;
+	}
+    }
+
     _notmuch_message_ensure_message_file (message);
     if (message->message_file == NULL)
 	return NULL;
@@ -464,9 +616,10 @@ notmuch_status_t
 _notmuch_message_add_filename (notmuch_message_t *message,
 			       const char *filename)
 {
-    const char *relative, *directory;
+    const char *relative, *directory, *basename;
     notmuch_status_t status;
     void *local = talloc_new (message);
+    unsigned int directory_id;
     char *direntry;
 
     if (filename == NULL)
@@ -478,15 +631,19 @@ _notmuch_message_add_filename (notmuch_message_t *message,
     if (status)
 	return status;
 
-    status = _notmuch_database_filename_to_direntry (local,
-						     message->notmuch,
-						     filename, &direntry);
+    status = _notmuch_database_split_filename (local, message->notmuch,
+					       filename, &directory_id,
+					       &basename);
     if (status)
 	return status;
 
+    direntry = talloc_asprintf (local, "%u:%s", directory_id, basename);
+
     /* New file-direntry allows navigating to this message with
      * notmuch_directory_get_child_files() . */
     _notmuch_message_add_term (message, "file-direntry", direntry);
+    _notmuch_directory_files_add (message->notmuch, directory_id, basename,
+				  message->doc_id);
 
     /* New terms allow user to search with folder: specification. */
     _notmuch_message_gen_terms (message, "folder", directory);
@@ -519,16 +676,21 @@ _notmuch_message_remove_filename (notmuch_message_t *message,
     void *local = talloc_new (message);
     char *zfolder_prefix = talloc_asprintf(local, "Z%s", folder_prefix);
     int zfolder_prefix_len = strlen (zfolder_prefix);
+    const char *basename;
+    unsigned int directory_id;
     char *direntry;
     notmuch_private_status_t private_status;
     notmuch_status_t status;
     Xapian::TermIterator i, last;
 
-    status = _notmuch_database_filename_to_direntry (local, message->notmuch,
-						     filename, &direntry);
+    status = _notmuch_database_split_filename (local, message->notmuch,
+					       filename, &directory_id,
+					       &basename);
     if (status)
 	return status;
 
+    direntry = talloc_asprintf (local, "%u:%s", directory_id, basename);
+
     /* Unlink this file from its parent directory. */
     private_status = _notmuch_message_remove_term (message,
 						   "file-direntry", direntry);
@@ -537,6 +699,9 @@ _notmuch_message_remove_filename (notmuch_message_t *message,
     if (status)
 	return status;
 
+    _notmuch_directory_files_remove (message->notmuch, directory_id,
+				     basename);
+
     /* Re-synchronize "folder:" terms for this message. This requires:
      *  1. removing all "folder:" terms
      *  2. removing all "folder:" stemmed terms
@@ -809,6 +974,70 @@ _notmuch_message_set_date (notmuch_message_t *message,
 			    Xapian::sortable_serialise (time_value));
 }
 
+/* Record the headers needed for thread summaries as document values,
+ * (see notmuch_message_get_header). A NULL header is stored as an
+ * empty value. */
+void
+_notmuch_message_set_header_values (notmuch_message_t *message,
+				    const char *date,
+				    const char *from,
+				    const char *subject)
+{
+    message->doc.add_value (NOTMUCH_VALUE_DATE, date ? date : "");
+    message->doc.add_value (NOTMUCH_VALUE_FROM, from ? from : "");
+    message->doc.add_value (NOTMUCH_VALUE_SUBJECT, subject ? subject : "");
+}
+
+/* Return the tags in the document of 'message', (not the cached
+ * tag_list, which may be stale while the tags are being changed). */
+static notmuch_string_list_t *
+_notmuch_message_get_tag_terms (notmuch_message_t *message)
+{
+    Xapian::TermIterator i, end;
+
+    i = message->doc.termlist_begin ();
+    end = message->doc.termlist_end ();
+
+    return _notmuch_database_get_terms_with_prefix (message, i, end,
+						    _find_prefix ("tag"));
+}
+
+/* Mark the tags of 'message' as about to change, (recording them
+ * first if the message is frozen and this is their first change). */
+static void
+_notmuch_message_tags_changing (notmuch_message_t *message)
+{
+    if (message->frozen && ! message->modified)
+	message->frozen_tags = _notmuch_message_get_tag_terms (message);
+
+    message->modified = TRUE;
+}
+
+/* Whether the tags of 'message' are still those recorded when they
+ * were first changed while frozen, (as after "-foo +foo"). */
+static notmuch_bool_t
+_notmuch_message_tags_restored (notmuch_message_t *message)
+{
+    notmuch_string_list_t *tags;
+    notmuch_string_node_t *a, *b;
+
+    if (message->frozen_tags == NULL)
+	return FALSE;
+
+    tags = _notmuch_message_get_tag_terms (message);
+    if (unlikely (tags == NULL))
+	return FALSE;
+
+    for (a = tags->head, b = message->frozen_tags->head;
+	 a && b && strcmp (a->string, b->string) == 0;
+	 a = a->next, b = b->next)
+	;
+
+    talloc_free (tags);
+
+    return a == NULL && b == NULL;
+}
+
 /* Synchronize changes made to message->doc out into the database. */
 void
 _notmuch_message_sync (notmuch_message_t *message)
@@ -818,8 +1047,27 @@ _notmuch_message_sync (notmuch_message_t *message)
     if (message->notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
 	return;
 
+    if (message->frozen_tags) {
+	if (message->modified && _notmuch_message_tags_restored (message))
+	    message->modified = FALSE;
+	talloc_free (message->frozen_tags);
+	message->frozen_tags = NULL;
+    }
+
+    /* Stamp a change to the tags with a new revision, so that
+     * "notmuch dump --since" finds it. */
+    if (message->modified) {
+	unsigned long revision;
+
+	revision = _notmuch_database_next_revision (message->notmuch);
+	message->doc.add_value (NOTMUCH_VALUE_REVISION,
+				Xapian::sortable_serialise (revision));
+    }
+
     db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
     db->replace_document (message->doc_id, message->doc);
+
+    message->modified = FALSE;
 }
 
 /* Delete a message document from the database. */
@@ -833,6 +1081,9 @@ _notmuch_message_delete (notmuch_message_t *message)
     if (status)
 	return status;
 
+    _notmuch_database_forget_message_id (message->notmuch,
+					 notmuch_message_get_message_id (message));
+
     db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
     db->delete_document (message->doc_id);
     return NOTMUCH_STATUS_SUCCESS;
@@ -851,6 +1102,19 @@ _notmuch_message_close (notmuch_message_t *message)
     }
 }
 
+/* Make 'message' refer to 'notmuch' from now on. This is used for
+ * messages read through a reader handle (see
+ * _notmuch_database_open_reader) once they are handed back to the
+ * thread that owns 'notmuch'. The document itself stays valid since
+ * Xapian reference-counts the underlying database. */
+void
+_notmuch_message_set_database (notmuch_message_t *message,
+			       notmuch_database_t *notmuch)
+{
+    message->notmuch = notmuch;
+    message->term_gen = notmuch->term_gen;
+}
+
 /* Add a name:value term to 'message', (the actual term will be
  * encoded by prefixing the value with a short prefix). See
  * NORMAL_PREFIX and BOOLEAN_PREFIX arrays for the mapping of term
@@ -879,6 +1143,11 @@ _notmuch_message_add_term (notmuch_message_t *message,
 
     talloc_free (term);
 
+    /* The thread ID is also kept in a value, so that thread searches
+     * can collapse on it (see NOTMUCH_VALUE_THREAD_ID). */
+    if (strcmp (prefix_name, "thread") == 0)
+	message->doc.add_value (NOTMUCH_VALUE_THREAD_ID, value);
+
     _notmuch_message_invalidate_metadata (message, prefix_name);
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
@@ -892,7 +1161,7 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text)
 {
-    Xapian::TermGenerator *term_gen = message->notmuch->term_gen;
+    Xapian::TermGenerator *term_gen = message->term_gen;
 
     if (text == NULL)
 	return NOTMUCH_PRIVATE_STATUS_NULL_POINTER;
@@ -912,6 +1181,61 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
 
+/* Start indexing a new part of the body of 'message', with the full
+ * per-part limit of indexed bytes ahead of it. */
+void
+_notmuch_message_begin_body_part (notmuch_message_t *message)
+{
+    message->part_bytes_left =
+	INDEX_LIMIT (message->notmuch->index_max_part_bytes);
+}
+
+/* Index 'length' bytes of 'text', (which need not be nul-terminated),
+ * as the next piece of the body of 'message'. Term positions carry on
+ * from the previous piece, so a body can be indexed piece by piece
+ * without ever being held in memory at once.
+ *
+ * Once the per-part or per-message limit of indexed bytes, (see
+ * notmuch_database_set_index_limits), is reached, the rest of the
+ * part or message is ignored. A word straddling the limit is dropped
+ * rather than indexed in part.
+ */
+void
+_notmuch_message_gen_body_terms (notmuch_message_t *message,
+				 const char *text,
+				 size_t length)
+{
+    Xapian::TermGenerator *term_gen = message->term_gen;
+    size_t allowed = length;
+
+    if (allowed > message->part_bytes_left)
+	allowed = message->part_bytes_left;
+    if (allowed > message->body_bytes_left)
+	allowed = message->body_bytes_left;
+
+    if (allowed < length) {
+	while (allowed && ! isspace ((unsigned char) text[allowed - 1]))
+	    allowed--;
+
+	/* Whichever limit was hit, exhaust it. */
+	if (message->part_bytes_left < length)
+	    message->part_bytes_left = allowed;
+	if (message->body_bytes_left < length)
+	    message->body_bytes_left = allowed;
+    }
+
+    message->part_bytes_left -= allowed;
+    message->body_bytes_left -= allowed;
+
+    if (allowed == 0)
+	return;
+
+    term_gen->set_document (message->doc);
+    term_gen->set_termpos (message->termpos);
+    term_gen->index_text (Xapian::Utf8Iterator (text, allowed));
+    message->termpos = term_gen->get_termpos ();
+}
+
 /* Remove a name:value term from 'message', (the actual term will be
  * encoded by prefixing the value with a short prefix). See
  * NORMAL_PREFIX and BOOLEAN_PREFIX arrays for the mapping of term
@@ -946,11 +1270,40 @@ _notmuch_message_remove_term (notmuch_message_t *message,
 
     talloc_free (term);
 
+    if (strcmp (prefix_name, "thread") == 0 &&
+	message->doc.get_value (NOTMUCH_VALUE_THREAD_ID) == value)
+    {
+	message->doc.remove_value (NOTMUCH_VALUE_THREAD_ID);
+    }
+
     _notmuch_message_invalidate_metadata (message, prefix_name);
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
 
+/* Whether 'message' has the name:value term, (see
+ * _notmuch_message_add_term). */
+static notmuch_bool_t
+_notmuch_message_has_term (notmuch_message_t *message,
+			   const char *prefix_name,
+			   const char *value)
+{
+    Xapian::TermIterator i;
+    notmuch_bool_t found;
+    char *term;
+
+    term = talloc_asprintf (message, "%s%s",
+			    _find_prefix (prefix_name), value);
+
+    i = message->doc.termlist_begin ();
+    i.skip_to (term);
+    found = (i != message->doc.termlist_end () && *i == term);
+
+    talloc_free (term);
+
+    return found;
+}
+
 notmuch_status_t
 notmuch_message_add_tag (notmuch_message_t *message, const char *tag)
 {
@@ -967,6 +1320,12 @@ notmuch_message_add_tag (notmuch_message_t *message, const char *tag)
     if (strlen (tag) > NOTMUCH_TAG_MAX)
 	return NOTMUCH_STATUS_TAG_TOO_LONG;
 
+    /* Don't rewrite the document for a tag it already has. */
+    if (_notmuch_message_has_term (message, "tag", tag))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    _notmuch_message_tags_changing (message);
+
     private_status = _notmuch_message_add_term (message, "tag", tag);
     if (private_status) {
 	INTERNAL_ERROR ("_notmuch_message_add_term return unexpected value: %d\n",
@@ -995,6 +1354,12 @@ notmuch_message_remove_tag (notmuch_message_t *message, const char *tag)
     if (strlen (tag) > NOTMUCH_TAG_MAX)
 	return NOTMUCH_STATUS_TAG_TOO_LONG;
 
+    /* Nor for a tag it doesn't have. */
+    if (! _notmuch_message_has_term (message, "tag", tag))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    _notmuch_message_tags_changing (message);
+
     private_status = _notmuch_message_remove_term (message, "tag", tag);
     if (private_status) {
 	INTERNAL_ERROR ("_notmuch_message_remove_term return unexpected value: %d\n",
@@ -1348,6 +1713,8 @@ notmuch_message_remove_all_tags (notmuch_message_t *message)
     {
 	tag = notmuch_tags_get (tags);
 
+	_notmuch_message_tags_changing (message);
+
 	private_status = _notmuch_message_remove_term (message, "tag", tag);
 	if (private_status) {
 	    INTERNAL_ERROR ("_notmuch_message_remove_term return unexpected value: %d\n",
@@ -1355,7 +1722,7 @@ notmuch_message_remove_all_tags (notmuch_message_t *message)
 	}
     }
 
-    if (! message->frozen)
+    if (! message->frozen && message->modified)
 	_notmuch_message_sync (message);
 
     talloc_free (tags);
@@ -1387,8 +1754,18 @@ notmuch_message_thaw (notmuch_message_t *message)
 
     if (message->frozen > 0) {
 	message->frozen--;
-	if (message->frozen == 0)
-	    _notmuch_message_sync (message);
+	/* Only a message whose tags actually changed while frozen
+	 * needs writing back, (comparing the final tags, since the
+	 * same tag may have been removed and added back). */
+	if (message->frozen == 0 && message->modified) {
+	    if (_notmuch_message_tags_restored (message)) {
+		message->modified = FALSE;
+		talloc_free (message->frozen_tags);
+		message->frozen_tags = NULL;
+	    } else {
+		_notmuch_message_sync (message);
+	    }
+	}
 	return NOTMUCH_STATUS_SUCCESS;
     } else {
 	return NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW;
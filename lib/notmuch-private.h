@@ -111,7 +111,14 @@ _internal_error (const char *format, ...) PRINTF_ATTRIBUTE (1, 2);
 
 typedef enum {
     NOTMUCH_VALUE_TIMESTAMP = 0,
-    NOTMUCH_VALUE_MESSAGE_ID
+    NOTMUCH_VALUE_MESSAGE_ID,
+    NOTMUCH_VALUE_FROM,
+    NOTMUCH_VALUE_SUBJECT,
+    NOTMUCH_VALUE_DATE,
+    NOTMUCH_VALUE_THREAD_ID,
+    NOTMUCH_VALUE_SUBDIRECTORIES,
+    NOTMUCH_VALUE_FILES,
+    NOTMUCH_VALUE_REVISION
 } notmuch_value_t;
 
 /* Xapian (with flint backend) complains if we provide a term longer
@@ -120,6 +127,7 @@ typedef enum {
 #define NOTMUCH_TERM_MAX 245
 
 #define NOTMUCH_METADATA_THREAD_ID_PREFIX "thread_id_"
+#define NOTMUCH_METADATA_THREAD_ALIAS_PREFIX "thread_alias_"
 
 /* For message IDs we have to be even more restrictive. Beyond fitting
  * into the term limit, we also use message IDs to construct
@@ -162,6 +170,7 @@ typedef enum _notmuch_private_status {
      :									\
      (notmuch_status_t) private_status)
 
+struct visible _notmuch_doc_id_set;
 typedef struct _notmuch_doc_id_set notmuch_doc_id_set_t;
 
 /* database.cc */
@@ -193,6 +202,9 @@ _notmuch_database_get_directory_db_path (const char *path);
 unsigned int
 _notmuch_database_generate_doc_id (notmuch_database_t *notmuch);
 
+notmuch_database_t *
+_notmuch_database_open_reader (void *ctx, notmuch_database_t *notmuch);
+
 notmuch_private_status_t
 _notmuch_database_find_unique_doc_id (notmuch_database_t *notmuch,
 				      const char *prefix_name,
@@ -209,6 +221,16 @@ _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
 				      unsigned int doc_id);
 
+unsigned long
+_notmuch_database_next_revision (notmuch_database_t *notmuch);
+
+notmuch_status_t
+_notmuch_database_split_filename (void *ctx,
+				  notmuch_database_t *notmuch,
+				  const char *filename,
+				  unsigned int *directory_id,
+				  const char **basename);
+
 notmuch_status_t
 _notmuch_database_filename_to_direntry (void *ctx,
 					notmuch_database_t *notmuch,
@@ -225,14 +247,40 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 unsigned int
 _notmuch_directory_get_document_id (notmuch_directory_t *directory);
 
+void
+_notmuch_directory_files_add (notmuch_database_t *notmuch,
+			      unsigned int directory_id,
+			      const char *basename,
+			      unsigned int doc_id);
+
+void
+_notmuch_directory_files_remove (notmuch_database_t *notmuch,
+				 unsigned int directory_id,
+				 const char *basename);
+
+notmuch_bool_t
+_notmuch_directory_files_lookup (notmuch_database_t *notmuch,
+				 unsigned int directory_id,
+				 const char *basename,
+				 unsigned int *doc_id);
+
+notmuch_status_t
+_notmuch_database_write_directory_files (notmuch_database_t *notmuch);
+
 /* thread.cc */
 
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_sort_t sort);
+void
+_notmuch_thread_set_database (notmuch_thread_t *thread,
+			      notmuch_database_t *notmuch);
+
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      const char **thread_ids,
+			      unsigned int count,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_sort_t sort,
+			      notmuch_thread_t **threads_ret);
 
 /* message.cc */
 
@@ -247,6 +295,10 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 					const char *message_id,
 					notmuch_private_status_t *status);
 
+notmuch_private_status_t
+_notmuch_message_attach (notmuch_message_t *message,
+			 notmuch_database_t *notmuch);
+
 unsigned int
 _notmuch_message_get_doc_id (notmuch_message_t *message);
 
@@ -268,6 +320,14 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text);
 
+void
+_notmuch_message_begin_body_part (notmuch_message_t *message);
+
+void
+_notmuch_message_gen_body_terms (notmuch_message_t *message,
+				 const char *text,
+				 size_t length);
+
 void
 _notmuch_message_upgrade_filename_storage (notmuch_message_t *message);
 
@@ -290,6 +350,12 @@ void
 _notmuch_message_set_date (notmuch_message_t *message,
 			   const char *date);
 
+void
+_notmuch_message_set_header_values (notmuch_message_t *message,
+				    const char *date,
+				    const char *from,
+				    const char *subject);
+
 void
 _notmuch_message_sync (notmuch_message_t *message);
 
@@ -299,6 +365,10 @@ _notmuch_message_delete (notmuch_message_t *message);
 void
 _notmuch_message_close (notmuch_message_t *message);
 
+void
+_notmuch_message_set_database (notmuch_message_t *message,
+			       notmuch_database_t *notmuch);
+
 /* Get a copy of the data in this message document.
  *
  * Caller should talloc_free the result when done.
@@ -325,12 +395,6 @@ const char *
 notmuch_message_get_author (notmuch_message_t *message);
 
 
-/* index.cc */
-
-notmuch_status_t
-_notmuch_message_index_file (notmuch_message_t *message,
-			     const char *filename);
-
 /* message-file.c */
 
 /* XXX: I haven't decided yet whether these will actually get exported
@@ -356,6 +420,14 @@ _notmuch_message_file_open_ctx (void *ctx, const char *filename);
 void
 notmuch_message_file_close (notmuch_message_file_t *message);
 
+/* Return the entire contents of the file of 'message', (which are
+ * read only once, however often they're used), storing their length
+ * in 'size'. The contents are not nul-terminated and are valid until
+ * the message is closed. */
+const char *
+_notmuch_message_file_get_contents (notmuch_message_file_t *message,
+				    size_t *size);
+
 /* Restrict 'message' to only save the named headers.
  *
  * When the caller is only interested in a short list of headers,
@@ -398,6 +470,15 @@ const char *
 notmuch_message_file_get_header (notmuch_message_file_t *message,
 				 const char *header);
 
+/* index.cc */
+
+void
+_notmuch_index_init (void);
+
+notmuch_status_t
+_notmuch_message_index_file (notmuch_message_t *message,
+			     notmuch_message_file_t *message_file);
+
 /* messages.c */
 
 typedef struct _notmuch_message_node {
@@ -444,14 +525,6 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages);
 void
 _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages);
 
-notmuch_bool_t
-_notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
-                              unsigned int doc_id);
-
-void
-_notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
-                            unsigned int doc_id);
-
 /* message.cc */
 
 void
@@ -463,6 +536,9 @@ _notmuch_message_add_reply (notmuch_message_t *message,
 char *
 notmuch_sha1_of_string (const char *str);
 
+char *
+notmuch_sha1_of_buffer (const void *buffer, size_t size);
+
 char *
 notmuch_sha1_of_file (const char *filename);
 
@@ -493,6 +569,19 @@ _notmuch_string_list_append (notmuch_string_list_t *list,
 void
 _notmuch_string_list_sort (notmuch_string_list_t *list);
 
+/* doc-id-set.c */
+
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create (const void *ctx);
+
+notmuch_bool_t
+_notmuch_doc_id_set_add (notmuch_doc_id_set_t *doc_ids,
+			 unsigned int doc_id);
+
+notmuch_bool_t
+_notmuch_doc_id_set_claim (notmuch_doc_id_set_t *doc_ids,
+			   unsigned int doc_id);
+
 /* tags.c */
 
 notmuch_tags_t *
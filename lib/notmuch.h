@@ -117,12 +117,16 @@ notmuch_status_to_string (notmuch_status_t status);
 typedef struct _notmuch_database notmuch_database_t;
 typedef struct _notmuch_query notmuch_query_t;
 typedef struct _notmuch_threads notmuch_threads_t;
+typedef struct _notmuch_thread_ids notmuch_thread_ids_t;
 typedef struct _notmuch_thread notmuch_thread_t;
 typedef struct _notmuch_messages notmuch_messages_t;
 typedef struct _notmuch_message notmuch_message_t;
 typedef struct _notmuch_tags notmuch_tags_t;
 typedef struct _notmuch_directory notmuch_directory_t;
 typedef struct _notmuch_filenames notmuch_filenames_t;
+typedef struct _notmuch_indexer notmuch_indexer_t;
+typedef struct _notmuch_indexed_file notmuch_indexed_file_t;
+typedef struct _notmuch_tag_dump notmuch_tag_dump_t;
 
 /* Create a new, empty notmuch database located at 'path'.
  *
@@ -180,6 +184,22 @@ notmuch_database_open (const char *path,
 void
 notmuch_database_close (notmuch_database_t *database);
 
+/* Limit how much body text is indexed for messages added to the
+ * given database from now on.
+ *
+ * At most 'max_part_bytes' bytes of each MIME part and at most
+ * 'max_message_bytes' bytes of each message are indexed, (the rest
+ * can't be found by searching for words, but the message is otherwise
+ * added as usual). A limit of 0, (the default), means no limit.
+ *
+ * Indexers created with notmuch_indexer_create use the limits in
+ * effect when they were created.
+ */
+void
+notmuch_database_set_index_limits (notmuch_database_t *database,
+				   size_t max_part_bytes,
+				   size_t max_message_bytes);
+
 /* Return the database path of the given database.
  *
  * The return value is a string owned by notmuch so should not be
@@ -191,6 +211,19 @@ notmuch_database_get_path (notmuch_database_t *database);
 unsigned int
 notmuch_database_get_version (notmuch_database_t *database);
 
+/* Return the revision of the last change to the tags of any message
+ * in the given database.
+ *
+ * Each change to the tags of a message, (and each message added),
+ * takes the next revision and records it with the message, so the
+ * messages added or whose tags changed after revision 'r' can be
+ * found by searching for "lastmod:<r+1>..<revision>". Messages whose
+ * tags haven't changed since before revisions were recorded have no
+ * revision at all.
+ */
+unsigned long
+notmuch_database_get_revision (notmuch_database_t *database);
+
 /* Does this database need to be upgraded before writing to it?
  *
  * If this function returns TRUE then no functions that modify the
@@ -254,6 +287,78 @@ notmuch_database_begin_atomic (notmuch_database_t *notmuch);
 notmuch_status_t
 notmuch_database_end_atomic (notmuch_database_t *notmuch);
 
+/* Begin committing modifications to the database in batches.
+ *
+ * Normally each outermost atomic section is its own transaction. In
+ * batch mode, consecutive atomic sections (and any modifications
+ * between them) are grouped into one transaction, which is committed
+ * to disk at the end of the first atomic section after which either
+ * 'max_messages' atomic sections have completed, 'max_bytes' bytes
+ * of message files have been added, or 'max_seconds' seconds have
+ * passed since the batch began. A limit of 0 disables that limit.
+ *
+ * Atomicity is unchanged: if the process is interrupted, the
+ * database reflects a prefix of the completed atomic sections,
+ * (possibly fewer of them than without batch mode).
+ *
+ * Batch mode lasts until notmuch_database_end_batch, (or until the
+ * database is closed, which ends it too). Calling this function
+ * while already in batch mode just changes the limits.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully entered batch mode, (this is
+ *	also returned, with no effect, for a read-only database).
+ */
+notmuch_status_t
+notmuch_database_begin_batch (notmuch_database_t *notmuch,
+			      unsigned int max_messages,
+			      size_t max_bytes,
+			      unsigned int max_seconds);
+
+/* Commit any outstanding batch and leave batch mode.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully committed the batch.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	the batch was not committed.
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The database is still inside
+ *	an atomic section.
+ */
+notmuch_status_t
+notmuch_database_end_batch (notmuch_database_t *notmuch);
+
+/* Move the messages of merged threads into the threads they were
+ * merged into.
+ *
+ * When a new message joins two existing threads, the database only
+ * records that one thread was merged into the other, (so adding the
+ * message takes the same time however large the threads are), and
+ * searches and thread objects resolve such merges as they go. This
+ * function rewrites the messages of every merged thread to carry the
+ * thread ID they were merged into, after which the records of the
+ * merges are dropped.
+ *
+ * Each merged thread is moved in its own atomic section, so the
+ * database remains consistent if this is interrupted, (and calling
+ * it again picks up where it left off).
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All merged threads were compacted.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no thread can be compacted.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	some threads may remain to be compacted.
+ */
+notmuch_status_t
+notmuch_database_compact_threads (notmuch_database_t *notmuch);
+
 /* Retrieve a directory object from the database for 'path'.
  *
  * Here, 'path' should be a path relative to the path of 'database'
@@ -317,6 +422,84 @@ notmuch_database_add_message (notmuch_database_t *database,
 			      const char *filename,
 			      notmuch_message_t **message);
 
+/* Create an indexer for 'database'.
+ *
+ * An indexer does the expensive part of adding a message, (parsing
+ * the file and generating its terms), without touching 'database',
+ * so that messages can be indexed in several threads of execution
+ * at once, each with its own indexer, while the thread that owns
+ * 'database' adds the results with notmuch_database_add_indexed_file.
+ *
+ * The indexer must be created (and destroyed) by the thread that owns
+ * 'database', but may then be used by any one thread at a time. It
+ * holds a read-only handle onto the database, so as not to bother
+ * indexing files of messages that are already in the database.
+ *
+ * Returns NULL if the indexer cannot be created, (such as when a
+ * Xapian exception occurs or memory runs out).
+ */
+notmuch_indexer_t *
+notmuch_indexer_create (notmuch_database_t *database);
+
+/* Create the object for adding the message in 'filename' to a
+ * database, to be filled in by notmuch_indexer_index_file.
+ *
+ * Here, 'filename' is as for notmuch_database_add_message. The object
+ * must be created (and later added or destroyed) by the thread that
+ * owns the database, but may be handed to an indexer in any thread
+ * in between.
+ *
+ * Returns NULL if memory runs out.
+ */
+notmuch_indexed_file_t *
+notmuch_indexed_file_create (const char *filename);
+
+/* Read the message of 'indexed' and, if it is not already in the
+ * database, index its contents.
+ *
+ * On success 'indexed' is to be passed to
+ * notmuch_database_add_indexed_file, (which must happen before any
+ * files are removed from the database, so that a renamed file is not
+ * mistaken for a new message). Otherwise it is to be destroyed with
+ * notmuch_indexed_file_destroy.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The file was read (and indexed if needed).
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: an error occurred trying to open the
+ *	file, (such as permission denied, or file not found, etc.).
+ *
+ * NOTMUCH_STATUS_FILE_NOT_EMAIL: the contents of filename don't look
+ *	like an email message.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ */
+notmuch_status_t
+notmuch_indexer_index_file (notmuch_indexer_t *indexer,
+			    notmuch_indexed_file_t *indexed);
+
+/* Destroy an indexer, (from the thread that owns its database). */
+void
+notmuch_indexer_destroy (notmuch_indexer_t *indexer);
+
+/* Add a file indexed by notmuch_indexer_index_file to 'database'.
+ *
+ * This behaves just as notmuch_database_add_message does for the
+ * same file, (with the same return values), but only the thread
+ * linking and the writes are left to do, (a file no indexer has read
+ * is read and indexed here). The 'indexed' object is
+ * consumed whatever the result, so it must not be used afterwards.
+ */
+notmuch_status_t
+notmuch_database_add_indexed_file (notmuch_database_t *database,
+				   notmuch_indexed_file_t *indexed,
+				   notmuch_message_t **message);
+
+/* Destroy an indexed file without adding it to the database. */
+void
+notmuch_indexed_file_destroy (notmuch_indexed_file_t *indexed);
+
 /* Remove a message filename from the given notmuch database. If the
  * message has no more filenames, remove the message.
  *
@@ -387,6 +570,76 @@ notmuch_database_find_message_by_filename (notmuch_database_t *notmuch,
 notmuch_tags_t *
 notmuch_database_get_all_tags (notmuch_database_t *db);
 
+/* Walk the message ID and tags of every message in the database, in
+ * order of message ID, (the order of NOTMUCH_SORT_MESSAGE_ID).
+ *
+ * This gives the same tags as notmuch_message_get_tags for each
+ * message, but reads them straight from the index, tag by tag, rather
+ * than loading the document of each message, which makes it much
+ * faster for visiting all messages, (as "notmuch dump" does). The
+ * memory used grows with the number of messages, (four bytes each),
+ * and the number of distinct sets of tags among them.
+ *
+ * Typical usage might be:
+ *
+ *     notmuch_tag_dump_t *dump;
+ *     notmuch_tags_t *tags;
+ *
+ *     for (dump = notmuch_database_dump_tags (database);
+ *          notmuch_tag_dump_valid (dump);
+ *          notmuch_tag_dump_move_to_next (dump))
+ *     {
+ *         tags = notmuch_tag_dump_get_tags (dump);
+ *         ....
+ *         notmuch_tags_destroy (tags);
+ *     }
+ *
+ *     notmuch_tag_dump_destroy (dump);
+ *
+ * Changes made to the database during the walk may or may not be
+ * seen by it.
+ *
+ * On error this function returns NULL.
+ */
+notmuch_tag_dump_t *
+notmuch_database_dump_tags (notmuch_database_t *notmuch);
+
+/* Is the given 'dump' positioned on a message?
+ *
+ * When this function returns TRUE, notmuch_tag_dump_get_message_id
+ * and notmuch_tag_dump_get_tags will return the message ID and tags
+ * of the current message.
+ *
+ * When this function returns FALSE, the walk is over.
+ */
+notmuch_bool_t
+notmuch_tag_dump_valid (notmuch_tag_dump_t *dump);
+
+/* Get the message ID of the current message of 'dump'.
+ *
+ * The returned string belongs to 'dump' and is only valid until the
+ * next call to notmuch_tag_dump_move_to_next.
+ */
+const char *
+notmuch_tag_dump_get_message_id (notmuch_tag_dump_t *dump);
+
+/* Get the tags of the current message of 'dump', in sorted order.
+ *
+ * The tags object is owned by 'dump', but may be destroyed early
+ * with notmuch_tags_destroy, (which is worthwhile when walking many
+ * messages).
+ */
+notmuch_tags_t *
+notmuch_tag_dump_get_tags (notmuch_tag_dump_t *dump);
+
+/* Move 'dump' on to the next message. */
+void
+notmuch_tag_dump_move_to_next (notmuch_tag_dump_t *dump);
+
+/* Destroy 'dump', (and everything it returned). */
+void
+notmuch_tag_dump_destroy (notmuch_tag_dump_t *dump);
+
 /* Create a new query for 'database'.
  *
  * Here, 'database' should be an open database, (see
@@ -435,6 +688,65 @@ notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort);
 notmuch_sort_t
 notmuch_query_get_sort (notmuch_query_t *query);
 
+/* Skip the first 'offset' results of this query.
+ *
+ * For notmuch_query_search_messages the offset counts messages, while
+ * for notmuch_query_search_threads it counts threads. Skipped threads
+ * are never constructed, so paging through a large result is cheap.
+ *
+ * The default offset is 0. The offset has no effect on
+ * notmuch_query_count_messages.
+ */
+void
+notmuch_query_set_offset (notmuch_query_t *query, unsigned int offset);
+
+/* Return the offset specified for this query. See
+ * notmuch_query_set_offset. */
+unsigned int
+notmuch_query_get_offset (notmuch_query_t *query);
+
+/* Return at most 'limit' results from this query, (after skipping any
+ * results according to notmuch_query_set_offset).
+ *
+ * As with the offset, the limit counts messages for
+ * notmuch_query_search_messages and threads for
+ * notmuch_query_search_threads.
+ *
+ * A negative value, (which is the default), means that all results
+ * will be returned. The limit has no effect on
+ * notmuch_query_count_messages.
+ */
+void
+notmuch_query_set_limit (notmuch_query_t *query, int limit);
+
+/* Return the limit specified for this query. See
+ * notmuch_query_set_limit. */
+int
+notmuch_query_get_limit (notmuch_query_t *query);
+
+/* Specify the number of threads of execution used to construct the
+ * results of notmuch_query_search_threads.
+ *
+ * With the default of 1, each thread is constructed by the calling
+ * thread as the results are iterated. With a larger value, threads
+ * are constructed by a pool of 'jobs' workers, each of which opens
+ * its own read-only handle onto the database. The results are still
+ * returned in the order specified with notmuch_query_set_sort.
+ *
+ * Note: Since the workers open the database anew, they cannot see
+ * changes which have not yet been committed to a database opened
+ * with NOTMUCH_DATABASE_MODE_READ_WRITE.
+ *
+ * A value of 0 is treated as 1.
+ */
+void
+notmuch_query_set_jobs (notmuch_query_t *query, unsigned int jobs);
+
+/* Return the number of jobs specified for this query. See
+ * notmuch_query_set_jobs. */
+unsigned int
+notmuch_query_get_jobs (notmuch_query_t *query);
+
 /* Execute a query for threads, returning a notmuch_threads_t object
  * which can be used to iterate over the results. The returned threads
  * object is owned by the query and as such, will only be valid until
@@ -476,6 +788,39 @@ notmuch_query_get_sort (notmuch_query_t *query);
 notmuch_threads_t *
 notmuch_query_search_threads (notmuch_query_t *query);
 
+/* Execute a query for the IDs of the threads containing matching
+ * messages, returning a notmuch_thread_ids_t object which can be
+ * used to iterate over the results. The returned object is owned by
+ * the query and as such, will only be valid until
+ * notmuch_query_destroy.
+ *
+ * The thread IDs are returned in the same order, and subject to the
+ * same offset and limit, as the threads of
+ * notmuch_query_search_threads. But no notmuch_thread_t objects are
+ * constructed, (nor are any message files read), so this is much
+ * cheaper when only the thread IDs are needed.
+ *
+ * Typical usage might be:
+ *
+ *     notmuch_query_t *query;
+ *     notmuch_thread_ids_t *thread_ids;
+ *
+ *     query = notmuch_query_create (database, query_string);
+ *
+ *     for (thread_ids = notmuch_query_search_thread_ids (query);
+ *          notmuch_thread_ids_valid (thread_ids);
+ *          notmuch_thread_ids_move_to_next (thread_ids))
+ *     {
+ *         printf ("thread:%s\n", notmuch_thread_ids_get (thread_ids));
+ *     }
+ *
+ *     notmuch_query_destroy (query);
+ *
+ * If a Xapian exception occurs this function will return NULL.
+ */
+notmuch_thread_ids_t *
+notmuch_query_search_thread_ids (notmuch_query_t *query);
+
 /* Execute a query for messages, returning a notmuch_messages_t object
  * which can be used to iterate over the results. The returned
  * messages object is owned by the query and as such, will only be
@@ -576,16 +921,67 @@ notmuch_threads_move_to_next (notmuch_threads_t *threads);
 void
 notmuch_threads_destroy (notmuch_threads_t *threads);
 
-/* Return an estimate of the number of messages matching a search
+/* Is the given 'thread_ids' iterator pointing at a valid thread ID.
+ *
+ * When this function returns TRUE, notmuch_thread_ids_get will
+ * return a valid string. Whereas when this function returns FALSE,
+ * notmuch_thread_ids_get will return NULL.
+ */
+notmuch_bool_t
+notmuch_thread_ids_valid (notmuch_thread_ids_t *thread_ids);
+
+/* Get the current thread ID from 'thread_ids'.
  *
- * This function performs a search and returns Xapian's best
- * guess as to number of matching messages.
+ * The returned string belongs to 'thread_ids' and has a lifetime
+ * identical to it (and the query to which it belongs).
+ */
+const char *
+notmuch_thread_ids_get (notmuch_thread_ids_t *thread_ids);
+
+/* Move the 'thread_ids' iterator to the next thread ID.
+ *
+ * If 'thread_ids' is already pointing at the last thread ID then the
+ * iterator will be moved to a point just beyond it, (where
+ * notmuch_thread_ids_valid will return FALSE and
+ * notmuch_thread_ids_get will return NULL).
+ */
+void
+notmuch_thread_ids_move_to_next (notmuch_thread_ids_t *thread_ids);
+
+/* Destroy a notmuch_thread_ids_t object.
+ *
+ * It's not strictly necessary to call this function. All memory from
+ * the notmuch_thread_ids_t object will be reclaimed when the
+ * containing query object is destroyed.
+ */
+void
+notmuch_thread_ids_destroy (notmuch_thread_ids_t *thread_ids);
+
+/* Return the number of messages matching a search
+ *
+ * The count is exact. Queries consisting of a single tag:, id: or
+ * thread: term (or matching all messages) are answered from the
+ * database's term statistics without running a search at all.
  *
  * If a Xapian exception occurs, this function may return 0 (after
  * printing a message).
  */
 unsigned
 notmuch_query_count_messages (notmuch_query_t *query);
+
+/* Return the number of threads containing messages matching a search
+ *
+ * This counts the distinct thread IDs of the matching messages,
+ * without constructing any threads, (so it is much cheaper than
+ * iterating over notmuch_query_search_threads). Like
+ * notmuch_query_count_messages, it is not affected by the query's
+ * offset and limit.
+ *
+ * If a Xapian exception occurs, this function may return 0 (after
+ * printing a message).
+ */
+unsigned
+notmuch_query_count_threads (notmuch_query_t *query);
  
 /* Get the thread ID of 'thread'.
  *
@@ -876,8 +1272,10 @@ notmuch_message_get_date  (notmuch_message_t *message);
 
 /* Get the value of the specified header from 'message'.
  *
- * The value will be read from the actual message file, not from the
- * notmuch database. The header name is case insensitive.
+ * The From, Subject and Date headers are read from values stored in
+ * the notmuch database when the message was indexed. All other
+ * headers are read from the actual message file. The header name is
+ * case insensitive.
  *
  * The returned string belongs to the message so should not be
  * modified or freed by the caller (nor should it be referenced after
@@ -926,6 +1324,9 @@ notmuch_message_get_tags (notmuch_message_t *message);
 #define NOTMUCH_TAG_MAX 200
 
 /* Add a tag to the given message.
+ *
+ * Adding a tag the message already has changes nothing, (and doesn't
+ * write to the database).
  *
  * Return value:
  *
@@ -943,6 +1344,9 @@ notmuch_status_t
 notmuch_message_add_tag (notmuch_message_t *message, const char *tag);
 
 /* Remove a tag from the given message.
+ *
+ * Removing a tag the message doesn't have changes nothing, (and
+ * doesn't write to the database).
  *
  * Return value:
  *
@@ -1210,6 +1614,46 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
 time_t
 notmuch_directory_get_mtime (notmuch_directory_t *directory);
 
+/* Store within the database the names of the subdirectories of
+ * 'directory', as read from the filesystem when its mtime was
+ * 'mtime'.
+ *
+ * These are the names returned by notmuch_directory_get_subdirectories
+ * for as long as the stored mtime of the directory (see
+ * notmuch_directory_set_mtime) is 'mtime'. Since the list of entries
+ * of a directory can't change without changing its mtime, this lets a
+ * client find the subdirectories of an unchanged directory without
+ * reading the directory itself. The names may be any subset of the
+ * subdirectories that is of interest to the client.
+ *
+ * The 'count' names in 'names' must not contain '/'. Store the names
+ * before the mtime, so that an interruption never leaves old names
+ * stored with a new mtime.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Names successfully stored in database.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception
+ *	occurred, names not stored.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so the names cannot be stored.
+ */
+notmuch_status_t
+notmuch_directory_set_subdirectories (notmuch_directory_t *directory,
+				      time_t mtime,
+				      const char **names,
+				      unsigned int count);
+
+/* Get a notmuch_filenames_t iterator listing the names of the
+ * subdirectories stored with notmuch_directory_set_subdirectories.
+ *
+ * Returns NULL if no names were stored with the mtime that is the
+ * stored mtime of the directory (see notmuch_directory_get_mtime). */
+notmuch_filenames_t *
+notmuch_directory_get_subdirectories (notmuch_directory_t *directory);
+
 /* Get a notmuch_filenames_t iterator listing all the filenames of
  * messages in the database within the given directory.
  *
@@ -23,10 +23,41 @@
 
 #include <glib.h> /* GHashTable, GPtrArray */
 
+#define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
+
 struct _notmuch_query {
     notmuch_database_t *notmuch;
     const char *query_string;
     notmuch_sort_t sort;
+    unsigned int offset;
+    int limit;
+    unsigned int jobs;
+
+    /* The parsed query, (NULL until first needed). */
+    Xapian::Query *xapian_query;
+};
+
+/* The number of parsed queries remembered by each database. */
+#define NOTMUCH_QUERY_CACHE_SIZE 16
+
+typedef struct _notmuch_query_cache_entry {
+    char *query_string;
+    Xapian::Query *xapian_query;
+    struct _notmuch_query_cache_entry *prev;
+    struct _notmuch_query_cache_entry *next;
+} notmuch_query_cache_entry_t;
+
+/* A cache of the most recently parsed query strings, so that a
+ * process running the same query repeatedly, (such as a long-lived
+ * user of the library), doesn't have to go through the query parser
+ * every time. */
+struct _notmuch_query_cache {
+    /* Maps a query string to its notmuch_query_cache_entry_t. */
+    GHashTable *entries;
+
+    /* The entries, from most to least recently used. */
+    notmuch_query_cache_entry_t *head;
+    notmuch_query_cache_entry_t *tail;
 };
 
 typedef struct _notmuch_mset_messages {
@@ -34,28 +65,224 @@ typedef struct _notmuch_mset_messages {
     notmuch_database_t *notmuch;
     Xapian::MSetIterator iterator;
     Xapian::MSetIterator iterator_end;
-} notmuch_mset_messages_t;
 
-struct _notmuch_doc_id_set {
-    unsigned int *bitmap;
-    unsigned int bound;
-};
+    /* The number of messages in the MSet. */
+    Xapian::doccount size;
+} notmuch_mset_messages_t;
 
-#define DOCIDSET_WORD(bit) ((bit) / sizeof (unsigned int))
-#define DOCIDSET_BIT(bit) ((bit) % sizeof (unsigned int))
+/* The maximum number of threads constructed together by
+ * _notmuch_thread_create_batch. */
+#define NOTMUCH_THREADS_BATCH_SIZE 64
 
 struct visible _notmuch_threads {
     notmuch_query_t *query;
 
-    /* The ordered list of doc ids matched by the query. */
-    GArray *doc_ids;
-    /* Our iterator's current position in doc_ids. */
-    unsigned int doc_id_pos;
-    /* The set of matched docid's that have not been assigned to a
-     * thread. Initially, this contains every docid in doc_ids. */
-    notmuch_doc_id_set_t match_set;
+    /* The IDs of the threads to be constructed, in order, (with the
+     * query's offset and limit already applied). */
+    notmuch_thread_ids_t *thread_ids;
+
+    /* Threads constructed ahead of the iterator, in result order. */
+    notmuch_thread_t **batch;
+    unsigned int batch_len;
+    unsigned int batch_pos;
+    /* Whether batch[batch_pos] has been handed out by
+     * notmuch_threads_get, (otherwise it is freed when the iterator
+     * moves past it). */
+    notmuch_bool_t batch_returned;
+
+    /* When constructing threads in parallel (see
+     * notmuch_query_set_jobs), the worker pool, the queue on which
+     * workers report finished jobs, and one database reader per
+     * job. These are all created with the first batch. */
+    unsigned int jobs;
+    GThreadPool *pool;
+    GAsyncQueue *done;
+    notmuch_database_t **readers;
 };
 
+struct visible _notmuch_thread_ids {
+    notmuch_query_t *query;
+
+    /* The messages matched by the query, in order. If 'collapsed',
+     * Xapian has already reduced these to the first message of each
+     * THREAD_ID value, and they are fetched a chunk at a time, (see
+     * _notmuch_thread_ids_fetch). Otherwise these are all matched
+     * messages, (for databases which predate
+     * NOTMUCH_VALUE_THREAD_ID). */
+    notmuch_messages_t *messages;
+    notmuch_bool_t collapsed;
+
+    /* When 'collapsed', the number of messages fetched so far, and
+     * whether that was all of them. */
+    unsigned int fetched;
+    notmuch_bool_t exhausted;
+
+    /* The thread IDs seen so far, (owned by the hash table). When
+     * 'collapsed', only the IDs of merged threads are recorded, (see
+     * _notmuch_database_thread_is_merged), as only those can come
+     * with more than one THREAD_ID value. */
+    GHashTable *seen;
+    /* The current thread ID, or NULL when we are not yet positioned
+     * on a message from an unseen thread. */
+    const char *current;
+
+    /* The number of leading threads still to be skipped (see
+     * notmuch_query_set_offset). */
+    unsigned int to_skip;
+    /* The number of threads still to be returned, or -1 for no
+     * limit (see notmuch_query_set_limit). */
+    int remaining;
+};
+
+/* A slice of a batch of threads, constructed by one worker. */
+typedef struct _notmuch_threads_job {
+    notmuch_threads_t *threads;
+    notmuch_doc_id_set_t *match_set;
+    notmuch_database_t *reader;
+    void *ctx;
+    const char **thread_ids;
+    unsigned int count;
+    notmuch_thread_t **threads_ret;
+    notmuch_status_t status;
+} notmuch_threads_job_t;
+
+static int
+_notmuch_query_destructor (notmuch_query_t *query)
+{
+    delete query->xapian_query;
+
+    return 0;
+}
+
+static int
+_notmuch_query_cache_entry_destructor (notmuch_query_cache_entry_t *entry)
+{
+    delete entry->xapian_query;
+
+    return 0;
+}
+
+static int
+_notmuch_query_cache_destructor (notmuch_query_cache_t *cache)
+{
+    g_hash_table_unref (cache->entries);
+
+    return 0;
+}
+
+/* Create an empty cache of parsed queries, with 'ctx' as its talloc
+ * owner.
+ *
+ * Returns NULL on out-of-memory. */
+notmuch_query_cache_t *
+_notmuch_query_cache_create (void *ctx)
+{
+    notmuch_query_cache_t *cache;
+
+    cache = talloc (ctx, notmuch_query_cache_t);
+    if (unlikely (cache == NULL))
+	return NULL;
+
+    cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+    cache->head = NULL;
+    cache->tail = NULL;
+
+    talloc_set_destructor (cache, _notmuch_query_cache_destructor);
+
+    return cache;
+}
+
+static void
+_notmuch_query_cache_unlink (notmuch_query_cache_t *cache,
+			     notmuch_query_cache_entry_t *entry)
+{
+    if (entry->prev)
+	entry->prev->next = entry->next;
+    else
+	cache->head = entry->next;
+
+    if (entry->next)
+	entry->next->prev = entry->prev;
+    else
+	cache->tail = entry->prev;
+}
+
+static void
+_notmuch_query_cache_push (notmuch_query_cache_t *cache,
+			   notmuch_query_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if (cache->head)
+	cache->head->prev = entry;
+    else
+	cache->tail = entry;
+
+    cache->head = entry;
+}
+
+/* Return the cached parse of 'query_string', (marking it as the most
+ * recently used), or NULL if it's not in the cache. */
+static Xapian::Query *
+_notmuch_query_cache_lookup (notmuch_query_cache_t *cache,
+			     const char *query_string)
+{
+    notmuch_query_cache_entry_t *entry;
+
+    entry = (notmuch_query_cache_entry_t *)
+	g_hash_table_lookup (cache->entries, query_string);
+    if (entry == NULL)
+	return NULL;
+
+    if (entry != cache->head) {
+	_notmuch_query_cache_unlink (cache, entry);
+	_notmuch_query_cache_push (cache, entry);
+    }
+
+    return entry->xapian_query;
+}
+
+/* Add the parse of 'query_string' to the cache, evicting the least
+ * recently used entry if the cache is full. */
+static void
+_notmuch_query_cache_add (notmuch_query_cache_t *cache,
+			  const char *query_string,
+			  const Xapian::Query &xapian_query)
+{
+    notmuch_query_cache_entry_t *entry;
+
+    if (g_hash_table_size (cache->entries) >= NOTMUCH_QUERY_CACHE_SIZE) {
+	entry = cache->tail;
+	_notmuch_query_cache_unlink (cache, entry);
+	g_hash_table_remove (cache->entries, entry->query_string);
+	talloc_free (entry);
+    }
+
+    entry = talloc (cache, notmuch_query_cache_entry_t);
+    if (unlikely (entry == NULL))
+	return;
+
+    entry->query_string = talloc_strdup (entry, query_string);
+    entry->xapian_query = new Xapian::Query (xapian_query);
+    talloc_set_destructor (entry, _notmuch_query_cache_entry_destructor);
+
+    _notmuch_query_cache_push (cache, entry);
+    g_hash_table_insert (cache->entries, entry->query_string, entry);
+}
+
+void
+_notmuch_query_cache_clear (notmuch_query_cache_t *cache)
+{
+    notmuch_query_cache_entry_t *entry;
+
+    while ((entry = cache->head)) {
+	_notmuch_query_cache_unlink (cache, entry);
+	g_hash_table_remove (cache->entries, entry->query_string);
+	talloc_free (entry);
+    }
+}
+
 notmuch_query_t *
 notmuch_query_create (notmuch_database_t *notmuch,
 		      const char *query_string)
@@ -76,6 +303,15 @@ notmuch_query_create (notmuch_database_t *notmuch,
 
     query->sort = NOTMUCH_SORT_NEWEST_FIRST;
 
+    query->offset = 0;
+    query->limit = -1;
+
+    query->jobs = 1;
+
+    query->xapian_query = NULL;
+
+    talloc_set_destructor (query, _notmuch_query_destructor);
+
     return query;
 }
 
@@ -97,6 +333,42 @@ notmuch_query_get_sort (notmuch_query_t *query)
     return query->sort;
 }
 
+void
+notmuch_query_set_offset (notmuch_query_t *query, unsigned int offset)
+{
+    query->offset = offset;
+}
+
+unsigned int
+notmuch_query_get_offset (notmuch_query_t *query)
+{
+    return query->offset;
+}
+
+void
+notmuch_query_set_limit (notmuch_query_t *query, int limit)
+{
+    query->limit = limit < 0 ? -1 : limit;
+}
+
+int
+notmuch_query_get_limit (notmuch_query_t *query)
+{
+    return query->limit;
+}
+
+void
+notmuch_query_set_jobs (notmuch_query_t *query, unsigned int jobs)
+{
+    query->jobs = jobs ? jobs : 1;
+}
+
+unsigned int
+notmuch_query_get_jobs (notmuch_query_t *query)
+{
+    return query->jobs;
+}
+
 /* We end up having to call the destructors explicitly because we had
  * to use "placement new" in order to initialize C++ objects within a
  * block that we allocated with talloc. So C++ is making talloc
@@ -112,11 +384,85 @@ _notmuch_messages_destructor (notmuch_mset_messages_t *messages)
     return 0;
 }
 
-notmuch_messages_t *
-notmuch_query_search_messages (notmuch_query_t *query)
+/* Parse the query string of 'query', (restricted to mail documents),
+ * or find it in the database's cache of parsed queries.
+ *
+ * Query strings with wildcards are never cached, since the query
+ * parser expands those against the terms currently in the database.
+ *
+ * This may throw a Xapian::Error. */
+static Xapian::Query
+_notmuch_query_parse (notmuch_query_t *query)
 {
     notmuch_database_t *notmuch = query->notmuch;
+    notmuch_query_cache_t *cache = notmuch->query_cache;
     const char *query_string = query->query_string;
+    Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
+					       _find_prefix ("type"),
+					       "mail"));
+    Xapian::Query *cached, final_query;
+    unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
+			  Xapian::QueryParser::FLAG_PHRASE |
+			  Xapian::QueryParser::FLAG_LOVEHATE |
+			  Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
+			  Xapian::QueryParser::FLAG_WILDCARD |
+			  Xapian::QueryParser::FLAG_PURE_NOT);
+
+    if (strcmp (query_string, "") == 0 ||
+	strcmp (query_string, "*") == 0)
+    {
+	return mail_query;
+    }
+
+    if (strchr (query_string, '*'))
+	cache = NULL;
+
+    if (cache) {
+	cached = _notmuch_query_cache_lookup (cache, query_string);
+	if (cached)
+	    return *cached;
+    }
+
+    final_query = Xapian::Query (Xapian::Query::OP_AND, mail_query,
+				 notmuch->query_parser->parse_query (query_string,
+								     flags));
+
+    if (cache)
+	_notmuch_query_cache_add (cache, query_string, final_query);
+
+    return final_query;
+}
+
+/* Return the Xapian query for 'query', (restricted to mail
+ * documents). The query string is parsed only the first time.
+ *
+ * This may throw a Xapian::Error. */
+static Xapian::Query
+_notmuch_query_get_xapian_query (notmuch_query_t *query)
+{
+    if (query->xapian_query == NULL)
+	query->xapian_query = new Xapian::Query (_notmuch_query_parse (query));
+
+    return *query->xapian_query;
+}
+
+/* Search for the messages matching 'query', returning only the
+ * messages from position 'first' onwards and at most 'max' of them
+ * (or all of them if 'max' is negative).
+ *
+ * If 'collapse_threads' is TRUE, only the first matching message of
+ * each thread is returned, (and 'first' and 'max' count threads).
+ *
+ * This is the engine behind notmuch_query_search_messages, which
+ * applies the query's own offset and limit, and
+ * notmuch_query_search_thread_ids. */
+static notmuch_messages_t *
+_notmuch_query_search_messages_range (notmuch_query_t *query,
+				      unsigned int first,
+				      int max,
+				      notmuch_bool_t collapse_threads)
+{
+    notmuch_database_t *notmuch = query->notmuch;
     notmuch_mset_messages_t *messages;
 
     messages = talloc (query, notmuch_mset_messages_t);
@@ -134,31 +480,16 @@ notmuch_query_search_messages (notmuch_query_t *query)
 	talloc_set_destructor (messages, _notmuch_messages_destructor);
 
 	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   "mail"));
-	Xapian::Query string_query, final_query;
+	Xapian::Query final_query;
 	Xapian::MSet mset;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
-
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
-	}
+
+	final_query = _notmuch_query_get_xapian_query (query);
 
 	enquire.set_weighting_scheme (Xapian::BoolWeight());
 
+	if (collapse_threads)
+	    enquire.set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+
 	switch (query->sort) {
 	case NOTMUCH_SORT_OLDEST_FIRST:
 	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
@@ -179,10 +510,12 @@ notmuch_query_search_messages (notmuch_query_t *query)
 
 	enquire.set_query (final_query);
 
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	mset = enquire.get_mset (first,
+				 max < 0 ? notmuch->xapian_db->get_doccount () : max);
 
 	messages->iterator = mset.begin ();
 	messages->iterator_end = mset.end ();
+	messages->size = mset.size ();
 
 	return &messages->base;
 
@@ -196,6 +529,15 @@ notmuch_query_search_messages (notmuch_query_t *query)
     }
 }
 
+notmuch_messages_t *
+notmuch_query_search_messages (notmuch_query_t *query)
+{
+    return _notmuch_query_search_messages_range (query,
+						 query->offset,
+						 query->limit,
+						 FALSE);
+}
+
 notmuch_bool_t
 _notmuch_mset_messages_valid (notmuch_messages_t *messages)
 {
@@ -257,145 +599,609 @@ _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages)
     mset_messages->iterator++;
 }
 
+/* Glib objects force use to use a talloc destructor as well, (but not
+ * nearly as ugly as the for messages due to C++ objects). At
+ * this point, I'd really like to have some talloc-friendly
+ * equivalents for the few pieces of glib that I'm using. */
+static int
+_notmuch_threads_destructor (notmuch_threads_t *threads)
+{
+    if (threads->pool)
+	g_thread_pool_free (threads->pool, TRUE, TRUE);
+
+    if (threads->done)
+	g_async_queue_unref (threads->done);
+
+    return 0;
+}
+
+notmuch_threads_t *
+notmuch_query_search_threads (notmuch_query_t *query)
+{
+    notmuch_threads_t *threads;
+
+    threads = talloc (query, notmuch_threads_t);
+    if (threads == NULL)
+	return NULL;
+    threads->pool = NULL;
+    threads->done = NULL;
+    talloc_set_destructor (threads, _notmuch_threads_destructor);
+
+    threads->query = query;
+
+    threads->jobs = query->jobs;
+    threads->readers = NULL;
+
+    threads->batch = talloc_array (threads, notmuch_thread_t *,
+				   NOTMUCH_THREADS_BATCH_SIZE * threads->jobs);
+    if (threads->batch == NULL) {
+	talloc_free (threads);
+	return NULL;
+    }
+    threads->batch_len = 0;
+    threads->batch_pos = 0;
+    threads->batch_returned = FALSE;
+
+    threads->thread_ids = notmuch_query_search_thread_ids (query);
+    if (threads->thread_ids == NULL) {
+	talloc_free (threads);
+	return NULL;
+    }
+    talloc_steal (threads, threads->thread_ids);
+
+    return threads;
+}
+
+static int
+_notmuch_thread_ids_destructor (notmuch_thread_ids_t *thread_ids)
+{
+    if (thread_ids->seen)
+	g_hash_table_unref (thread_ids->seen);
+
+    return 0;
+}
+
+/* Fetch the next chunk of the matches of a 'collapsed' thread ID
+ * iterator, (one message per THREAD_ID value), following the
+ * 'fetched' messages already seen.
+ *
+ * The chunk holds as many messages as are still needed to apply the
+ * offset and limit. That is all of them unless some were merged
+ * threads, whose several values only give one thread, in which case
+ * the next chunk is fetched when the first runs out.
+ *
+ * Returns FALSE if the search fails. */
 static notmuch_bool_t
-_notmuch_doc_id_set_init (void *ctx,
-			  notmuch_doc_id_set_t *doc_ids,
-			  GArray *arr)
+_notmuch_thread_ids_fetch (notmuch_thread_ids_t *thread_ids)
 {
-    unsigned int max = 0;
-    unsigned int *bitmap;
+    notmuch_messages_t *messages;
+    int max = -1;
 
-    for (unsigned int i = 0; i < arr->len; i++)
-	max = MAX(max, g_array_index (arr, unsigned int, i));
-    bitmap = talloc_zero_array (ctx, unsigned int, 1 + max / sizeof (*bitmap));
+    if (thread_ids->remaining >= 0)
+	max = thread_ids->to_skip + thread_ids->remaining;
 
-    if (bitmap == NULL)
+    messages = _notmuch_query_search_messages_range (thread_ids->query,
+						     thread_ids->fetched,
+						     max, TRUE);
+    if (messages == NULL)
 	return FALSE;
 
-    doc_ids->bitmap = bitmap;
-    doc_ids->bound = max + 1;
+    if (thread_ids->messages)
+	talloc_free (thread_ids->messages);
+    thread_ids->messages = messages;
+    talloc_steal (thread_ids, messages);
 
-    for (unsigned int i = 0; i < arr->len; i++) {
-	unsigned int doc_id = g_array_index (arr, unsigned int, i);
-	bitmap[DOCIDSET_WORD(doc_id)] |= 1 << DOCIDSET_BIT(doc_id);
-    }
+    thread_ids->fetched += ((notmuch_mset_messages_t *) messages)->size;
+    thread_ids->exhausted = (max < 0 ||
+			     ((notmuch_mset_messages_t *) messages)->size <
+			     (unsigned int) max);
 
     return TRUE;
 }
 
+notmuch_thread_ids_t *
+notmuch_query_search_thread_ids (notmuch_query_t *query)
+{
+    notmuch_thread_ids_t *thread_ids;
+
+    thread_ids = talloc (query, notmuch_thread_ids_t);
+    if (thread_ids == NULL)
+	return NULL;
+    thread_ids->seen = NULL;
+    talloc_set_destructor (thread_ids, _notmuch_thread_ids_destructor);
+
+    thread_ids->query = query;
+    thread_ids->current = NULL;
+    thread_ids->messages = NULL;
+    thread_ids->fetched = 0;
+    thread_ids->exhausted = FALSE;
+    thread_ids->to_skip = query->offset;
+    thread_ids->remaining = query->limit;
+    thread_ids->seen = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      free, NULL);
+
+    /* With a thread ID value in every message, Xapian can do most of
+     * the work, (all but telling apart the values of merged
+     * threads). */
+    thread_ids->collapsed = query->notmuch->version >= 3;
+
+    if (thread_ids->collapsed) {
+	if (! _notmuch_thread_ids_fetch (thread_ids)) {
+	    talloc_free (thread_ids);
+	    return NULL;
+	}
+    } else {
+	thread_ids->messages =
+	    _notmuch_query_search_messages_range (query, 0, -1, FALSE);
+	if (thread_ids->messages == NULL) {
+	    talloc_free (thread_ids);
+	    return NULL;
+	}
+	talloc_steal (thread_ids, thread_ids->messages);
+    }
+
+    return thread_ids;
+}
+
+/* Return the thread ID of the document 'doc_id', (as a newly
+ * allocated string which the caller must free), or NULL if it has
+ * none. If the thread of the document was merged into another, this
+ * is the ID of the latter.
+ *
+ * This reads only the thread term of the document rather than
+ * constructing a notmuch_message_t. */
+static char *
+_notmuch_thread_ids_read (notmuch_database_t *notmuch, Xapian::docid doc_id)
+{
+    const char *prefix = _find_prefix ("thread");
+    Xapian::TermIterator i, end;
+
+    try {
+	i = notmuch->xapian_db->termlist_begin (doc_id);
+	end = notmuch->xapian_db->termlist_end (doc_id);
+
+	i.skip_to (prefix);
+	if (i == end || (*i).compare (0, strlen (prefix), prefix) != 0)
+	    return NULL;
+
+	return xstrdup (_notmuch_database_resolve_thread_id (
+			    notmuch, (*i).c_str () + strlen (prefix)));
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading thread ID: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+}
+
+/* Move a 'collapsed' thread ID iterator on to the next thread not
+ * yet seen, (see notmuch_thread_ids_valid).
+ *
+ * Each THREAD_ID value names a distinct thread, unless its thread was
+ * merged, so only those values need resolving and remembering. */
+static notmuch_bool_t
+_notmuch_thread_ids_collapsed_valid (notmuch_thread_ids_t *thread_ids)
+{
+    notmuch_database_t *notmuch = thread_ids->query->notmuch;
+    notmuch_mset_messages_t *mset_messages;
+    std::string value;
+    const char *thread_id;
+
+    while (thread_ids->current == NULL) {
+	if (! _notmuch_mset_messages_valid (thread_ids->messages)) {
+	    if (thread_ids->exhausted ||
+		! _notmuch_thread_ids_fetch (thread_ids))
+	    {
+		break;
+	    }
+	    continue;
+	}
+
+	mset_messages = (notmuch_mset_messages_t *) thread_ids->messages;
+	value = mset_messages->iterator.get_collapse_key ();
+	thread_id = value.c_str ();
+
+	if (_notmuch_database_thread_is_merged (notmuch, thread_id)) {
+	    thread_id = _notmuch_database_resolve_thread_id (notmuch,
+							     thread_id);
+	    if (g_hash_table_lookup_extended (thread_ids->seen, thread_id,
+					      NULL, NULL))
+	    {
+		_notmuch_mset_messages_move_to_next (thread_ids->messages);
+		continue;
+	    }
+	    g_hash_table_insert (thread_ids->seen, xstrdup (thread_id), NULL);
+	}
+
+	if (thread_ids->to_skip > 0) {
+	    thread_ids->to_skip--;
+	    _notmuch_mset_messages_move_to_next (thread_ids->messages);
+	    continue;
+	}
+
+	thread_ids->current = talloc_strdup (thread_ids, thread_id);
+    }
+
+    return thread_ids->current != NULL;
+}
+
 notmuch_bool_t
-_notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
-			      unsigned int doc_id)
+notmuch_thread_ids_valid (notmuch_thread_ids_t *thread_ids)
 {
-    if (doc_id >= doc_ids->bound)
+    notmuch_messages_t *messages = thread_ids->messages;
+    char *thread_id;
+
+    if (thread_ids->remaining == 0)
 	return FALSE;
-    return doc_ids->bitmap[DOCIDSET_WORD(doc_id)] & (1 << DOCIDSET_BIT(doc_id));
+
+    if (thread_ids->collapsed)
+	return _notmuch_thread_ids_collapsed_valid (thread_ids);
+
+    while (thread_ids->current == NULL &&
+	   _notmuch_mset_messages_valid (messages))
+    {
+	thread_id = _notmuch_thread_ids_read (thread_ids->query->notmuch,
+					      _notmuch_mset_messages_get_doc_id (messages));
+
+	if (thread_id == NULL ||
+	    g_hash_table_lookup_extended (thread_ids->seen, thread_id,
+					  NULL, NULL))
+	{
+	    free (thread_id);
+	} else {
+	    g_hash_table_insert (thread_ids->seen, thread_id, NULL);
+	    if (thread_ids->to_skip > 0)
+		thread_ids->to_skip--;
+	    else
+		thread_ids->current = thread_id;
+	}
+
+	if (thread_ids->current == NULL)
+	    _notmuch_mset_messages_move_to_next (messages);
+    }
+
+    return thread_ids->current != NULL;
+}
+
+const char *
+notmuch_thread_ids_get (notmuch_thread_ids_t *thread_ids)
+{
+    if (! notmuch_thread_ids_valid (thread_ids))
+	return NULL;
+
+    return thread_ids->current;
 }
 
 void
-_notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
-                            unsigned int doc_id)
+notmuch_thread_ids_move_to_next (notmuch_thread_ids_t *thread_ids)
 {
-    if (doc_id < doc_ids->bound)
-	doc_ids->bitmap[DOCIDSET_WORD(doc_id)] &= ~(1 << DOCIDSET_BIT(doc_id));
+    if (! notmuch_thread_ids_valid (thread_ids))
+	return;
+
+    if (thread_ids->collapsed)
+	talloc_free ((char *) thread_ids->current);
+    thread_ids->current = NULL;
+
+    _notmuch_mset_messages_move_to_next (thread_ids->messages);
+
+    if (thread_ids->remaining > 0)
+	thread_ids->remaining--;
 }
 
-/* Glib objects force use to use a talloc destructor as well, (but not
- * nearly as ugly as the for messages due to C++ objects). At
- * this point, I'd really like to have some talloc-friendly
- * equivalents for the few pieces of glib that I'm using. */
-static int
-_notmuch_threads_destructor (notmuch_threads_t *threads)
+void
+notmuch_thread_ids_destroy (notmuch_thread_ids_t *thread_ids)
 {
-    if (threads->doc_ids)
-	g_array_unref (threads->doc_ids);
+    talloc_free (thread_ids);
+}
 
-    return 0;
+void
+notmuch_query_destroy (notmuch_query_t *query)
+{
+    talloc_free (query);
 }
 
-notmuch_threads_t *
-notmuch_query_search_threads (notmuch_query_t *query)
+/* Find the messages matching the query among the messages of the
+ * 'count' threads in 'thread_ids', storing them in a new doc ID set
+ * (allocated with 'ctx') returned in *match_set.
+ *
+ * This is a single search for the query restricted to those threads,
+ * so it scales with the size of the batch, not of the result. */
+static notmuch_status_t
+_notmuch_threads_find_matches (void *ctx,
+			       notmuch_threads_t *threads,
+			       const char **thread_ids,
+			       unsigned int count,
+			       notmuch_doc_id_set_t **match_set)
 {
-    notmuch_threads_t *threads;
-    notmuch_messages_t *messages;
+    notmuch_query_t *query = threads->query;
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_doc_id_set_t *doc_ids;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
 
-    threads = talloc (query, notmuch_threads_t);
-    if (threads == NULL)
-	return NULL;
-    threads->doc_ids = NULL;
-    talloc_set_destructor (threads, _notmuch_threads_destructor);
+    doc_ids = _notmuch_doc_id_set_create (ctx);
+    if (unlikely (doc_ids == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
 
-    threads->query = query;
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator i;
+	std::vector<std::string> terms;
 
-    messages = notmuch_query_search_messages (query);
-    if (messages == NULL) {
-	    talloc_free (threads);
-	    return NULL;
+	for (unsigned int j = 0; j < count; j++)
+	    _notmuch_database_get_thread_terms (notmuch, thread_ids[j], terms);
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_FILTER,
+					  _notmuch_query_get_xapian_query (query),
+					  Xapian::Query (Xapian::Query::OP_OR,
+							 terms.begin (),
+							 terms.end ())));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (i = mset.begin (); i != mset.end (); i++) {
+	    if (! _notmuch_doc_id_set_add (doc_ids, *i)) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		break;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred performing query: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
-    threads->doc_ids = g_array_new (FALSE, FALSE, sizeof (unsigned int));
-    while (notmuch_messages_valid (messages)) {
-	unsigned int doc_id = _notmuch_mset_messages_get_doc_id (messages);
-	g_array_append_val (threads->doc_ids, doc_id);
-	notmuch_messages_move_to_next (messages);
+    if (status) {
+	talloc_free (doc_ids);
+	return status;
     }
-    threads->doc_id_pos = 0;
 
-    talloc_free (messages);
+    *match_set = doc_ids;
 
-    if (! _notmuch_doc_id_set_init (threads, &threads->match_set,
-				    threads->doc_ids)) {
-	talloc_free (threads);
-	return NULL;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static void
+_notmuch_threads_worker (gpointer data, unused (gpointer user_data))
+{
+    notmuch_threads_job_t *job = (notmuch_threads_job_t *) data;
+
+    job->status = _notmuch_thread_create_batch (job->ctx, job->reader,
+						job->thread_ids, job->count,
+						job->match_set,
+						job->threads->query->sort,
+						job->threads_ret);
+
+    g_async_queue_push (job->threads->done, job);
+}
+
+/* Close the database readers of the workers, (after they failed to
+ * start). */
+static void
+_notmuch_threads_close_readers (notmuch_threads_t *threads)
+{
+    unsigned int i;
+
+    for (i = 0; i < threads->jobs; i++) {
+	if (threads->readers[i])
+	    talloc_free (threads->readers[i]);
     }
 
-    return threads;
+    talloc_free (threads->readers);
+    threads->readers = NULL;
 }
 
-void
-notmuch_query_destroy (notmuch_query_t *query)
+/* Create the worker pool, and a database reader for each worker. */
+static notmuch_status_t
+_notmuch_threads_start_workers (notmuch_threads_t *threads)
 {
-    talloc_free (query);
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    GError *error = NULL;
+    unsigned int i;
+
+#if ! GLIB_CHECK_VERSION (2, 32, 0)
+    if (! g_thread_supported ())
+	g_thread_init (NULL);
+#endif
+
+    threads->readers = talloc_zero_array (threads, notmuch_database_t *,
+					  threads->jobs);
+    if (unlikely (threads->readers == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    for (i = 0; i < threads->jobs; i++) {
+	threads->readers[i] = _notmuch_database_open_reader (threads,
+							     notmuch);
+	if (threads->readers[i] == NULL) {
+	    _notmuch_threads_close_readers (threads);
+	    return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	}
+    }
+
+    threads->done = g_async_queue_new ();
+    threads->pool = g_thread_pool_new (_notmuch_threads_worker, NULL,
+				       threads->jobs, TRUE, &error);
+    if (threads->pool == NULL) {
+	fprintf (stderr, "Error: Failed to start worker threads: %s\n",
+		 error->message);
+	g_error_free (error);
+	g_async_queue_unref (threads->done);
+	threads->done = NULL;
+	_notmuch_threads_close_readers (threads);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
 }
 
-notmuch_bool_t
-notmuch_threads_valid (notmuch_threads_t *threads)
+/* Construct the threads for 'thread_ids' into threads->batch by
+ * splitting them into one contiguous slice per worker. Since each
+ * slice goes to its own place in the batch, the threads come out in
+ * the original order regardless of which worker finishes first.
+ *
+ * The finished threads are moved to the query and pointed back at
+ * the query's own database, so that callers cannot tell them apart
+ * from threads constructed sequentially. */
+static notmuch_status_t
+_notmuch_threads_create_parallel (notmuch_threads_t *threads,
+				  const char **thread_ids,
+				  unsigned int count,
+				  notmuch_doc_id_set_t *match_set)
 {
-    unsigned int doc_id;
+    notmuch_threads_job_t *jobs;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i, j, slice, num_jobs;
+
+    if (threads->pool == NULL) {
+	status = _notmuch_threads_start_workers (threads);
+	if (status)
+	    return status;
+    }
 
-    while (threads->doc_id_pos < threads->doc_ids->len) {
-	doc_id = g_array_index (threads->doc_ids, unsigned int,
-				threads->doc_id_pos);
-	if (_notmuch_doc_id_set_contains (&threads->match_set, doc_id))
-	    break;
+    slice = (count + threads->jobs - 1) / threads->jobs;
+    num_jobs = (count + slice - 1) / slice;
+
+    jobs = talloc_array (threads, notmuch_threads_job_t, num_jobs);
+    if (unlikely (jobs == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    /* Every job's talloc context is created here, on this thread,
+     * before any worker starts allocating under one. (talloc has no
+     * locking, so workers must never allocate from talloc's NULL
+     * context, nor under a parent that another thread is changing.) */
+    for (i = 0; i < num_jobs; i++) {
+	jobs[i].threads = threads;
+	jobs[i].match_set = match_set;
+	jobs[i].reader = threads->readers[i];
+	jobs[i].ctx = talloc_new (threads);
+	jobs[i].thread_ids = thread_ids + i * slice;
+	jobs[i].count = MIN (slice, count - i * slice);
+	jobs[i].threads_ret = threads->batch + i * slice;
+	jobs[i].status = NOTMUCH_STATUS_SUCCESS;
+
+	if (unlikely (jobs[i].ctx == NULL)) {
+	    while (i--)
+		talloc_free (jobs[i].ctx);
+	    talloc_free (jobs);
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
+    }
+
+    for (i = 0; i < num_jobs; i++)
+	g_thread_pool_push (threads->pool, &jobs[i], NULL);
+
+    for (i = 0; i < num_jobs; i++)
+	g_async_queue_pop (threads->done);
+
+    for (i = 0; i < num_jobs; i++) {
+	if (jobs[i].status && ! status)
+	    status = jobs[i].status;
+
+	for (j = 0; j < jobs[i].count; j++) {
+	    if (jobs[i].threads_ret[j] == NULL)
+		continue;
+	    talloc_steal (threads->query, jobs[i].threads_ret[j]);
+	    _notmuch_thread_set_database (jobs[i].threads_ret[j],
+					  threads->query->notmuch);
+	}
+
+	talloc_free (jobs[i].ctx);
+    }
+
+    talloc_free (jobs);
 
-	threads->doc_id_pos++;
+    return status;
+}
+
+/* Construct the next batch of (at most NOTMUCH_THREADS_BATCH_SIZE
+ * per job) threads.
+ *
+ * Returns FALSE if there are no more threads (or on error). */
+static notmuch_bool_t
+_notmuch_threads_fill_batch (notmuch_threads_t *threads)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    const char **thread_ids;
+    unsigned int count = 0, max = NOTMUCH_THREADS_BATCH_SIZE * threads->jobs;
+    notmuch_doc_id_set_t *match_set;
+    void *local;
+    notmuch_status_t status;
+
+    threads->batch_len = 0;
+    threads->batch_pos = 0;
+    threads->batch_returned = FALSE;
+
+    local = talloc_new (threads);
+    thread_ids = talloc_array (local, const char *, max);
+
+    while (count < max && notmuch_thread_ids_valid (threads->thread_ids)) {
+	thread_ids[count++] = talloc_strdup (local,
+					     notmuch_thread_ids_get (threads->thread_ids));
+	notmuch_thread_ids_move_to_next (threads->thread_ids);
+    }
+
+    if (count) {
+	status = _notmuch_threads_find_matches (local, threads,
+						thread_ids, count,
+						&match_set);
+	if (status)
+	    goto DONE;
+
+	if (threads->jobs > 1)
+	    status = _notmuch_threads_create_parallel (threads,
+						       thread_ids, count,
+						       match_set);
+	else
+	    status = _notmuch_thread_create_batch (threads->query, notmuch,
+						   thread_ids, count,
+						   match_set,
+						   threads->query->sort,
+						   threads->batch);
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    threads->batch_len = count;
     }
 
-    return threads->doc_id_pos < threads->doc_ids->len;
+  DONE:
+    talloc_free (local);
+
+    return threads->batch_len > 0;
+}
+
+notmuch_bool_t
+notmuch_threads_valid (notmuch_threads_t *threads)
+{
+    if (threads->batch_pos < threads->batch_len)
+	return TRUE;
+
+    return _notmuch_threads_fill_batch (threads);
 }
 
 notmuch_thread_t *
 notmuch_threads_get (notmuch_threads_t *threads)
 {
-    unsigned int doc_id;
-
     if (! notmuch_threads_valid (threads))
 	return NULL;
 
-    doc_id = g_array_index (threads->doc_ids, unsigned int,
-			    threads->doc_id_pos);
-    return _notmuch_thread_create (threads->query,
-				   threads->query->notmuch,
-				   doc_id,
-				   &threads->match_set,
-				   threads->query->sort);
+    threads->batch_returned = TRUE;
+
+    return threads->batch[threads->batch_pos];
 }
 
 void
 notmuch_threads_move_to_next (notmuch_threads_t *threads)
 {
-    threads->doc_id_pos++;
+    if (! notmuch_threads_valid (threads))
+	return;
+
+    if (! threads->batch_returned)
+	talloc_free (threads->batch[threads->batch_pos]);
+
+    threads->batch_pos++;
+    threads->batch_returned = FALSE;
 }
 
 void
@@ -404,56 +1210,177 @@ notmuch_threads_destroy (notmuch_threads_t *threads)
     talloc_free (threads);
 }
 
+/* If counting 'query' amounts to looking up the frequency of a single
+ * term, return that term, (otherwise NULL).
+ *
+ * This is the case for the match-everything query, (every message
+ * carries the type:mail term), and for a query string consisting of
+ * one tag:, is:, id: or thread: term. Those terms are only ever
+ * attached to mail documents, so their frequency is exactly the
+ * number of matching messages. */
+static const char *
+_notmuch_query_single_term (notmuch_query_t *query)
+{
+    const char *query_string = query->query_string;
+    const char *colon, *value, *s;
+    const char *name;
+    unsigned int i;
+    static const char *mail_only_prefixes[] = {
+	"tag", "is", "id", "thread"
+    };
+
+    if (strcmp (query_string, "") == 0 ||
+	strcmp (query_string, "*") == 0)
+    {
+	return talloc_asprintf (query, "%s%s", _find_prefix ("type"), "mail");
+    }
+
+    colon = strchr (query_string, ':');
+    if (colon == NULL)
+	return NULL;
+
+    name = talloc_strndup (query, query_string, colon - query_string);
+    for (i = 0; i < ARRAY_SIZE (mail_only_prefixes); i++) {
+	if (strcmp (name, mail_only_prefixes[i]) == 0)
+	    break;
+    }
+    if (i == ARRAY_SIZE (mail_only_prefixes))
+	return NULL;
+
+    /* Anything beyond a bare value (quoting, grouping, a second term
+     * or a wildcard) goes through the query parser instead. */
+    value = colon + 1;
+    if (*value == '\0' || *value == '"')
+	return NULL;
+
+    for (s = value; *s; s++) {
+	if (isspace (*s) || *s == '(' || *s == ')' || *s == '*')
+	    return NULL;
+    }
+
+    /* The messages of a merged thread may carry several thread
+     * terms. */
+    if (strcmp (name, "thread") == 0 &&
+	_notmuch_database_thread_is_merged (query->notmuch, value))
+	return NULL;
+
+    return talloc_asprintf (query, "%s%s", _find_prefix (name), value);
+}
+
 unsigned
 notmuch_query_count_messages (notmuch_query_t *query)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
+    const char *term;
     Xapian::doccount count = 0;
 
     try {
-	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   "mail"));
-	Xapian::Query string_query, final_query;
-	Xapian::MSet mset;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
-
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
+	term = _notmuch_query_single_term (query);
+	if (term) {
+	    count = notmuch->xapian_db->get_termfreq (term);
 	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
+	    Xapian::Enquire enquire (*notmuch->xapian_db);
+	    Xapian::MSet mset;
+
+	    enquire.set_weighting_scheme (Xapian::BoolWeight());
+	    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	    enquire.set_query (_notmuch_query_get_xapian_query (query));
+
+	    /* Ask for no documents at all, but have the matcher check
+	     * every candidate so that the count it reports is exact
+	     * rather than an estimate. With boolean weighting this
+	     * walks the posting lists without building any result
+	     * set. */
+	    mset = enquire.get_mset (0, 0,
+				     notmuch->xapian_db->get_doccount ());
+
+	    count = mset.get_matches_estimated ();
 	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+    }
 
-	enquire.set_weighting_scheme(Xapian::BoolWeight());
-	enquire.set_docid_order(Xapian::Enquire::ASCENDING);
+    return count;
+}
 
-#if DEBUG_QUERY
-	fprintf (stderr, "Final query is:\n%s\n", final_query.get_description().c_str());
-#endif
+unsigned
+notmuch_query_count_threads (notmuch_query_t *query)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_messages_t *messages;
+    GHashTable *seen;
+    char *thread_id;
+    unsigned count = 0;
+
+    /* With a thread ID value in every message, Xapian can collapse
+     * the matches to one per value for us. Only the values of merged
+     * threads, (several of which can name one thread), are then
+     * resolved and counted once per thread. */
+    if (notmuch->version >= 3) {
+	seen = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+
+	try {
+	    Xapian::Enquire enquire (*notmuch->xapian_db);
+	    Xapian::MSet mset;
+	    Xapian::MSetIterator i;
+
+	    enquire.set_weighting_scheme (Xapian::BoolWeight());
+	    enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	    enquire.set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+	    enquire.set_query (_notmuch_query_get_xapian_query (query));
+
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	    for (i = mset.begin (); i != mset.end (); i++) {
+		std::string value = i.get_collapse_key ();
+
+		if (_notmuch_database_thread_is_merged (notmuch,
+							value.c_str ()))
+		{
+		    g_hash_table_insert (seen, xstrdup (
+			_notmuch_database_resolve_thread_id (notmuch,
+							     value.c_str ())),
+					 NULL);
+		} else {
+		    count++;
+		}
+	    }
+
+	    count += g_hash_table_size (seen);
+	} catch (const Xapian::Error &error) {
+	    fprintf (stderr, "A Xapian exception occurred: %s\n",
+		     error.get_msg().c_str());
+	    fprintf (stderr, "Query string was: %s\n", query->query_string);
+	    count = 0;
+	}
 
-	enquire.set_query (final_query);
+	g_hash_table_unref (seen);
 
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	return count;
+    }
 
-	count = mset.get_matches_estimated();
+    messages = _notmuch_query_search_messages_range (query, 0, -1, FALSE);
+    if (messages == NULL)
+	return 0;
 
-    } catch (const Xapian::Error &error) {
-	fprintf (stderr, "A Xapian exception occurred: %s\n",
-		 error.get_msg().c_str());
-	fprintf (stderr, "Query string was: %s\n", query->query_string);
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, free, NULL);
+
+    for (;
+	 _notmuch_mset_messages_valid (messages);
+	 _notmuch_mset_messages_move_to_next (messages))
+    {
+	thread_id = _notmuch_thread_ids_read (notmuch,
+					      _notmuch_mset_messages_get_doc_id (messages));
+	if (thread_id)
+	    g_hash_table_insert (seen, thread_id, NULL);
     }
 
+    count = g_hash_table_size (seen);
+
+    g_hash_table_unref (seen);
+    talloc_free (messages);
+
     return count;
 }
@@ -64,6 +64,27 @@ notmuch_sha1_of_string (const char *str)
     return _hex_of_sha1_digest (digest);
 }
 
+/* Create a hexadecimal string version of the SHA-1 digest of the
+ * 'size' bytes at 'buffer'.
+ *
+ * This function returns a newly allocated string which the caller
+ * should free() when finished.
+ */
+char *
+notmuch_sha1_of_buffer (const void *buffer, size_t size)
+{
+    sha1_ctx sha1;
+    unsigned char digest[SHA1_DIGEST_SIZE];
+
+    sha1_begin (&sha1);
+
+    sha1_hash ((const unsigned char *) buffer, size, &sha1);
+
+    sha1_end (digest, &sha1);
+
+    return _hex_of_sha1_digest (digest);
+}
+
 /* Create a hexadecimal string version of the SHA-1 digest of the
  * contents of the named file.
  *
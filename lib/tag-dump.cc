@@ -0,0 +1,286 @@
+/* tag-dump.cc - Walk the tags of all messages, straight from the index
+ *
+ * Copyright © 2009 Carl Worth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Carl Worth <cworth@cworth.org>
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GArray, GHashTable */
+
+/* The tags of all messages are gathered up front, one tag at a time,
+ * by walking the posting list of each tag term. Few messages have
+ * sets of tags that no other message has, so rather than a list of
+ * tags per message, each message only records which of the distinct
+ * sets of tags it has.
+ *
+ * The sets form a trie: set i is the set 'parents[i]' plus the tag
+ * 'tags[last_tags[i]]', (set 0 being the empty set). As the tag terms
+ * are walked in order, the tags of each set come out in order too.
+ *
+ * The messages are then walked in order of message ID, by walking
+ * the id terms, so no document is ever loaded. */
+struct visible _notmuch_tag_dump {
+    notmuch_database_t *notmuch;
+
+    /* The distinct tags, in order. */
+    notmuch_string_list_t *tag_list;
+    const char **tags;
+
+    /* The distinct sets of tags, (see above). */
+    GArray *parents;
+    GArray *last_tags;
+
+    /* The set of tags of each document, by document ID, (for
+     * document IDs up to 'max_doc_id'). */
+    unsigned int *doc_sets;
+    Xapian::docid max_doc_id;
+
+    /* The walk of the id terms. */
+    Xapian::TermIterator iterator;
+    Xapian::TermIterator iterator_end;
+    size_t id_prefix_len;
+
+    /* The current message, (with a 'doc_id' of 0 at the end of the
+     * walk). */
+    Xapian::docid doc_id;
+    char *message_id;
+};
+
+static int
+_notmuch_tag_dump_destructor (notmuch_tag_dump_t *dump)
+{
+    dump->iterator.~TermIterator ();
+    dump->iterator_end.~TermIterator ();
+
+    if (dump->parents)
+	g_array_free (dump->parents, TRUE);
+    if (dump->last_tags)
+	g_array_free (dump->last_tags, TRUE);
+
+    return 0;
+}
+
+/* Record that each message with the tag term 'term', (the tag with
+ * index 'tag' in dump->tags), has that tag. */
+static void
+_notmuch_tag_dump_add_tag (notmuch_tag_dump_t *dump,
+			   const std::string &term,
+			   unsigned int tag)
+{
+    Xapian::Database *db = dump->notmuch->xapian_db;
+    Xapian::PostingIterator i, end;
+    GHashTable *children;
+    unsigned int set, child;
+
+    /* Maps each set to the set with 'tag' added, (offset by one, so
+     * that a missing entry is NULL), for this tag only. */
+    children = g_hash_table_new (NULL, NULL);
+
+    end = db->postlist_end (term);
+    for (i = db->postlist_begin (term); i != end; i++) {
+	if (*i > dump->max_doc_id)
+	    break;
+
+	set = dump->doc_sets[*i];
+	child = GPOINTER_TO_UINT (g_hash_table_lookup (children,
+						       GUINT_TO_POINTER (set)));
+	if (child == 0) {
+	    child = dump->parents->len;
+	    g_array_append_val (dump->parents, set);
+	    g_array_append_val (dump->last_tags, tag);
+	    g_hash_table_insert (children, GUINT_TO_POINTER (set),
+				 GUINT_TO_POINTER (child + 1));
+	} else {
+	    child--;
+	}
+
+	dump->doc_sets[*i] = child;
+    }
+
+    g_hash_table_unref (children);
+}
+
+/* Move to the next message with a document, (starting with the
+ * current id term). */
+static void
+_notmuch_tag_dump_find_message (notmuch_tag_dump_t *dump)
+{
+    Xapian::Database *db = dump->notmuch->xapian_db;
+    Xapian::PostingIterator i;
+
+    dump->doc_id = 0;
+    talloc_free (dump->message_id);
+    dump->message_id = NULL;
+
+    for (; dump->iterator != dump->iterator_end; dump->iterator++) {
+	const std::string &term = *dump->iterator;
+
+	i = db->postlist_begin (term);
+	if (i != db->postlist_end (term)) {
+	    dump->doc_id = *i;
+	    dump->message_id = talloc_strdup (dump, term.c_str () +
+					      dump->id_prefix_len);
+	    return;
+	}
+    }
+}
+
+notmuch_tag_dump_t *
+notmuch_database_dump_tags (notmuch_database_t *notmuch)
+{
+    Xapian::Database *db = notmuch->xapian_db;
+    Xapian::TermIterator i, end;
+    const char *tag_prefix = _find_prefix ("tag");
+    const char *id_prefix = _find_prefix ("id");
+    notmuch_tag_dump_t *dump;
+    notmuch_string_node_t *node;
+    unsigned int tag, empty = 0;
+
+    dump = talloc (notmuch, notmuch_tag_dump_t);
+    if (unlikely (dump == NULL))
+	return NULL;
+
+    dump->notmuch = notmuch;
+    dump->tags = NULL;
+    dump->doc_sets = NULL;
+    dump->doc_id = 0;
+    dump->message_id = NULL;
+    dump->id_prefix_len = strlen (id_prefix);
+
+    new (&dump->iterator) Xapian::TermIterator ();
+    new (&dump->iterator_end) Xapian::TermIterator ();
+
+    dump->parents = g_array_new (FALSE, FALSE, sizeof (unsigned int));
+    dump->last_tags = g_array_new (FALSE, FALSE, sizeof (unsigned int));
+    g_array_append_val (dump->parents, empty);
+    g_array_append_val (dump->last_tags, empty);
+
+    talloc_set_destructor (dump, _notmuch_tag_dump_destructor);
+
+    try {
+	dump->max_doc_id = db->get_lastdocid ();
+	dump->doc_sets = talloc_zero_array (dump, unsigned int,
+					    dump->max_doc_id + 1);
+	if (unlikely (dump->doc_sets == NULL))
+	    goto FAIL;
+
+	i = db->allterms_begin ();
+	end = db->allterms_end ();
+	dump->tag_list = _notmuch_database_get_terms_with_prefix (dump, i, end,
+								  tag_prefix);
+	dump->tags = talloc_array (dump, const char *,
+				   dump->tag_list->length);
+	if (unlikely (dump->tags == NULL))
+	    goto FAIL;
+
+	for (node = dump->tag_list->head, tag = 0; node;
+	     node = node->next, tag++)
+	{
+	    std::string term = tag_prefix;
+
+	    term += node->string;
+	    dump->tags[tag] = node->string;
+	    _notmuch_tag_dump_add_tag (dump, term, tag);
+	}
+
+	dump->iterator = db->allterms_begin (id_prefix);
+	dump->iterator_end = db->allterms_end (id_prefix);
+	_notmuch_tag_dump_find_message (dump);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred dumping tags: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	goto FAIL;
+    }
+
+    return dump;
+
+  FAIL:
+    talloc_free (dump);
+    return NULL;
+}
+
+notmuch_bool_t
+notmuch_tag_dump_valid (notmuch_tag_dump_t *dump)
+{
+    return dump->doc_id != 0;
+}
+
+const char *
+notmuch_tag_dump_get_message_id (notmuch_tag_dump_t *dump)
+{
+    return dump->message_id;
+}
+
+notmuch_tags_t *
+notmuch_tag_dump_get_tags (notmuch_tag_dump_t *dump)
+{
+    notmuch_string_list_t *list;
+    unsigned int set, depth, count, *last_tags;
+    const char **tags;
+
+    list = _notmuch_string_list_create (dump);
+    if (unlikely (list == NULL))
+	return NULL;
+
+    if (dump->doc_id && dump->doc_id <= dump->max_doc_id) {
+	/* The tags of a set come out last first. */
+	set = dump->doc_sets[dump->doc_id];
+	for (count = 0; set; count++)
+	    set = g_array_index (dump->parents, unsigned int, set);
+
+	tags = talloc_array (list, const char *, count);
+	last_tags = (unsigned int *) dump->last_tags->data;
+
+	set = dump->doc_sets[dump->doc_id];
+	depth = count;
+	while (set) {
+	    tags[--depth] = dump->tags[last_tags[set]];
+	    set = g_array_index (dump->parents, unsigned int, set);
+	}
+
+	for (depth = 0; depth < count; depth++)
+	    _notmuch_string_list_append (list, tags[depth]);
+    }
+
+    return _notmuch_tags_create (dump, list);
+}
+
+void
+notmuch_tag_dump_move_to_next (notmuch_tag_dump_t *dump)
+{
+    if (dump->doc_id == 0)
+	return;
+
+    try {
+	dump->iterator++;
+	_notmuch_tag_dump_find_message (dump);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred dumping tags: %s\n",
+		 error.get_msg().c_str());
+	dump->notmuch->exception_reported = TRUE;
+	dump->doc_id = 0;
+    }
+}
+
+void
+notmuch_tag_dump_destroy (notmuch_tag_dump_t *dump)
+{
+    talloc_free (dump);
+}
@@ -371,52 +371,12 @@ _resolve_thread_relationships (unused (notmuch_thread_t *thread))
      */
 }
 
-/* Create a new notmuch_thread_t object by finding the thread
- * containing the message with the given doc ID, treating any messages
- * contained in match_set as "matched".  Remove all messages in the
- * thread from match_set.
- *
- * Creating the thread will perform a database search to get all
- * messages belonging to the thread and will get the first subject
- * line, the total count of messages, and all authors in the thread.
- * Each message in the thread is checked against match_set to allow
- * for a separate count of matched messages, and to allow a viewer to
- * display these messages differently.
- *
- * Here, 'ctx' is talloc context for the resulting thread object.
- *
- * This function returns NULL in the case of any error.
- */
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_sort_t sort)
+static notmuch_thread_t *
+_thread_new (void *ctx,
+	     notmuch_database_t *notmuch,
+	     const char *thread_id)
 {
     notmuch_thread_t *thread;
-    notmuch_message_t *seed_message;
-    const char *thread_id;
-    char *thread_id_query_string;
-    notmuch_query_t *thread_id_query;
-
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-
-    seed_message = _notmuch_message_create (ctx, notmuch, seed_doc_id, NULL);
-    if (! seed_message)
-	INTERNAL_ERROR ("Thread seed message %u does not exist", seed_doc_id);
-
-    thread_id = notmuch_message_get_thread_id (seed_message);
-    thread_id_query_string = talloc_asprintf (ctx, "thread:%s", thread_id);
-    if (unlikely (thread_id_query_string == NULL))
-	return NULL;
-
-    thread_id_query = notmuch_query_create (notmuch, thread_id_query_string);
-    if (unlikely (thread_id_query == NULL))
-	return NULL;
-
-    talloc_free (thread_id_query_string);
 
     thread = talloc (ctx, notmuch_thread_t);
     if (unlikely (thread == NULL))
@@ -438,52 +398,167 @@ _notmuch_thread_create (void *ctx,
     thread->tags = g_hash_table_new_full (g_str_hash, g_str_equal,
 					  free, NULL);
 
-    thread->message_list = _notmuch_message_list_create (thread);
-    if (unlikely (thread->message_list == NULL))
-	return NULL;
-
     thread->message_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
 						  free, NULL);
 
+    thread->message_list = _notmuch_message_list_create (thread);
+    if (unlikely (thread->message_list == NULL)) {
+	talloc_free (thread);
+	return NULL;
+    }
+
     thread->total_messages = 0;
     thread->matched_messages = 0;
     thread->oldest = 0;
     thread->newest = 0;
 
-    /* We use oldest-first order unconditionally here to obtain the
-     * proper author ordering for the thread. The 'sort' parameter
-     * passed to this function is used only to indicate whether the
-     * oldest or newest subject is desired. */
-    notmuch_query_set_sort (thread_id_query, NOTMUCH_SORT_OLDEST_FIRST);
+    return thread;
+}
 
-    for (messages = notmuch_query_search_messages (thread_id_query);
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages))
-    {
-	unsigned int doc_id;
+/* Create one new notmuch_thread_t object for each of the 'count'
+ * (distinct) thread IDs in 'thread_ids', storing them in the same
+ * order in 'threads_ret'. Any messages contained in match_set are
+ * treated as "matched", and all messages of the threads are removed
+ * from match_set.
+ *
+ * The members of all of the threads are fetched with a single
+ * database search, (a disjunction of the thread terms), rather than
+ * one search per thread. Each thread gets the first subject line,
+ * the total count of messages, and all authors in the thread. Each
+ * message in the thread is checked against match_set to allow for a
+ * separate count of matched messages, and to allow a viewer to
+ * display these messages differently.
+ *
+ * Here, 'ctx' is talloc context for the resulting thread objects.
+ *
+ * Several calls may run concurrently, (from different threads of
+ * execution, each with its own 'ctx' and 'notmuch' handle), sharing
+ * a single match_set.
+ *
+ * On failure, no threads are returned, (every element of threads_ret
+ * is set to NULL).
+ */
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      const char **thread_ids,
+			      unsigned int count,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_sort_t sort,
+			      notmuch_thread_t **threads_ret)
+{
+    GHashTable *threads_by_id;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i;
 
-	message = notmuch_messages_get (messages);
-	doc_id = _notmuch_message_get_doc_id (message);
-	if (doc_id == seed_doc_id)
-	    message = seed_message;
+    for (i = 0; i < count; i++)
+	threads_ret[i] = NULL;
 
-	_thread_add_message (thread, message);
+    threads_by_id = g_hash_table_new (g_str_hash, g_str_equal);
 
-	if ( _notmuch_doc_id_set_contains (match_set, doc_id)) {
-	    _notmuch_doc_id_set_remove (match_set, doc_id);
-	    _thread_add_matched_message (thread, message, sort);
+    for (i = 0; i < count; i++) {
+	threads_ret[i] = _thread_new (ctx, notmuch, thread_ids[i]);
+	if (unlikely (threads_ret[i] == NULL)) {
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
 	}
+	g_hash_table_insert (threads_by_id, threads_ret[i]->thread_id,
+			     threads_ret[i]);
+    }
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+	std::vector<std::string> terms;
+
+	for (i = 0; i < count; i++)
+	    _notmuch_database_get_thread_terms (notmuch, thread_ids[i], terms);
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+
+	/* We use oldest-first order unconditionally here to obtain
+	 * the proper author ordering for the thread. The 'sort'
+	 * parameter passed to this function is used only to indicate
+	 * whether the oldest or newest subject is desired. */
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_OR,
+					  terms.begin (), terms.end ()));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    unsigned int doc_id = *iterator;
+	    notmuch_message_t *message;
+	    notmuch_thread_t *thread;
 
-	_notmuch_message_close (message);
+	    message = _notmuch_message_create (ctx, notmuch, doc_id, NULL);
+	    if (unlikely (message == NULL))
+		continue;
+
+	    thread = (notmuch_thread_t *)
+		g_hash_table_lookup (threads_by_id,
+				     notmuch_message_get_thread_id (message));
+	    if (unlikely (thread == NULL)) {
+		notmuch_message_destroy (message);
+		continue;
+	    }
+
+	    _thread_add_message (thread, message);
+
+	    if (_notmuch_doc_id_set_claim (match_set, doc_id))
+		_thread_add_matched_message (thread, message, sort);
+
+	    _notmuch_message_close (message);
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred building threads: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
     }
 
-    notmuch_query_destroy (thread_id_query);
+    for (i = 0; i < count; i++) {
+	_resolve_thread_authors_string (threads_ret[i]);
+	_resolve_thread_relationships (threads_ret[i]);
+    }
 
-    _resolve_thread_authors_string (thread);
+  DONE:
+    g_hash_table_destroy (threads_by_id);
 
-    _resolve_thread_relationships (thread);
+    if (status) {
+	for (i = 0; i < count; i++) {
+	    if (threads_ret[i]) {
+		talloc_free (threads_ret[i]);
+		threads_ret[i] = NULL;
+	    }
+	}
+    }
 
-    return thread;
+    return status;
+}
+
+static void
+_set_message_database (unused (gpointer key),
+		       gpointer value,
+		       gpointer user_data)
+{
+    _notmuch_message_set_database ((notmuch_message_t *) value,
+				   (notmuch_database_t *) user_data);
+}
+
+/* Make 'thread' and all of its messages refer to 'notmuch', (see
+ * _notmuch_message_set_database). */
+void
+_notmuch_thread_set_database (notmuch_thread_t *thread,
+			      notmuch_database_t *notmuch)
+{
+    thread->notmuch = notmuch;
+
+    g_hash_table_foreach (thread->message_hash,
+			  _set_message_database, notmuch);
 }
 
 notmuch_messages_t *
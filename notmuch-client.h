@@ -45,6 +45,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 
 #include <talloc.h>
@@ -113,6 +114,9 @@ chomp_newline (char *str)
 	str[strlen(str)-1] = '\0';
 }
 
+int
+notmuch_compact_threads_command (void *ctx, int argc, char *argv[]);
+
 int
 notmuch_count_command (void *ctx, int argc, char *argv[]);
 
@@ -122,6 +126,9 @@ notmuch_dump_command (void *ctx, int argc, char *argv[]);
 int
 notmuch_new_command (void *ctx, int argc, char *argv[]);
 
+int
+notmuch_watch_command (void *ctx, int argc, char *argv[]);
+
 int
 notmuch_reply_command (void *ctx, int argc, char *argv[]);
 
@@ -197,6 +204,33 @@ void
 notmuch_config_set_database_path (notmuch_config_t *config,
 				  const char *database_path);
 
+unsigned int
+notmuch_config_get_database_batch_messages (notmuch_config_t *config);
+
+void
+notmuch_config_set_database_batch_messages (notmuch_config_t *config,
+					    unsigned int messages);
+
+unsigned int
+notmuch_config_get_database_batch_megabytes (notmuch_config_t *config);
+
+void
+notmuch_config_set_database_batch_megabytes (notmuch_config_t *config,
+					     unsigned int megabytes);
+
+unsigned int
+notmuch_config_get_database_batch_seconds (notmuch_config_t *config);
+
+void
+notmuch_config_set_database_batch_seconds (notmuch_config_t *config,
+					   unsigned int seconds);
+
+/* Put 'notmuch' into batch mode with the limits configured in
+ * 'config'. */
+notmuch_status_t
+notmuch_config_begin_batch (notmuch_config_t *config,
+			    notmuch_database_t *notmuch);
+
 const char *
 notmuch_config_get_user_name (notmuch_config_t *config);
 
@@ -228,6 +262,27 @@ notmuch_config_set_new_tags (notmuch_config_t *config,
 			     const char *new_tags[],
 			     size_t length);
 
+unsigned int
+notmuch_config_get_new_jobs (notmuch_config_t *config);
+
+void
+notmuch_config_set_new_jobs (notmuch_config_t *config,
+			     unsigned int jobs);
+
+unsigned int
+notmuch_config_get_new_index_part_kilobytes (notmuch_config_t *config);
+
+void
+notmuch_config_set_new_index_part_kilobytes (notmuch_config_t *config,
+					     unsigned int kilobytes);
+
+unsigned int
+notmuch_config_get_new_index_message_kilobytes (notmuch_config_t *config);
+
+void
+notmuch_config_set_new_index_message_kilobytes (notmuch_config_t *config,
+						unsigned int kilobytes);
+
 notmuch_bool_t
 notmuch_config_get_maildir_synchronize_flags (notmuch_config_t *config);
 
@@ -235,6 +290,13 @@ void
 notmuch_config_set_maildir_synchronize_flags (notmuch_config_t *config,
 					      notmuch_bool_t synchronize_flags);
 
+unsigned int
+notmuch_config_get_search_jobs (notmuch_config_t *config);
+
+void
+notmuch_config_set_search_jobs (notmuch_config_t *config,
+				unsigned int jobs);
+
 notmuch_bool_t
 debugger_is_active (void);
 
@@ -0,0 +1,57 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2009 Carl Worth
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ *
+ * Author: Carl Worth <cworth@cworth.org>
+ */
+
+#include "notmuch-client.h"
+
+int
+notmuch_compact_threads_command (void *ctx,
+				 unused (int argc),
+				 unused (char *argv[]))
+{
+    notmuch_config_t *config;
+    notmuch_database_t *notmuch;
+    notmuch_status_t status;
+
+    config = notmuch_config_open (ctx, NULL, NULL);
+    if (config == NULL)
+	return 1;
+
+    notmuch = notmuch_database_open (notmuch_config_get_database_path (config),
+				     NOTMUCH_DATABASE_MODE_READ_WRITE);
+    if (notmuch == NULL)
+	return 1;
+
+    if (notmuch_database_needs_upgrade (notmuch)) {
+	fprintf (stderr, "Error: The database needs to be upgraded first. "
+		 "Run \"notmuch new\" to do so.\n");
+	notmuch_database_close (notmuch);
+	return 1;
+    }
+
+    status = notmuch_database_compact_threads (notmuch);
+    if (status) {
+	fprintf (stderr, "Error compacting threads: %s\n",
+		 notmuch_status_to_string (status));
+    }
+
+    notmuch_database_close (notmuch);
+
+    return status ? 1 : 0;
+}
@@ -31,11 +31,22 @@ static const char toplevel_config_comment[] =
 static const char database_config_comment[] =
     " Database configuration\n"
     "\n"
-    " The only value supported here is 'path' which should be the top-level\n"
+    " The most important value here is 'path' which should be the top-level\n"
     " directory where your mail currently exists and to where mail will be\n"
     " delivered in the future. Files should be individual email messages.\n"
     " Notmuch will store its database within a sub-directory of the path\n"
-    " configured here named \".notmuch\".\n";
+    " configured here named \".notmuch\".\n"
+    "\n"
+    " When adding or restoring many messages, notmuch commits its changes\n"
+    " to disk in batches. A batch is committed as soon as it reaches any\n"
+    " of the following limits, (a value of 0 disables that limit):\n"
+    "\n"
+    "\tbatch_messages	The number of messages in a batch.\n"
+    "\tbatch_megabytes	The total size of the message files added.\n"
+    "\tbatch_seconds	The time since the batch began.\n"
+    "\n"
+    " An interrupted run loses at most the batch in progress, which the\n"
+    " next run will simply add again.\n";
 
 static const char new_config_comment[] =
     " Configuration for \"notmuch new\"\n"
@@ -43,7 +54,20 @@ static const char new_config_comment[] =
     " The following options are supported here:\n"
     "\n"
     "\ttags	A list (separated by ';') of the tags that will be\n"
-    "\t	added to all messages incorporated by \"notmuch new\".\n";
+    "\t	added to all messages incorporated by \"notmuch new\".\n"
+    "\n"
+    "\tjobs	The number of threads of execution used to read the\n"
+    "\t	directories of the mail store, and to read and index\n"
+    "\t	new messages. The default of 1 does one thing after the\n"
+    "\t	other, larger values may speed up adding many messages,\n"
+    "\t	(or checking many directories), on machines with several\n"
+    "\t	processor cores or fast storage.\n"
+    "\n"
+    "\tindex_part_kilobytes\n"
+    "\tindex_message_kilobytes\n"
+    "\t	The most text indexed for searching from each MIME part,\n"
+    "\t	and from each message, (0, the default, means no limit).\n"
+    "\t	Text past these limits can't be found by searching.\n";
 
 static const char user_config_comment[] =
     " User configuration\n"
@@ -83,18 +107,36 @@ static const char maildir_config_comment[] =
     "\tand update tags, while the \"notmuch tag\" and \"notmuch restore\"\n"
     "\tcommands will notice tag changes and update flags in filenames\n";
 
+static const char search_config_comment[] =
+    " Configuration for \"notmuch search\" and \"notmuch show\"\n"
+    "\n"
+    " The following option is supported here:\n"
+    "\n"
+    "\tjobs	The number of threads of execution used to\n"
+    "\t	construct the mail threads of the results. The default\n"
+    "\t	of 1 constructs them one after the other, larger values\n"
+    "\t	may speed up searches with many results on machines with\n"
+    "\t	several processor cores.\n";
+
 struct _notmuch_config {
     char *filename;
     GKeyFile *key_file;
 
     char *database_path;
+    unsigned int database_batch_messages;
+    unsigned int database_batch_megabytes;
+    unsigned int database_batch_seconds;
     char *user_name;
     char *user_primary_email;
     const char **user_other_email;
     size_t user_other_email_length;
     const char **new_tags;
     size_t new_tags_length;
+    unsigned int new_jobs;
+    unsigned int new_index_part_kilobytes;
+    unsigned int new_index_message_kilobytes;
     notmuch_bool_t maildir_synchronize_flags;
+    unsigned int search_jobs;
 };
 
 static int
@@ -220,6 +262,8 @@ notmuch_config_open (void *ctx,
     int file_had_new_group;
     int file_had_user_group;
     int file_had_maildir_group;
+    int file_had_search_group;
+    int jobs, value;
 
     if (is_new_ret)
 	*is_new_ret = 0;
@@ -294,6 +338,7 @@ notmuch_config_open (void *ctx,
     file_had_new_group = g_key_file_has_group (config->key_file, "new");
     file_had_user_group = g_key_file_has_group (config->key_file, "user");
     file_had_maildir_group = g_key_file_has_group (config->key_file, "maildir");
+    file_had_search_group = g_key_file_has_group (config->key_file, "search");
 
 
     if (notmuch_config_get_database_path (config) == NULL) {
@@ -303,6 +348,36 @@ notmuch_config_open (void *ctx,
 	talloc_free (path);
     }
 
+    error = NULL;
+    value = g_key_file_get_integer (config->key_file,
+				    "database", "batch_messages", &error);
+    if (error) {
+	notmuch_config_set_database_batch_messages (config, 1000);
+	g_error_free (error);
+    } else {
+	config->database_batch_messages = value > 0 ? value : 0;
+    }
+
+    error = NULL;
+    value = g_key_file_get_integer (config->key_file,
+				    "database", "batch_megabytes", &error);
+    if (error) {
+	notmuch_config_set_database_batch_megabytes (config, 64);
+	g_error_free (error);
+    } else {
+	config->database_batch_megabytes = value > 0 ? value : 0;
+    }
+
+    error = NULL;
+    value = g_key_file_get_integer (config->key_file,
+				    "database", "batch_seconds", &error);
+    if (error) {
+	notmuch_config_set_database_batch_seconds (config, 10);
+	g_error_free (error);
+    } else {
+	config->database_batch_seconds = value > 0 ? value : 0;
+    }
+
     if (notmuch_config_get_user_name (config) == NULL) {
 	char *name = get_name_from_passwd_file (config);
 	notmuch_config_set_user_name (config, name);
@@ -344,6 +419,36 @@ notmuch_config_open (void *ctx,
 	notmuch_config_set_new_tags (config, tags, 2);
     }
 
+    error = NULL;
+    jobs = g_key_file_get_integer (config->key_file,
+				   "new", "jobs", &error);
+    if (error) {
+	notmuch_config_set_new_jobs (config, 1);
+	g_error_free (error);
+    } else {
+	config->new_jobs = jobs > 0 ? jobs : 1;
+    }
+
+    error = NULL;
+    value = g_key_file_get_integer (config->key_file,
+				    "new", "index_part_kilobytes", &error);
+    if (error) {
+	notmuch_config_set_new_index_part_kilobytes (config, 0);
+	g_error_free (error);
+    } else {
+	config->new_index_part_kilobytes = value > 0 ? value : 0;
+    }
+
+    error = NULL;
+    value = g_key_file_get_integer (config->key_file,
+				    "new", "index_message_kilobytes", &error);
+    if (error) {
+	notmuch_config_set_new_index_message_kilobytes (config, 0);
+	g_error_free (error);
+    } else {
+	config->new_index_message_kilobytes = value > 0 ? value : 0;
+    }
+
     error = NULL;
     config->maildir_synchronize_flags =
 	g_key_file_get_boolean (config->key_file,
@@ -353,6 +458,16 @@ notmuch_config_open (void *ctx,
 	g_error_free (error);
     }
 
+    error = NULL;
+    jobs = g_key_file_get_integer (config->key_file,
+				   "search", "jobs", &error);
+    if (error) {
+	notmuch_config_set_search_jobs (config, 1);
+	g_error_free (error);
+    } else {
+	config->search_jobs = jobs > 0 ? jobs : 1;
+    }
+
     /* Whenever we know of configuration sections that don't appear in
      * the configuration file, we add some comments to help the user
      * understand what can be done. */
@@ -386,6 +501,12 @@ notmuch_config_open (void *ctx,
 				maildir_config_comment, NULL);
     }
 
+    if (! file_had_search_group)
+    {
+	g_key_file_set_comment (config->key_file, "search", NULL,
+				search_config_comment, NULL);
+    }
+
     if (is_new_ret)
 	*is_new_ret = is_new;
 
@@ -464,6 +585,62 @@ notmuch_config_set_database_path (notmuch_config_t *config,
     config->database_path = NULL;
 }
 
+unsigned int
+notmuch_config_get_database_batch_messages (notmuch_config_t *config)
+{
+    return config->database_batch_messages;
+}
+
+void
+notmuch_config_set_database_batch_messages (notmuch_config_t *config,
+					    unsigned int messages)
+{
+    g_key_file_set_integer (config->key_file,
+			    "database", "batch_messages", messages);
+    config->database_batch_messages = messages;
+}
+
+unsigned int
+notmuch_config_get_database_batch_megabytes (notmuch_config_t *config)
+{
+    return config->database_batch_megabytes;
+}
+
+void
+notmuch_config_set_database_batch_megabytes (notmuch_config_t *config,
+					     unsigned int megabytes)
+{
+    g_key_file_set_integer (config->key_file,
+			    "database", "batch_megabytes", megabytes);
+    config->database_batch_megabytes = megabytes;
+}
+
+unsigned int
+notmuch_config_get_database_batch_seconds (notmuch_config_t *config)
+{
+    return config->database_batch_seconds;
+}
+
+void
+notmuch_config_set_database_batch_seconds (notmuch_config_t *config,
+					   unsigned int seconds)
+{
+    g_key_file_set_integer (config->key_file,
+			    "database", "batch_seconds", seconds);
+    config->database_batch_seconds = seconds;
+}
+
+notmuch_status_t
+notmuch_config_begin_batch (notmuch_config_t *config,
+			    notmuch_database_t *notmuch)
+{
+    return notmuch_database_begin_batch (notmuch,
+					 config->database_batch_messages,
+					 (size_t) config->database_batch_megabytes
+					 * 1024 * 1024,
+					 config->database_batch_seconds);
+}
+
 const char *
 notmuch_config_get_user_name (notmuch_config_t *config)
 {
@@ -608,6 +785,50 @@ notmuch_config_set_new_tags (notmuch_config_t *config,
     config->new_tags = NULL;
 }
 
+unsigned int
+notmuch_config_get_new_jobs (notmuch_config_t *config)
+{
+    return config->new_jobs;
+}
+
+void
+notmuch_config_set_new_jobs (notmuch_config_t *config,
+			     unsigned int jobs)
+{
+    g_key_file_set_integer (config->key_file, "new", "jobs", jobs);
+    config->new_jobs = jobs;
+}
+
+unsigned int
+notmuch_config_get_new_index_part_kilobytes (notmuch_config_t *config)
+{
+    return config->new_index_part_kilobytes;
+}
+
+void
+notmuch_config_set_new_index_part_kilobytes (notmuch_config_t *config,
+					     unsigned int kilobytes)
+{
+    g_key_file_set_integer (config->key_file,
+			    "new", "index_part_kilobytes", kilobytes);
+    config->new_index_part_kilobytes = kilobytes;
+}
+
+unsigned int
+notmuch_config_get_new_index_message_kilobytes (notmuch_config_t *config)
+{
+    return config->new_index_message_kilobytes;
+}
+
+void
+notmuch_config_set_new_index_message_kilobytes (notmuch_config_t *config,
+						unsigned int kilobytes)
+{
+    g_key_file_set_integer (config->key_file,
+			    "new", "index_message_kilobytes", kilobytes);
+    config->new_index_message_kilobytes = kilobytes;
+}
+
 /* Given a configuration item of the form <group>.<key> return the
  * component group and key. If any error occurs, print a message on
  * stderr and return 1. Otherwise, return 0.
@@ -764,3 +985,17 @@ notmuch_config_set_maildir_synchronize_flags (notmuch_config_t *config,
 			    "maildir", "synchronize_flags", synchronize_flags);
     config->maildir_synchronize_flags = synchronize_flags;
 }
+
+unsigned int
+notmuch_config_get_search_jobs (notmuch_config_t *config)
+{
+    return config->search_jobs;
+}
+
+void
+notmuch_config_set_search_jobs (notmuch_config_t *config,
+				unsigned int jobs)
+{
+    g_key_file_set_integer (config->key_file, "search", "jobs", jobs);
+    config->search_jobs = jobs;
+}
@@ -21,6 +21,11 @@
 
 #include "notmuch-client.h"
 
+typedef enum {
+    OUTPUT_THREADS,
+    OUTPUT_MESSAGES
+} output_t;
+
 int
 notmuch_count_command (void *ctx, int argc, char *argv[])
 {
@@ -28,7 +33,9 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
     notmuch_database_t *notmuch;
     notmuch_query_t *query;
     char *query_str;
+    char *opt;
     int i;
+    output_t output = OUTPUT_MESSAGES;
 #if 0
     char *opt, *end;
     int i, first = 0, max_threads = -1;
@@ -40,6 +47,17 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	    i++;
 	    break;
 	}
+	if (STRNCMP_LITERAL (argv[i], "--output=") == 0) {
+	    opt = argv[i] + sizeof ("--output=") - 1;
+	    if (strcmp (opt, "threads") == 0) {
+		output = OUTPUT_THREADS;
+	    } else if (strcmp (opt, "messages") == 0) {
+		output = OUTPUT_MESSAGES;
+	    } else {
+		fprintf (stderr, "Invalid value for --output: %s\n", opt);
+		return 1;
+	    }
+	} else
 #if 0
 	if (STRNCMP_LITERAL (argv[i], "--first=") == 0) {
 	    opt = argv[i] + sizeof ("--first=") - 1;
@@ -101,7 +119,14 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	return 1;
     }
 
-    printf ("%u\n", notmuch_query_count_messages(query));
+    switch (output) {
+    case OUTPUT_MESSAGES:
+	printf ("%u\n", notmuch_query_count_messages (query));
+	break;
+    case OUTPUT_THREADS:
+	printf ("%u\n", notmuch_query_count_threads (query));
+	break;
+    }
 
     notmuch_query_destroy (query);
     notmuch_database_close (notmuch);
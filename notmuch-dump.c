@@ -20,16 +20,139 @@
 
 #include "notmuch-client.h"
 
+/* Write 'len' bytes of 'buf' to 'output', through 'gzip_filter' if
+ * it isn't NULL, (completing the compressed output if 'complete'). */
+static void
+write_output (FILE *output, GMimeFilter *gzip_filter,
+	      char *buf, size_t len, notmuch_bool_t complete)
+{
+    char *outbuf;
+    size_t outlen, outprespace;
+
+    if (gzip_filter == NULL) {
+	fwrite (buf, 1, len, output);
+	return;
+    }
+
+    if (complete)
+	g_mime_filter_complete (gzip_filter, buf, len, 0,
+				&outbuf, &outlen, &outprespace);
+    else
+	g_mime_filter_filter (gzip_filter, buf, len, 0,
+			      &outbuf, &outlen, &outprespace);
+
+    fwrite (outbuf, 1, outlen, output);
+}
+
+/* Append the dump line of the message with 'message_id' and 'tags'
+ * to 'line'. */
+static void
+format_line (GString *line, const char *message_id, notmuch_tags_t *tags)
+{
+    int first = 1;
+
+    g_string_assign (line, message_id);
+    g_string_append (line, " (");
+
+    for (;
+	 notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+    {
+	if (! first)
+	    g_string_append_c (line, ' ');
+
+	g_string_append (line, notmuch_tags_get (tags));
+
+	first = 0;
+    }
+
+    g_string_append (line, ")\n");
+}
+
+/* Write the lines of the messages whose tags changed after revision
+ * 'since', up to 'revision', (in the same order as a full dump). */
+static int
+dump_changes (notmuch_database_t *notmuch, FILE *output,
+	      GMimeFilter *gzip_filter, GString *line,
+	      unsigned long since, unsigned long revision)
+{
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_tags_t *tags;
+    char *query_string;
+
+    if (since >= revision)
+	return 0;
+
+    query_string = talloc_asprintf (notmuch, "lastmod:%lu..%lu",
+				    since + 1, revision);
+    query = notmuch_query_create (notmuch, query_string);
+    if (query == NULL) {
+	fprintf (stderr, "Out of memory\n");
+	return 1;
+    }
+    notmuch_query_set_sort (query, NOTMUCH_SORT_MESSAGE_ID);
+
+    for (messages = notmuch_query_search_messages (query);
+	 notmuch_messages_valid (messages);
+	 notmuch_messages_move_to_next (messages))
+    {
+	message = notmuch_messages_get (messages);
+
+	tags = notmuch_message_get_tags (message);
+	format_line (line, notmuch_message_get_message_id (message), tags);
+	write_output (output, gzip_filter, line->str, line->len, FALSE);
+
+	notmuch_message_destroy (message);
+    }
+
+    notmuch_query_destroy (query);
+    talloc_free (query_string);
+
+    return 0;
+}
+
 int
 notmuch_dump_command (unused (void *ctx), int argc, char *argv[])
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
-    notmuch_query_t *query;
+    notmuch_tag_dump_t *dump;
     FILE *output;
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
+    GMimeFilter *gzip_filter = NULL;
+    GString *line;
     notmuch_tags_t *tags;
+    notmuch_bool_t incremental = FALSE;
+    unsigned long since = 0, revision;
+    char *end;
+    int i, ret = 0;
+
+    for (i = 0; i < argc && argv[i][0] == '-'; i++) {
+	if (strcmp (argv[i], "--") == 0) {
+	    i++;
+	    break;
+	}
+	if (strcmp (argv[i], "--gzip") == 0) {
+	    if (gzip_filter == NULL)
+		gzip_filter = g_mime_filter_gzip_new (GMIME_FILTER_GZIP_MODE_ZIP, 6);
+	} else if (STRNCMP_LITERAL (argv[i], "--since=") == 0) {
+	    const char *opt = argv[i] + sizeof ("--since=") - 1;
+
+	    since = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *opt == '-' || *end != '\0') {
+		fprintf (stderr, "Invalid value for --since: %s\n", opt);
+		return 1;
+	    }
+	    incremental = TRUE;
+	} else {
+	    fprintf (stderr, "Unrecognized option: %s\n", argv[i]);
+	    return 1;
+	}
+    }
+
+    argc -= i;
+    argv += i;
 
     config = notmuch_config_open (ctx, NULL, NULL);
     if (config == NULL)
@@ -40,13 +163,6 @@ notmuch_dump_command (unused (void *ctx), int argc, char *argv[])
     if (notmuch == NULL)
 	return 1;
 
-    query = notmuch_query_create (notmuch, "");
-    if (query == NULL) {
-	fprintf (stderr, "Out of memory\n");
-	return 1;
-    }
-    notmuch_query_set_sort (query, NOTMUCH_SORT_MESSAGE_ID);
-
     if (argc) {
 	output = fopen (argv[0], "w");
 	if (output == NULL) {
@@ -58,38 +174,58 @@ notmuch_dump_command (unused (void *ctx), int argc, char *argv[])
 	output = stdout;
     }
 
-    for (messages = notmuch_query_search_messages (query);
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages))
-    {
-	int first = 1;
-	message = notmuch_messages_get (messages);
+    line = g_string_new (NULL);
 
-	fprintf (output,
-		 "%s (", notmuch_message_get_message_id (message));
+    /* An incremental dump starts with the revisions it covers, so that
+     * the next one can carry on from there, (and so that "notmuch
+     * restore" knows it only holds some of the messages). */
+    revision = notmuch_database_get_revision (notmuch);
+    if (incremental) {
+	g_string_printf (line, "#notmuch-dump since:%lu revision:%lu\n",
+			 since, revision);
+	write_output (output, gzip_filter, line->str, line->len, FALSE);
+    }
 
-	for (tags = notmuch_message_get_tags (message);
-	     notmuch_tags_valid (tags);
-	     notmuch_tags_move_to_next (tags))
-	{
-	    if (! first)
-		fprintf (output, " ");
+    if (since) {
+	ret = dump_changes (notmuch, output, gzip_filter, line,
+			    since, revision);
+    } else {
+	dump = notmuch_database_dump_tags (notmuch);
+	if (dump == NULL)
+	    ret = 1;
 
-	    fprintf (output, "%s", notmuch_tags_get (tags));
+	for (;
+	     dump && notmuch_tag_dump_valid (dump);
+	     notmuch_tag_dump_move_to_next (dump))
+	{
+	    tags = notmuch_tag_dump_get_tags (dump);
+	    format_line (line, notmuch_tag_dump_get_message_id (dump), tags);
+	    notmuch_tags_destroy (tags);
 
-	    first = 0;
+	    write_output (output, gzip_filter, line->str, line->len, FALSE);
 	}
 
-	fprintf (output, ")\n");
+	if (dump)
+	    notmuch_tag_dump_destroy (dump);
+    }
 
-	notmuch_message_destroy (message);
+    g_string_free (line, TRUE);
+
+    if (gzip_filter)
+	write_output (output, gzip_filter, (char *) "", 0, TRUE);
+
+    if (gzip_filter)
+	g_object_unref (gzip_filter);
+
+    if (fflush (output) || ferror (output)) {
+	fprintf (stderr, "Error writing dump: %s\n", strerror (errno));
+	ret = 1;
     }
 
     if (output != stdout)
 	fclose (output);
 
-    notmuch_query_destroy (query);
     notmuch_database_close (notmuch);
 
-    return 0;
+    return ret;
 }
@@ -22,9 +22,18 @@
 
 #include <unistd.h>
 
+#if HAVE_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
 typedef struct _filename_node {
     char *filename;
     time_t mtime;
+    /* The names of the subdirectories walked, to be recorded along
+     * with 'mtime', (see check_directory). */
+    const char **subdirs;
+    unsigned int num_subdirs;
     struct _filename_node *next;
 } _filename_node_t;
 
@@ -40,7 +49,6 @@ typedef struct {
     const char **new_tags;
     size_t new_tags_length;
 
-    int total_files;
     int processed_files;
     int added_messages, removed_messages, renamed_messages;
     struct timeval tv_start;
@@ -50,8 +58,90 @@ typedef struct {
     _filename_list_t *directory_mtimes;
 
     notmuch_bool_t synchronize_flags;
+
+    /* When indexing with several threads of execution, new files are
+     * indexed by the 'index_pool' workers, (each borrowing one of the
+     * 'idle_indexers'), and the results come back on 'indexed_files'
+     * to be added to the database by the main thread. */
+    GThreadPool *index_pool;
+    GAsyncQueue *idle_indexers;
+    GAsyncQueue *indexed_files;
+    unsigned int num_indexers;
+    unsigned int in_flight;
+    unsigned int max_in_flight;
+    notmuch_bool_t halted;
+
+    /* Directories are stat'ed and read by the 'scan_pool' workers,
+     * (or by the main thread from 'unscanned_dirs' when there's no
+     * pool), and come back on 'scanned_dirs' to be compared with the
+     * database by the main thread, (see add_files). */
+    GThreadPool *scan_pool;
+    GAsyncQueue *scanned_dirs;
+    GQueue *unscanned_dirs;
+    volatile notmuch_bool_t scan_halted;
 } add_files_state_t;
 
+/* The kind of an entry of a scanned directory. */
+typedef enum {
+    SCANNED_FILE,
+    SCANNED_DIRECTORY,
+    SCANNED_OTHER,
+    /* A symlink, (or entry of unknown type), which couldn't be
+     * stat'ed. */
+    SCANNED_ERROR
+} scanned_type_t;
+
+typedef struct {
+    char *name;
+    ino_t inode;
+    scanned_type_t type;
+    /* The errno of the failed stat of a SCANNED_ERROR entry. */
+    int error;
+} scanned_entry_t;
+
+/* A directory as stat'ed, (and possibly read), from the filesystem
+ * by scan_directory, (on any thread of execution), waiting to be
+ * compared with the database by check_directory or update_directory,
+ * (on the main thread).
+ *
+ * The record is created and freed by the main thread, (see
+ * _scanned_dir_create), while a worker thread only allocates beneath
+ * it. */
+typedef struct {
+    char *path;
+
+    /* Whether check_directory has found that the entries must be
+     * read, and whether they have been. */
+    notmuch_bool_t read_wanted;
+    notmuch_bool_t read;
+
+    /* The errno of a failed stat or opendir of 'path', (or 0). */
+    int stat_error;
+    int open_error;
+
+    notmuch_bool_t is_directory;
+    notmuch_bool_t is_maildir;
+    time_t fs_mtime;
+    time_t stat_time;
+
+    /* The entries, (except "." and ".."), sorted by name. */
+    scanned_entry_t *entries;
+    unsigned int num_entries;
+
+    /* The number of subdirectories queued to be stat'ed in turn. */
+    unsigned int num_subdirs;
+} scanned_dir_t;
+
+/* A file to be added to the database. If 'indexed' is NULL the file
+ * has not been read yet. Otherwise it was created by the main thread
+ * for an indexer to fill in, and 'status' is the result of
+ * notmuch_indexer_index_file. */
+typedef struct {
+    char *filename;
+    notmuch_status_t status;
+    notmuch_indexed_file_t *indexed;
+} add_file_job_t;
+
 static volatile sig_atomic_t do_print_progress = 0;
 
 static void
@@ -96,6 +186,8 @@ _filename_list_add (_filename_list_t *list,
     list->count++;
 
     node->filename = talloc_strdup (list, filename);
+    node->subdirs = NULL;
+    node->num_subdirs = 0;
     node->next = NULL;
 
     *(list->tail) = node;
@@ -137,36 +229,39 @@ generic_print_progress (const char *action, const char *object,
 }
 
 static int
-dirent_sort_inode (const struct dirent **a, const struct dirent **b)
+scanned_entry_cmp_inode (const void *a, const void *b)
 {
-    return ((*a)->d_ino < (*b)->d_ino) ? -1 : 1;
+    return (((const scanned_entry_t *) a)->inode <
+	    ((const scanned_entry_t *) b)->inode) ? -1 : 1;
 }
 
 static int
-dirent_sort_strcmp_name (const struct dirent **a, const struct dirent **b)
+scanned_entry_cmp_name (const void *a, const void *b)
 {
-    return strcmp ((*a)->d_name, (*b)->d_name);
+    return strcmp (((const scanned_entry_t *) a)->name,
+		   ((const scanned_entry_t *) b)->name);
 }
 
 /* Test if the directory looks like a Maildir directory.
  *
- * Search through the array of directory entries to see if we can find all
+ * Search through the entries of the directory to see if we can find all
  * three subdirectories typical for Maildir, that is "new", "cur", and "tmp".
  *
  * Return 1 if the directory looks like a Maildir and 0 otherwise.
  */
 static int
-_entries_resemble_maildir (struct dirent **entries, int count)
+_entries_resemble_maildir (scanned_entry_t *entries, unsigned int count)
 {
-    int i, found = 0;
+    unsigned int i;
+    int found = 0;
 
     for (i = 0; i < count; i++) {
-	if (entries[i]->d_type != DT_DIR && entries[i]->d_type != DT_UNKNOWN)
+	if (entries[i].type != SCANNED_DIRECTORY)
 	    continue;
 
-	if (strcmp(entries[i]->d_name, "new") == 0 ||
-	    strcmp(entries[i]->d_name, "cur") == 0 ||
-	    strcmp(entries[i]->d_name, "tmp") == 0)
+	if (strcmp(entries[i].name, "new") == 0 ||
+	    strcmp(entries[i].name, "cur") == 0 ||
+	    strcmp(entries[i].name, "tmp") == 0)
 	{
 	    found++;
 	    if (found == 3)
@@ -177,360 +272,843 @@ _entries_resemble_maildir (struct dirent **entries, int count)
     return 0;
 }
 
-/* Examine 'path' recursively as follows:
- *
- *   o Ask the filesystem for the mtime of 'path' (fs_mtime)
- *   o Ask the database for its timestamp of 'path' (db_mtime)
- *
- *   o Ask the filesystem for files and directories within 'path'
- *     (via scandir and stored in fs_entries)
- *
- *   o Pass 1: For each directory in fs_entries, recursively call into
- *     this same function.
- *
- *   o Compare fs_mtime to db_mtime. If they are equivalent, terminate
- *     the algorithm at this point, (this directory has not been
- *     updated in the filesystem since the last database scan of PASS
- *     2).
- *
- *   o Ask the database for files and directories within 'path'
- *     (db_files and db_subdirs)
- *
- *   o Pass 2: Walk fs_entries simultaneously with db_files and
- *     db_subdirs. Look for one of three interesting cases:
- *
- *	   1. Regular file in fs_entries and not in db_files
- *            This is a new file to add_message into the database.
- *
- *         2. Filename in db_files not in fs_entries.
- *            This is a file that has been removed from the mail store.
+/* Should the walk descend into 'entry' of 'dir'?
  *
- *         3. Directory in db_subdirs not in fs_entries
- *            This is a directory that has been removed from the mail store.
+ * We ignore the .notmuch directory and any "tmp" directory that
+ * appears within a maildir. */
+/* XXX: Eventually we'll want more sophistication to let the
+ * user specify files to be ignored. */
+static notmuch_bool_t
+_entry_is_walked (scanned_dir_t *dir, scanned_entry_t *entry)
+{
+    if (entry->type != SCANNED_DIRECTORY && entry->type != SCANNED_ERROR)
+	return FALSE;
+
+    if ((dir->is_maildir && strcmp (entry->name, "tmp") == 0) ||
+	strcmp (entry->name, ".notmuch") == 0)
+    {
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Add the file of 'job' to the database, (reading it first unless an
+ * indexer already has), and apply the new tags.
  *
- *     Note that the addition of a directory is not interesting here,
- *     since that will have been taken care of in pass 1. Also, we
- *     don't immediately act on file/directory removal since we must
- *     ensure that in the case of a rename that the new filename is
- *     added before the old filename is removed, (so that no
- *     information is lost from the database).
- *
- *   o Tell the database to update its time of 'path' to 'fs_mtime'
- *     if fs_mtime isn't the current wall-clock time.
- */
+ * Returns a status other than NOTMUCH_STATUS_SUCCESS only for errors
+ * after which processing should halt. */
 static notmuch_status_t
-add_files_recursive (notmuch_database_t *notmuch,
-		     const char *path,
-		     add_files_state_t *state)
+add_file (notmuch_database_t *notmuch,
+	  add_file_job_t *job,
+	  add_files_state_t *state)
 {
-    DIR *dir = NULL;
-    struct dirent *entry = NULL;
-    char *next = NULL;
-    time_t fs_mtime, db_mtime;
-    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
     notmuch_message_t *message = NULL;
-    struct dirent **fs_entries = NULL;
-    int i, num_fs_entries;
-    notmuch_directory_t *directory;
-    notmuch_filenames_t *db_files = NULL;
-    notmuch_filenames_t *db_subdirs = NULL;
-    time_t stat_time;
-    struct stat st;
-    notmuch_bool_t is_maildir, new_directory;
+    notmuch_status_t status;
     const char **tag;
 
-    if (stat (path, &st)) {
-	fprintf (stderr, "Error reading directory %s: %s\n",
-		 path, strerror (errno));
-	return NOTMUCH_STATUS_FILE_ERROR;
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status) {
+	notmuch_indexed_file_destroy (job->indexed);
+	return status;
     }
-    stat_time = time (NULL);
 
-    /* This is not an error since we may have recursed based on a
-     * symlink to a regular file, not a directory, and we don't know
-     * that until this stat. */
-    if (! S_ISDIR (st.st_mode))
-	return NOTMUCH_STATUS_SUCCESS;
+    if (job->status) {
+	status = job->status;
+	notmuch_indexed_file_destroy (job->indexed);
+    } else if (job->indexed) {
+	status = notmuch_database_add_indexed_file (notmuch, job->indexed,
+						    &message);
+    } else {
+	status = notmuch_database_add_message (notmuch, job->filename,
+					       &message);
+    }
+    job->indexed = NULL;
+
+    switch (status) {
+    /* success */
+    case NOTMUCH_STATUS_SUCCESS:
+	state->added_messages++;
+	notmuch_message_freeze (message);
+	for (tag=state->new_tags; *tag != NULL; tag++)
+	    notmuch_message_add_tag (message, *tag);
+	if (state->synchronize_flags == TRUE)
+	    notmuch_message_maildir_flags_to_tags (message);
+	notmuch_message_thaw (message);
+	break;
+    /* Non-fatal issues (go on to next file) */
+    case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
+	if (state->synchronize_flags == TRUE)
+	    notmuch_message_maildir_flags_to_tags (message);
+	break;
+    case NOTMUCH_STATUS_FILE_NOT_EMAIL:
+	fprintf (stderr, "Note: Ignoring non-mail file: %s\n",
+		 job->filename);
+	break;
+    /* Fatal issues. Don't process anymore. */
+    case NOTMUCH_STATUS_READ_ONLY_DATABASE:
+    case NOTMUCH_STATUS_XAPIAN_EXCEPTION:
+    case NOTMUCH_STATUS_OUT_OF_MEMORY:
+	fprintf (stderr, "Error: %s. Halting processing.\n",
+		 notmuch_status_to_string (status));
+	return status;
+    default:
+    case NOTMUCH_STATUS_FILE_ERROR:
+    case NOTMUCH_STATUS_NULL_POINTER:
+    case NOTMUCH_STATUS_TAG_TOO_LONG:
+    case NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW:
+    case NOTMUCH_STATUS_UNBALANCED_ATOMIC:
+    case NOTMUCH_STATUS_LAST_STATUS:
+	INTERNAL_ERROR ("add_message returned unexpected value: %d",  status);
+	return status;
+    }
 
-    fs_mtime = st.st_mtime;
+    status = notmuch_database_end_atomic (notmuch);
 
-    directory = notmuch_database_get_directory (notmuch, path);
-    db_mtime = notmuch_directory_get_mtime (directory);
+    if (message)
+	notmuch_message_destroy (message);
 
-    new_directory = db_mtime ? FALSE : TRUE;
+    return status;
+}
 
-    /* XXX This is a temporary workaround.  If we don't update the
-     * database mtime until after processing messages in this
-     * directory, then a 0 mtime is *not* sufficient to indicate that
-     * this directory has no messages or subdirs in the database (for
-     * example, if an earlier run skipped the mtime update because
-     * fs_mtime == stat_time, or was interrupted before updating the
-     * mtime at the end).  To address this, we record a (bogus)
-     * non-zero value before processing any child messages so that a
-     * later run won't mistake this for a new directory (and, for
-     * example, fail to detect removed files and subdirs).
-     *
-     * A better solution would be for notmuch_database_get_directory
-     * to indicate if it really created a new directory or not, either
-     * by a new out-argument, or by recording this information and
-     * providing an accessor.
-     */
-    if (new_directory)
-	notmuch_directory_set_mtime (directory, -1);
+/* Runs in a worker thread: index the file of 'data', (an
+ * add_file_job_t), and hand it back to the main thread.
+ *
+ * Everything allocated here belongs to the job's indexed file, which
+ * the main thread created, (see queue_file). */
+static void
+index_file_worker (gpointer data, gpointer user_data)
+{
+    add_file_job_t *job = (add_file_job_t *) data;
+    add_files_state_t *state = (add_files_state_t *) user_data;
+    notmuch_indexer_t *indexer;
 
-    /* If the database knows about this directory, then we sort based
-     * on strcmp to match the database sorting. Otherwise, we can do
-     * inode-based sorting for faster filesystem operation. */
-    num_fs_entries = scandir (path, &fs_entries, 0,
-			      new_directory ?
-			      dirent_sort_inode : dirent_sort_strcmp_name);
+    indexer = (notmuch_indexer_t *) g_async_queue_pop (state->idle_indexers);
+    job->status = notmuch_indexer_index_file (indexer, job->indexed);
+    g_async_queue_push (state->idle_indexers, indexer);
 
-    if (num_fs_entries == -1) {
-	fprintf (stderr, "Error opening directory %s: %s\n",
-		 path, strerror (errno));
-	ret = NOTMUCH_STATUS_FILE_ERROR;
-	goto DONE;
-    }
+    g_async_queue_push (state->indexed_files, job);
+}
 
-    /* Pass 1: Recurse into all sub-directories. */
-    is_maildir = _entries_resemble_maildir (fs_entries, num_fs_entries);
+/* Add the files that have come back from the workers to the
+ * database, waiting for more to come back for as long as more than
+ * 'max_in_flight' are still out.
+ *
+ * Once an error has halted processing, files are discarded rather
+ * than added. */
+static notmuch_status_t
+add_indexed_files (notmuch_database_t *notmuch,
+		   add_files_state_t *state,
+		   unsigned int max_in_flight)
+{
+    add_file_job_t *job;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
 
-    for (i = 0; i < num_fs_entries; i++) {
-	if (interrupted)
+    while (state->in_flight) {
+	if (state->in_flight > max_in_flight)
+	    job = (add_file_job_t *) g_async_queue_pop (state->indexed_files);
+	else
+	    job = (add_file_job_t *) g_async_queue_try_pop (state->indexed_files);
+	if (job == NULL)
 	    break;
 
-	entry = fs_entries[i];
-
-	/* We only want to descend into directories.
-	 * But symlinks can be to directories too, of course.
-	 *
-	 * And if the filesystem doesn't tell us the file type in the
-	 * scandir results, then it might be a directory (and if not,
-	 * then we'll stat and return immediately in the next level of
-	 * recursion). */
-	if (entry->d_type != DT_DIR &&
-	    entry->d_type != DT_LNK &&
-	    entry->d_type != DT_UNKNOWN)
-	{
-	    continue;
-	}
+	state->in_flight--;
 
-	/* Ignore special directories to avoid infinite recursion.
-	 * Also ignore the .notmuch directory and any "tmp" directory
-	 * that appears within a maildir.
-	 */
-	/* XXX: Eventually we'll want more sophistication to let the
-	 * user specify files to be ignored. */
-	if (strcmp (entry->d_name, ".") == 0 ||
-	    strcmp (entry->d_name, "..") == 0 ||
-	    (is_maildir && strcmp (entry->d_name, "tmp") == 0) ||
-	    strcmp (entry->d_name, ".notmuch") ==0)
-	{
-	    continue;
+	if (! state->halted) {
+	    status = add_file (notmuch, job, state);
+	    if (status) {
+		state->halted = TRUE;
+		ret = status;
+	    }
+	} else {
+	    notmuch_indexed_file_destroy (job->indexed);
 	}
 
-	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
-	status = add_files_recursive (notmuch, next, state);
-	if (status && ret == NOTMUCH_STATUS_SUCCESS)
-	    ret = status;
-	talloc_free (next);
-	next = NULL;
+	talloc_free (job);
     }
 
-    /* If the directory's modification time in the filesystem is the
-     * same as what we recorded in the database the last time we
-     * scanned it, then we can skip the second pass entirely.
-     *
-     * We test for strict equality here to avoid a bug that can happen
-     * if the system clock jumps backward, (preventing new mail from
-     * being discovered until the clock catches up and the directory
-     * is modified again).
-     */
-    if (fs_mtime == db_mtime)
-	goto DONE;
+    return ret;
+}
 
-    /* new_directory means a directory that the database has never
-     * seen before. In that case, we can simply leave db_files and
-     * db_subdirs NULL. */
-    if (!new_directory) {
-	db_files = notmuch_directory_get_child_files (directory);
-	db_subdirs = notmuch_directory_get_child_directories (directory);
+/* Hand 'filename' to the worker threads for indexing, and add any
+ * files they have finished with to the database. */
+static notmuch_status_t
+queue_file (notmuch_database_t *notmuch,
+	    const char *filename,
+	    add_files_state_t *state)
+{
+    add_file_job_t *job;
+
+    job = talloc (NULL, add_file_job_t);
+    if (job == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    job->filename = talloc_strdup (job, filename);
+    job->status = NOTMUCH_STATUS_SUCCESS;
+
+    /* The indexed file is created here rather than by the worker, as
+     * talloc objects without a parent may only be created and freed
+     * by the main thread. */
+    job->indexed = notmuch_indexed_file_create (filename);
+    if (job->indexed == NULL) {
+	talloc_free (job);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
     }
 
-    /* Pass 2: Scan for new files, removed files, and removed directories. */
-    for (i = 0; i < num_fs_entries; i++)
-    {
-	if (interrupted)
-	    break;
+    g_thread_pool_push (state->index_pool, job, NULL);
+    state->in_flight++;
 
-        entry = fs_entries[i];
+    /* Limit the number of indexed files waiting in memory. */
+    return add_indexed_files (notmuch, state, state->max_in_flight - 1);
+}
 
-	/* Check if we've walked past any names in db_files or
-	 * db_subdirs. If so, these have been deleted. */
-	while (notmuch_filenames_valid (db_files) &&
-	       strcmp (notmuch_filenames_get (db_files), entry->d_name) < 0)
-	{
-	    char *absolute = talloc_asprintf (state->removed_files,
-					      "%s/%s", path,
-					      notmuch_filenames_get (db_files));
+/* Add the new file 'filename' to the database, (by way of the
+ * indexing threads if there are any). */
+static notmuch_status_t
+add_new_file (notmuch_database_t *notmuch,
+	      char *filename,
+	      add_files_state_t *state)
+{
+    notmuch_status_t status;
 
-	    _filename_list_add (state->removed_files, absolute);
+    state->processed_files++;
 
-	    notmuch_filenames_move_to_next (db_files);
-	}
+    if (state->verbose) {
+	if (state->output_is_a_tty)
+	    printf("\r\033[K");
 
-	while (notmuch_filenames_valid (db_subdirs) &&
-	       strcmp (notmuch_filenames_get (db_subdirs), entry->d_name) <= 0)
-	{
-	    const char *filename = notmuch_filenames_get (db_subdirs);
+	printf ("%i: %s", state->processed_files, filename);
 
-	    if (strcmp (filename, entry->d_name) < 0)
-	    {
-		char *absolute = talloc_asprintf (state->removed_directories,
-						  "%s/%s", path, filename);
+	putchar((state->output_is_a_tty) ? '\r' : '\n');
+	fflush (stdout);
+    }
 
-		_filename_list_add (state->removed_directories, absolute);
-	    }
+    if (state->index_pool) {
+	status = queue_file (notmuch, filename, state);
+    } else {
+	add_file_job_t job = { filename, NOTMUCH_STATUS_SUCCESS, NULL };
 
-	    notmuch_filenames_move_to_next (db_subdirs);
-	}
+	status = add_file (notmuch, &job, state);
+    }
+    if (status)
+	return status;
 
-	/* If we're looking at a symlink, we only want to add it if it
-	 * links to a regular file, (and not to a directory, say).
-	 *
-	 * Similarly, if the file is of unknown type (due to filesystem
-	 * limitations), then we also need to look closer.
-	 *
-	 * In either case, a stat does the trick.
-	 */
-	if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
-	    int err;
+    if (do_print_progress) {
+	do_print_progress = 0;
+	generic_print_progress ("Processed", "files", state->tv_start,
+				state->processed_files, 0);
+    }
 
-	    next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
-	    err = stat (next, &st);
-	    talloc_free (next);
-	    next = NULL;
+    return NOTMUCH_STATUS_SUCCESS;
+}
 
-	    /* Don't emit an error for a link pointing nowhere, since
-	     * the directory-traversal pass will have already done
-	     * that. */
-	    if (err)
-		continue;
+/* Start 'jobs' threads of execution to index new files, (see
+ * queue_file). If they can't be started, files are indexed by the
+ * main thread instead. */
+static void
+start_indexing (notmuch_database_t *notmuch,
+		add_files_state_t *state,
+		unsigned int jobs)
+{
+    notmuch_indexer_t *indexer;
+    unsigned int i;
+
+    state->index_pool = NULL;
+    state->idle_indexers = NULL;
+    state->indexed_files = NULL;
+    state->num_indexers = 0;
+    state->in_flight = 0;
+    state->max_in_flight = jobs * 16;
+    state->halted = FALSE;
+
+    if (jobs <= 1)
+	return;
+
+#if ! GLIB_CHECK_VERSION (2, 32, 0)
+    if (! g_thread_supported ())
+	g_thread_init (NULL);
+#endif
+
+    state->idle_indexers = g_async_queue_new ();
+    state->indexed_files = g_async_queue_new ();
+
+    for (i = 0; i < jobs; i++) {
+	indexer = notmuch_indexer_create (notmuch);
+	if (indexer == NULL)
+	    break;
+	g_async_queue_push (state->idle_indexers, indexer);
+	state->num_indexers++;
+    }
 
-	    if (! S_ISREG (st.st_mode))
-		continue;
-	} else if (entry->d_type != DT_REG) {
-	    continue;
-	}
+    if (state->num_indexers)
+	state->index_pool = g_thread_pool_new (index_file_worker, state,
+					       state->num_indexers,
+					       TRUE, NULL);
 
-	/* Don't add a file that we've added before. */
-	if (notmuch_filenames_valid (db_files) &&
-	    strcmp (notmuch_filenames_get (db_files), entry->d_name) == 0)
-	{
-	    notmuch_filenames_move_to_next (db_files);
-	    continue;
-	}
+    if (state->index_pool == NULL)
+	fprintf (stderr, "Warning: Failed to start indexing threads, "
+		 "indexing one file at a time.\n");
+}
 
-	/* We're now looking at a regular file that doesn't yet exist
-	 * in the database, so add it. */
-	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
+/* Wait for the indexing threads to finish, (after add_files has added
+ * everything they indexed), and release them. */
+static void
+stop_indexing (add_files_state_t *state)
+{
+    if (state->index_pool)
+	g_thread_pool_free (state->index_pool, FALSE, TRUE);
+
+    if (state->idle_indexers == NULL)
+	return;
+
+    while (state->num_indexers) {
+	notmuch_indexer_destroy ((notmuch_indexer_t *)
+				 g_async_queue_pop (state->idle_indexers));
+	state->num_indexers--;
+    }
+
+    g_async_queue_unref (state->idle_indexers);
+    g_async_queue_unref (state->indexed_files);
+}
 
-	state->processed_files++;
+/* Create the record of the directory 'path', (taking over the talloc
+ * string 'path', which must have no parent), to be stat'ed by
+ * scan_directory.
+ *
+ * This must only be called by the main thread. The record has no
+ * talloc parent, so that it may be handed to a worker thread and back
+ * without touching any other record. But notmuch enables talloc's
+ * null tracking, which links every such chunk into a single NULL
+ * context, and talloc has no locking, so only the main thread may
+ * create or free chunks without a parent. */
+static scanned_dir_t *
+_scanned_dir_create (char *path)
+{
+    scanned_dir_t *dir;
 
-	if (state->verbose) {
-	    if (state->output_is_a_tty)
-		printf("\r\033[K");
+    dir = talloc_zero (NULL, scanned_dir_t);
+    dir->path = talloc_steal (dir, path);
 
-	    printf ("%i/%i: %s",
-		    state->processed_files,
-		    state->total_files,
-		    next);
+    return dir;
+}
 
-	    putchar((state->output_is_a_tty) ? '\r' : '\n');
-	    fflush (stdout);
+/* Look up the directory 'dir' in the filesystem, (without reading its
+ * entries). Errors are recorded in 'dir' for check_directory to
+ * report. */
+static void
+stat_directory (scanned_dir_t *dir)
+{
+    struct stat st;
+
+    if (stat (dir->path, &st)) {
+	dir->stat_error = errno;
+	return;
+    }
+    dir->stat_time = time (NULL);
+
+    /* This is not an error since the directory may have been replaced
+     * by something else since its parent was read. */
+    if (! S_ISDIR (st.st_mode))
+	return;
+
+    dir->is_directory = TRUE;
+    dir->fs_mtime = st.st_mtime;
+}
+
+/* Read the entries of the directory 'dir', (already stat'ed by
+ * stat_directory), from the filesystem. Errors are recorded in 'dir'
+ * for update_directory to report. */
+static void
+read_directory (scanned_dir_t *dir)
+{
+    scanned_entry_t *entry;
+    struct dirent *fs_entry;
+    unsigned int size = 0;
+    struct stat st;
+    DIR *handle;
+    char *next;
+
+    dir->read = TRUE;
+
+    handle = opendir (dir->path);
+    if (handle == NULL) {
+	dir->open_error = errno;
+	return;
+    }
+
+    while ((fs_entry = readdir (handle)) != NULL) {
+	if (strcmp (fs_entry->d_name, ".") == 0 ||
+	    strcmp (fs_entry->d_name, "..") == 0)
+	{
+	    continue;
 	}
 
-	status = notmuch_database_begin_atomic (notmuch);
-	if (status) {
-	    ret = status;
-	    goto DONE;
+	if (dir->num_entries == size) {
+	    size = size ? size * 2 : 64;
+	    dir->entries = talloc_realloc (dir, dir->entries,
+					   scanned_entry_t, size);
 	}
 
-	status = notmuch_database_add_message (notmuch, next, &message);
-	switch (status) {
-	/* success */
-	case NOTMUCH_STATUS_SUCCESS:
-	    state->added_messages++;
-	    notmuch_message_freeze (message);
-	    for (tag=state->new_tags; *tag != NULL; tag++)
-	        notmuch_message_add_tag (message, *tag);
-	    if (state->synchronize_flags == TRUE)
-		notmuch_message_maildir_flags_to_tags (message);
-	    notmuch_message_thaw (message);
+	entry = &dir->entries[dir->num_entries++];
+	entry->name = talloc_strdup (dir, fs_entry->d_name);
+	entry->inode = fs_entry->d_ino;
+	entry->error = 0;
+
+	/* A symlink may be to a file or to a directory, (or to
+	 * nothing at all), and if the filesystem doesn't tell us the
+	 * file type, it might be anything. In either case, a stat
+	 * does the trick. */
+	switch (fs_entry->d_type) {
+	case DT_REG:
+	    entry->type = SCANNED_FILE;
 	    break;
-	/* Non-fatal issues (go on to next file) */
-	case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
-	    if (state->synchronize_flags == TRUE)
-		notmuch_message_maildir_flags_to_tags (message);
+	case DT_DIR:
+	    entry->type = SCANNED_DIRECTORY;
 	    break;
-	case NOTMUCH_STATUS_FILE_NOT_EMAIL:
-	    fprintf (stderr, "Note: Ignoring non-mail file: %s\n",
-		     next);
+	case DT_LNK:
+	case DT_UNKNOWN:
+	    next = talloc_asprintf (dir, "%s/%s", dir->path, fs_entry->d_name);
+	    if (stat (next, &st)) {
+		entry->type = SCANNED_ERROR;
+		entry->error = errno;
+	    } else if (S_ISREG (st.st_mode)) {
+		entry->type = SCANNED_FILE;
+	    } else if (S_ISDIR (st.st_mode)) {
+		entry->type = SCANNED_DIRECTORY;
+	    } else {
+		entry->type = SCANNED_OTHER;
+	    }
+	    talloc_free (next);
 	    break;
-	/* Fatal issues. Don't process anymore. */
-	case NOTMUCH_STATUS_READ_ONLY_DATABASE:
-	case NOTMUCH_STATUS_XAPIAN_EXCEPTION:
-	case NOTMUCH_STATUS_OUT_OF_MEMORY:
-	    fprintf (stderr, "Error: %s. Halting processing.\n",
-		     notmuch_status_to_string (status));
-	    ret = status;
-	    goto DONE;
 	default:
-	case NOTMUCH_STATUS_FILE_ERROR:
-	case NOTMUCH_STATUS_NULL_POINTER:
-	case NOTMUCH_STATUS_TAG_TOO_LONG:
-	case NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW:
-	case NOTMUCH_STATUS_UNBALANCED_ATOMIC:
-	case NOTMUCH_STATUS_LAST_STATUS:
-	    INTERNAL_ERROR ("add_message returned unexpected value: %d",  status);
-	    goto DONE;
-	}
-
-	status = notmuch_database_end_atomic (notmuch);
-	if (status) {
-	    ret = status;
-	    goto DONE;
+	    entry->type = SCANNED_OTHER;
+	    break;
 	}
+    }
 
-	if (message) {
-	    notmuch_message_destroy (message);
-	    message = NULL;
-	}
+    closedir (handle);
 
-	if (do_print_progress) {
-	    do_print_progress = 0;
-	    generic_print_progress ("Processed", "files", state->tv_start,
-				    state->processed_files, state->total_files);
-	}
+    /* Sort by name, to match the database sorting. */
+    qsort (dir->entries, dir->num_entries, sizeof (scanned_entry_t),
+	   scanned_entry_cmp_name);
 
-	talloc_free (next);
-	next = NULL;
-    }
+    dir->is_maildir = _entries_resemble_maildir (dir->entries,
+						 dir->num_entries);
+}
 
-    if (interrupted)
-	goto DONE;
+static void
+queue_directory (add_files_state_t *state, scanned_dir_t *dir)
+{
+    if (state->scan_pool)
+	g_thread_pool_push (state->scan_pool, dir, NULL);
+    else
+	g_queue_push_tail (state->unscanned_dirs, dir);
+}
 
-    /* Now that we've walked the whole filesystem list, anything left
-     * over in the database lists has been deleted. */
-    while (notmuch_filenames_valid (db_files))
-    {
-	char *absolute = talloc_asprintf (state->removed_files,
-					  "%s/%s", path,
-					  notmuch_filenames_get (db_files));
+/* Queue the subdirectory 'name' of 'dir' to be stat'ed in turn, (from
+ * the main thread). */
+static void
+queue_subdirectory (add_files_state_t *state,
+		    scanned_dir_t *dir,
+		    const char *name)
+{
+    queue_directory (state,
+		     _scanned_dir_create (talloc_asprintf (NULL, "%s/%s",
+							   dir->path, name)));
+    dir->num_subdirs++;
+}
 
-	_filename_list_add (state->removed_files, absolute);
+/* Queue each subdirectory of 'dir', (as read by scan_directory), to
+ * be stat'ed in turn. */
+static void
+queue_read_subdirectories (add_files_state_t *state, scanned_dir_t *dir)
+{
+    unsigned int i;
 
-	notmuch_filenames_move_to_next (db_files);
+    for (i = 0; i < dir->num_entries; i++) {
+	if (dir->entries[i].type == SCANNED_DIRECTORY &&
+	    _entry_is_walked (dir, &dir->entries[i]))
+	{
+	    queue_subdirectory (state, dir, dir->entries[i].name);
+	}
+    }
+}
+
+/* Stat the directory 'dir', or, if check_directory has asked for it,
+ * read its entries, (whose subdirectories the main thread then queues
+ * with queue_read_subdirectories).
+ *
+ * This only looks at the filesystem, (and only allocates beneath
+ * 'dir'), so it may run on any thread of execution. */
+static scanned_dir_t *
+scan_directory (add_files_state_t *state, scanned_dir_t *dir)
+{
+    /* Once we're stopping, just hand the directory back untouched. */
+    if (interrupted || state->scan_halted)
+	return dir;
+
+    if (! dir->read_wanted)
+	stat_directory (dir);
+    else
+	read_directory (dir);
+
+    return dir;
+}
+
+/* Runs in a worker thread: stat or read the directory 'data', (a
+ * scanned_dir_t), and hand it back to the main thread. */
+static void
+scan_directory_worker (gpointer data, gpointer user_data)
+{
+    add_files_state_t *state = (add_files_state_t *) user_data;
+
+    g_async_queue_push (state->scanned_dirs,
+			scan_directory (state, (scanned_dir_t *) data));
+}
+
+/* Return the next directory that has been stat'ed or read, (waiting
+ * for a worker thread to finish one if necessary). */
+static scanned_dir_t *
+next_scanned_directory (add_files_state_t *state)
+{
+    if (state->scan_pool)
+	return (scanned_dir_t *) g_async_queue_pop (state->scanned_dirs);
+
+    return scan_directory (state, (scanned_dir_t *)
+			   g_queue_pop_head (state->unscanned_dirs));
+}
+
+/* Start 'jobs' threads of execution to stat and read directories,
+ * (see queue_directory). If they can't be started, or 'jobs' is 1,
+ * the main thread does so itself just before comparing each directory
+ * with the database.
+ *
+ * This must follow start_indexing, which initializes GLib threads. */
+static void
+start_scanning (add_files_state_t *state, unsigned int jobs)
+{
+    state->scan_pool = NULL;
+    state->scanned_dirs = NULL;
+    state->unscanned_dirs = g_queue_new ();
+    state->scan_halted = FALSE;
+
+    if (jobs <= 1)
+	return;
+
+    state->scanned_dirs = g_async_queue_new ();
+    state->scan_pool = g_thread_pool_new (scan_directory_worker, state,
+					  jobs, TRUE, NULL);
+
+    if (state->scan_pool == NULL)
+	fprintf (stderr, "Warning: Failed to start directory reading threads, "
+		 "reading one directory at a time.\n");
+}
+
+/* Wait for the directory reading threads to finish, (after add_files
+ * has taken back every directory they read), and release them. */
+static void
+stop_scanning (add_files_state_t *state)
+{
+    if (state->scan_pool)
+	g_thread_pool_free (state->scan_pool, FALSE, TRUE);
+
+    if (state->scanned_dirs)
+	g_async_queue_unref (state->scanned_dirs);
+
+    g_queue_free (state->unscanned_dirs);
+}
+
+/* Ask for the database's time of the directory 'dir' to be updated
+ * to 'fs_mtime', along with the names of the subdirectories that were
+ * walked, (see check_directory), unless fs_mtime is the wall-clock
+ * time at which it was stat'ed.
+ *
+ * In that case a message could be delivered later in this same
+ * second, so we skip the update. This may lead to unnecessary
+ * re-scans, but it avoids overlooking messages. */
+static void
+_record_directory_mtime (add_files_state_t *state, scanned_dir_t *dir)
+{
+    _filename_node_t *node;
+    unsigned int i;
+
+    if (dir->fs_mtime == dir->stat_time)
+	return;
+
+    node = _filename_list_add (state->directory_mtimes, dir->path);
+    node->mtime = dir->fs_mtime;
+    node->subdirs = talloc_array (state->directory_mtimes, const char *,
+				  dir->num_entries);
+
+    for (i = 0; i < dir->num_entries; i++) {
+	if (_entry_is_walked (dir, &dir->entries[i]))
+	    node->subdirs[node->num_subdirs++] =
+		talloc_strdup (node->subdirs, dir->entries[i].name);
+    }
+}
+
+/* Decide whether the directory 'dir', as stat'ed from the filesystem
+ * by scan_directory, must be read.
+ *
+ * The entries of a directory can't change without changing its
+ * mtime, so if the mtime in the filesystem (fs_mtime) is the same as
+ * the one recorded in the database (db_mtime), the only thing left to
+ * do is to walk its subdirectories, (whose own entries may well have
+ * changed). The database records their names along with db_mtime, so
+ * we queue them to be stat'ed without reading the directory itself.
+ *
+ * Otherwise, (or if no names are recorded with db_mtime), set
+ * 'read_wanted' to have the directory read and handed to
+ * update_directory.
+ */
+static notmuch_status_t
+check_directory (notmuch_database_t *notmuch,
+		 scanned_dir_t *dir,
+		 add_files_state_t *state)
+{
+    notmuch_directory_t *directory;
+    notmuch_filenames_t *subdirs = NULL;
+
+    if (dir->stat_error) {
+	fprintf (stderr, "Error reading directory %s: %s\n",
+		 dir->path, strerror (dir->stat_error));
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+
+    if (! dir->is_directory)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    directory = notmuch_database_get_directory (notmuch, dir->path);
+    if (directory == NULL) {
+	dir->read_wanted = TRUE;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    /* We test for strict equality here, (as update_directory does),
+     * to avoid a bug that can happen if the system clock jumps
+     * backward. */
+    if (dir->fs_mtime == notmuch_directory_get_mtime (directory))
+	subdirs = notmuch_directory_get_subdirectories (directory);
+
+    if (subdirs == NULL) {
+	dir->read_wanted = TRUE;
+    } else {
+	for (; notmuch_filenames_valid (subdirs);
+	     notmuch_filenames_move_to_next (subdirs))
+	{
+	    queue_subdirectory (state, dir, notmuch_filenames_get (subdirs));
+	}
+	notmuch_filenames_destroy (subdirs);
+    }
+
+    notmuch_directory_destroy (directory);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Bring the database up to date with the directory 'dir', as read
+ * from the filesystem by scan_directory:
+ *
+ *   o Ask the database for its timestamp of the directory (db_mtime)
+ *
+ *   o Compare the mtime read from the filesystem (fs_mtime) to
+ *     db_mtime. If they are equivalent, terminate the algorithm at
+ *     this point, (this directory has not been updated in the
+ *     filesystem since the last database scan, and was only read
+ *     because the database didn't know its subdirectories).
+ *
+ *   o Ask the database for files and directories within the directory
+ *     (db_files and db_subdirs)
+ *
+ *   o Walk the entries of 'dir' simultaneously with db_files and
+ *     db_subdirs. Look for one of three interesting cases:
+ *
+ *	   1. Regular file in the entries and not in db_files
+ *            This is a new file to add_message into the database.
+ *
+ *         2. Filename in db_files not in the entries.
+ *            This is a file that has been removed from the mail store.
+ *
+ *         3. Directory in db_subdirs not in the entries.
+ *            This is a directory that has been removed from the mail store.
+ *
+ *     Note that the addition of a directory is not interesting here,
+ *     since the new directory will be read (and compared with the
+ *     database) in turn. Also, we don't immediately act on
+ *     file/directory removal since we must ensure that in the case of
+ *     a rename that the new filename is added before the old filename
+ *     is removed, (so that no information is lost from the database).
+ *
+ *   o Tell the database to update its time of the directory to
+ *     'fs_mtime', along with its subdirectories, (see
+ *     _record_directory_mtime).
+ *
+ * Subdirectories are compared with the database independently, (and
+ * in no particular order relative to their parent).
+ */
+static notmuch_status_t
+update_directory (notmuch_database_t *notmuch,
+		  scanned_dir_t *dir,
+		  add_files_state_t *state)
+{
+    const char *path = dir->path;
+    scanned_entry_t *entry;
+    char *next = NULL;
+    time_t db_mtime;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i;
+    notmuch_directory_t *directory;
+    notmuch_filenames_t *db_files = NULL;
+    notmuch_filenames_t *db_subdirs = NULL;
+    notmuch_bool_t new_directory;
+
+    /* Report the symlinks we could not follow just as we do
+     * directories we can't read. */
+    for (i = 0; i < dir->num_entries; i++) {
+	entry = &dir->entries[i];
+	if (entry->type == SCANNED_ERROR && _entry_is_walked (dir, entry)) {
+	    fprintf (stderr, "Error reading directory %s/%s: %s\n",
+		     path, entry->name, strerror (entry->error));
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+	}
+    }
+
+    directory = notmuch_database_get_directory (notmuch, path);
+    db_mtime = notmuch_directory_get_mtime (directory);
+
+    new_directory = db_mtime ? FALSE : TRUE;
+
+    /* XXX This is a temporary workaround.  If we don't update the
+     * database mtime until after processing messages in this
+     * directory, then a 0 mtime is *not* sufficient to indicate that
+     * this directory has no messages or subdirs in the database (for
+     * example, if an earlier run skipped the mtime update because
+     * fs_mtime == stat_time, or was interrupted before updating the
+     * mtime at the end).  To address this, we record a (bogus)
+     * non-zero value before processing any child messages so that a
+     * later run won't mistake this for a new directory (and, for
+     * example, fail to detect removed files and subdirs).
+     *
+     * A better solution would be for notmuch_database_get_directory
+     * to indicate if it really created a new directory or not, either
+     * by a new out-argument, or by recording this information and
+     * providing an accessor.
+     */
+    if (new_directory)
+	notmuch_directory_set_mtime (directory, -1);
+
+    if (dir->open_error) {
+	fprintf (stderr, "Error opening directory %s: %s\n",
+		 path, strerror (dir->open_error));
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    /* If the directory's modification time in the filesystem is the
+     * same as what we recorded in the database the last time we
+     * scanned it, then we can skip the rest entirely.
+     *
+     * We test for strict equality here to avoid a bug that can happen
+     * if the system clock jumps backward, (preventing new mail from
+     * being discovered until the clock catches up and the directory
+     * is modified again).
+     */
+    if (dir->fs_mtime == db_mtime) {
+	_record_directory_mtime (state, dir);
+	goto DONE;
+    }
+
+    /* new_directory means a directory that the database has never
+     * seen before. In that case, we can simply leave db_files and
+     * db_subdirs NULL, and there's no database sorting to match, so
+     * we add the files in inode order for faster filesystem
+     * operation. */
+    if (!new_directory) {
+	db_files = notmuch_directory_get_child_files (directory);
+	db_subdirs = notmuch_directory_get_child_directories (directory);
+    } else {
+	qsort (dir->entries, dir->num_entries, sizeof (scanned_entry_t),
+	       scanned_entry_cmp_inode);
+    }
+
+    /* Scan for new files, removed files, and removed directories. */
+    for (i = 0; i < dir->num_entries; i++)
+    {
+	if (interrupted)
+	    break;
+
+	entry = &dir->entries[i];
+
+	/* Check if we've walked past any names in db_files or
+	 * db_subdirs. If so, these have been deleted. */
+	while (notmuch_filenames_valid (db_files) &&
+	       strcmp (notmuch_filenames_get (db_files), entry->name) < 0)
+	{
+	    char *absolute = talloc_asprintf (state->removed_files,
+					      "%s/%s", path,
+					      notmuch_filenames_get (db_files));
+
+	    _filename_list_add (state->removed_files, absolute);
+
+	    notmuch_filenames_move_to_next (db_files);
+	}
+
+	while (notmuch_filenames_valid (db_subdirs) &&
+	       strcmp (notmuch_filenames_get (db_subdirs), entry->name) <= 0)
+	{
+	    const char *filename = notmuch_filenames_get (db_subdirs);
+
+	    if (strcmp (filename, entry->name) < 0)
+	    {
+		char *absolute = talloc_asprintf (state->removed_directories,
+						  "%s/%s", path, filename);
+
+		_filename_list_add (state->removed_directories, absolute);
+	    }
+
+	    notmuch_filenames_move_to_next (db_subdirs);
+	}
+
+	/* We only add regular files, (including symlinks to them). */
+	if (entry->type != SCANNED_FILE)
+	    continue;
+
+	/* Don't add a file that we've added before. */
+	if (notmuch_filenames_valid (db_files) &&
+	    strcmp (notmuch_filenames_get (db_files), entry->name) == 0)
+	{
+	    notmuch_filenames_move_to_next (db_files);
+	    continue;
+	}
+
+	/* We're now looking at a regular file that doesn't yet exist
+	 * in the database, so add it. */
+	next = talloc_asprintf (dir, "%s/%s", path, entry->name);
+
+	status = add_new_file (notmuch, next, state);
+	if (status) {
+	    ret = status;
+	    goto DONE;
+	}
+
+	talloc_free (next);
+	next = NULL;
+    }
+
+    if (interrupted)
+	goto DONE;
+
+    /* Now that we've walked the whole filesystem list, anything left
+     * over in the database lists has been deleted. */
+    while (notmuch_filenames_valid (db_files))
+    {
+	char *absolute = talloc_asprintf (state->removed_files,
+					  "%s/%s", path,
+					  notmuch_filenames_get (db_files));
+
+	_filename_list_add (state->removed_files, absolute);
+
+	notmuch_filenames_move_to_next (db_files);
     }
 
     while (notmuch_filenames_valid (db_subdirs))
@@ -544,23 +1122,11 @@ add_files_recursive (notmuch_database_t *notmuch,
 	notmuch_filenames_move_to_next (db_subdirs);
     }
 
-    /* If the directory's mtime is the same as the wall-clock time
-     * when we stat'ed the directory, we skip updating the mtime in
-     * the database because a message could be delivered later in this
-     * same second.  This may lead to unnecessary re-scans, but it
-     * avoids overlooking messages. */
-    if (fs_mtime != stat_time)
-	_filename_list_add (state->directory_mtimes, path)->mtime = fs_mtime;
+    _record_directory_mtime (state, dir);
 
   DONE:
     if (next)
 	talloc_free (next);
-    if (entry)
-	free (entry);
-    if (dir)
-	closedir (dir);
-    if (fs_entries)
-	free (fs_entries);
     if (db_subdirs)
 	notmuch_filenames_destroy (db_subdirs);
     if (db_files)
@@ -612,13 +1178,22 @@ stop_progress_printing_timer (void)
 
 
 /* This is the top-level entry point for add_files. It does a couple
- * of error checks and then calls into the recursive function. */
+ * of error checks and then walks the directories under 'path', (with
+ * 'jobs' threads of execution), comparing each with the database as
+ * it comes in.
+ *
+ * Each directory is first only stat'ed, and handed to
+ * check_directory. Only if that finds it may have changed is the
+ * directory read, and handed to update_directory. */
 static notmuch_status_t
 add_files (notmuch_database_t *notmuch,
 	   const char *path,
-	   add_files_state_t *state)
+	   add_files_state_t *state,
+	   unsigned int jobs)
 {
-    notmuch_status_t status;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    scanned_dir_t *dir;
+    unsigned int pending;
     struct stat st;
 
     if (stat (path, &st)) {
@@ -632,78 +1207,58 @@ add_files (notmuch_database_t *notmuch,
 	return NOTMUCH_STATUS_FILE_ERROR;
     }
 
-    status = add_files_recursive (notmuch, path, state);
+    start_scanning (state, jobs);
 
-    return status;
-}
+    queue_directory (state, _scanned_dir_create (talloc_strdup (NULL, path)));
 
-/* XXX: This should be merged with the add_files function since it
- * shares a lot of logic with it. */
-/* Recursively count all regular files in path and all sub-directories
- * of path.  The result is added to *count (which should be
- * initialized to zero by the top-level caller before calling
- * count_files). */
-static void
-count_files (const char *path, int *count)
-{
-    struct dirent *entry = NULL;
-    char *next;
-    struct stat st;
-    struct dirent **fs_entries = NULL;
-    int num_fs_entries = scandir (path, &fs_entries, 0, dirent_sort_inode);
-    int i = 0;
+    /* Each directory tells us how many more were queued, (when it was
+     * read, or by check_directory), so we know when the walk is
+     * complete. */
+    for (pending = 1; pending; pending--) {
+	dir = next_scanned_directory (state);
 
-    if (num_fs_entries == -1) {
-	fprintf (stderr, "Warning: failed to open directory %s: %s\n",
-		 path, strerror (errno));
-	goto DONE;
-    }
+	if (! interrupted && ! state->scan_halted) {
+	    if (dir->read) {
+		queue_read_subdirectories (state, dir);
+		status = update_directory (notmuch, dir, state);
+	    } else {
+		status = check_directory (notmuch, dir, state);
+	    }
+	    if (status && ret == NOTMUCH_STATUS_SUCCESS)
+		ret = status;
 
-    while (!interrupted) {
-        if (i == num_fs_entries)
-	    break;
+	    /* An unreadable directory doesn't stop the walk, but an
+	     * error from the database does. */
+	    if (status && status != NOTMUCH_STATUS_FILE_ERROR)
+		state->scan_halted = TRUE;
+	}
 
-        entry = fs_entries[i++];
+	pending += dir->num_subdirs;
 
-	/* Ignore special directories to avoid infinite recursion.
-	 * Also ignore the .notmuch directory.
-	 */
-	/* XXX: Eventually we'll want more sophistication to let the
-	 * user specify files to be ignored. */
-	if (strcmp (entry->d_name, ".") == 0 ||
-	    strcmp (entry->d_name, "..") == 0 ||
-	    strcmp (entry->d_name, ".notmuch") == 0)
+	/* Send the directory back to be read if check_directory has
+	 * asked for it. */
+	if (dir->read_wanted && ! dir->read &&
+	    ! interrupted && ! state->scan_halted)
 	{
-	    continue;
-	}
-
-	if (asprintf (&next, "%s/%s", path, entry->d_name) == -1) {
-	    next = NULL;
-	    fprintf (stderr, "Error descending from %s to %s: Out of memory\n",
-		     path, entry->d_name);
-	    continue;
+	    queue_directory (state, dir);
+	    pending++;
+	} else {
+	    talloc_free (dir);
 	}
+    }
 
-	stat (next, &st);
-
-	if (S_ISREG (st.st_mode)) {
-	    *count = *count + 1;
-	    if (*count % 1000 == 0) {
-		printf ("Found %d files so far.\r", *count);
-		fflush (stdout);
-	    }
-	} else if (S_ISDIR (st.st_mode)) {
-	    count_files (next, count);
-	}
+    stop_scanning (state);
 
-	free (next);
+    /* Wait for (and add) the files still being indexed, so that
+     * renamed files get their new names before the old ones are
+     * removed. */
+    if (state->index_pool) {
+	status = add_indexed_files (notmuch, state, 0);
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
     }
 
-  DONE:
-    if (entry)
-	free (entry);
-    if (fs_entries)
-        free (fs_entries);
+    return ret;
 }
 
 static void
@@ -744,6 +1299,11 @@ remove_filename (notmuch_database_t *notmuch,
     if (status)
 	return status;
     message = notmuch_database_find_message_by_filename (notmuch, path);
+    /* The file may never have been added, (for example if it was
+     * removed from the mail store while "notmuch watch" was waiting
+     * to add it). */
+    if (message == NULL)
+	return notmuch_database_end_atomic (notmuch);
     status = notmuch_database_remove_message (notmuch, path);
     if (status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) {
 	add_files_state->renamed_messages++;
@@ -793,27 +1353,127 @@ _remove_directory (void *ctx,
     notmuch_directory_destroy (directory);
 }
 
-int
-notmuch_new_command (void *ctx, int argc, char *argv[])
+/* Reset the counts of 'state', and create its lists of files and
+ * directories to be removed and directories whose mtimes are to be
+ * recorded. */
+static void
+start_results (void *ctx, add_files_state_t *state)
 {
-    notmuch_config_t *config;
-    notmuch_database_t *notmuch;
-    add_files_state_t add_files_state;
-    double elapsed;
-    struct timeval tv_now, tv_start;
-    int ret = 0;
-    struct stat st;
-    const char *db_path;
-    char *dot_notmuch_path;
-    struct sigaction action;
-    _filename_node_t *f;
-    int i;
-    notmuch_bool_t timer_is_active = FALSE;
-
-    add_files_state.verbose = 0;
-    add_files_state.output_is_a_tty = isatty (fileno (stdout));
+    state->processed_files = 0;
+    state->added_messages = 0;
+    state->removed_messages = state->renamed_messages = 0;
+    gettimeofday (&state->tv_start, NULL);
+
+    state->removed_files = _filename_list_create (ctx);
+    state->removed_directories = _filename_list_create (ctx);
+    state->directory_mtimes = _filename_list_create (ctx);
+}
 
-    for (i = 0; i < argc && argv[i][0] == '-'; i++) {
+static void
+stop_results (add_files_state_t *state)
+{
+    talloc_free (state->removed_files);
+    talloc_free (state->removed_directories);
+    talloc_free (state->directory_mtimes);
+}
+
+/* Once add_files has added the new files, remove the files and
+ * directories it found missing from the mail store, and record the
+ * mtimes of the directories it brought up to date. */
+static void
+remove_and_record (void *ctx,
+		   notmuch_database_t *notmuch,
+		   add_files_state_t *state)
+{
+    struct timeval tv_start;
+    _filename_node_t *f;
+    unsigned int i;
+
+    gettimeofday (&tv_start, NULL);
+    for (f = state->removed_files->head; f && !interrupted; f = f->next) {
+	remove_filename (notmuch, f->filename, state);
+	if (do_print_progress) {
+	    do_print_progress = 0;
+	    generic_print_progress ("Cleaned up", "messages",
+		tv_start, state->removed_messages + state->renamed_messages,
+		state->removed_files->count);
+	}
+    }
+
+    gettimeofday (&tv_start, NULL);
+    for (f = state->removed_directories->head, i = 0; f && !interrupted; f = f->next, i++) {
+	_remove_directory (ctx, notmuch, f->filename, state);
+	if (do_print_progress) {
+	    do_print_progress = 0;
+	    generic_print_progress ("Cleaned up", "directories",
+		tv_start, i,
+		state->removed_directories->count);
+	}
+    }
+
+    for (f = state->directory_mtimes->head; f && !interrupted; f = f->next) {
+	notmuch_directory_t *directory;
+	directory = notmuch_database_get_directory (notmuch, f->filename);
+	if (directory) {
+	    /* The names go first, so that they are never stored with
+	     * an mtime they don't belong to. */
+	    notmuch_directory_set_subdirectories (directory, f->mtime,
+						  f->subdirs,
+						  f->num_subdirs);
+	    notmuch_directory_set_mtime (directory, f->mtime);
+	    notmuch_directory_destroy (directory);
+	}
+    }
+}
+
+static void
+print_results (add_files_state_t *state)
+{
+    if (state->added_messages) {
+	printf ("Added %d new %s to the database.",
+		state->added_messages,
+		state->added_messages == 1 ?
+		"message" : "messages");
+    } else {
+	printf ("No new mail.");
+    }
+
+    if (state->removed_messages) {
+	printf (" Removed %d %s.",
+		state->removed_messages,
+		state->removed_messages == 1 ? "message" : "messages");
+    }
+
+    if (state->renamed_messages) {
+	printf (" Detected %d file %s.",
+		state->renamed_messages,
+		state->renamed_messages == 1 ? "rename" : "renames");
+    }
+
+    printf ("\n");
+}
+
+int
+notmuch_new_command (void *ctx, int argc, char *argv[])
+{
+    notmuch_config_t *config;
+    notmuch_database_t *notmuch;
+    add_files_state_t add_files_state;
+    double elapsed;
+    struct timeval tv_now;
+    int ret = 0;
+    notmuch_status_t status;
+    struct stat st;
+    const char *db_path;
+    char *dot_notmuch_path;
+    struct sigaction action;
+    int i;
+    notmuch_bool_t timer_is_active = FALSE;
+
+    add_files_state.verbose = 0;
+    add_files_state.output_is_a_tty = isatty (fileno (stdout));
+
+    for (i = 0; i < argc && argv[i][0] == '-'; i++) {
 	if (STRNCMP_LITERAL (argv[i], "--verbose") == 0) {
 	    add_files_state.verbose = 1;
 	} else {
@@ -832,16 +1492,7 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     dot_notmuch_path = talloc_asprintf (ctx, "%s/%s", db_path, ".notmuch");
 
     if (stat (dot_notmuch_path, &st)) {
-	int count;
-
-	count = 0;
-	count_files (db_path, &count);
-	if (interrupted)
-	    return 1;
-
-	printf ("Found %d total files (that's not much mail).\n", count);
 	notmuch = notmuch_database_create (db_path);
-	add_files_state.total_files = count;
     } else {
 	notmuch = notmuch_database_open (db_path,
 					 NOTMUCH_DATABASE_MODE_READ_WRITE);
@@ -856,8 +1507,6 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
 	    printf ("Your notmuch database has now been upgraded to database format version %u.\n",
 		    notmuch_database_get_version (notmuch));
 	}
-
-	add_files_state.total_files = 0;
     }
 
     if (notmuch == NULL)
@@ -875,14 +1524,7 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     talloc_free (dot_notmuch_path);
     dot_notmuch_path = NULL;
 
-    add_files_state.processed_files = 0;
-    add_files_state.added_messages = 0;
-    add_files_state.removed_messages = add_files_state.renamed_messages = 0;
-    gettimeofday (&add_files_state.tv_start, NULL);
-
-    add_files_state.removed_files = _filename_list_create (ctx);
-    add_files_state.removed_directories = _filename_list_create (ctx);
-    add_files_state.directory_mtimes = _filename_list_create (ctx);
+    start_results (ctx, &add_files_state);
 
     if (! debugger_is_active () && add_files_state.output_is_a_tty
 	&& ! add_files_state.verbose) {
@@ -890,42 +1532,29 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
 	timer_is_active = TRUE;
     }
 
-    ret = add_files (notmuch, db_path, &add_files_state);
-
-    gettimeofday (&tv_start, NULL);
-    for (f = add_files_state.removed_files->head; f && !interrupted; f = f->next) {
-	remove_filename (notmuch, f->filename, &add_files_state);
-	if (do_print_progress) {
-	    do_print_progress = 0;
-	    generic_print_progress ("Cleaned up", "messages",
-		tv_start, add_files_state.removed_messages + add_files_state.renamed_messages,
-		add_files_state.removed_files->count);
-	}
+    /* Commit the changes in batches rather than after every single
+     * message. Each message is still added atomically. */
+    ret = notmuch_config_begin_batch (config, notmuch);
+    if (ret) {
+	notmuch_database_close (notmuch);
+	return 1;
     }
 
-    gettimeofday (&tv_start, NULL);
-    for (f = add_files_state.removed_directories->head, i = 0; f && !interrupted; f = f->next, i++) {
-	_remove_directory (ctx, notmuch, f->filename, &add_files_state);
-	if (do_print_progress) {
-	    do_print_progress = 0;
-	    generic_print_progress ("Cleaned up", "directories",
-		tv_start, i,
-		add_files_state.removed_directories->count);
-	}
-    }
+    notmuch_database_set_index_limits (notmuch,
+	(size_t) notmuch_config_get_new_index_part_kilobytes (config) * 1024,
+	(size_t) notmuch_config_get_new_index_message_kilobytes (config) * 1024);
 
-    for (f = add_files_state.directory_mtimes->head; f && !interrupted; f = f->next) {
-	notmuch_directory_t *directory;
-	directory = notmuch_database_get_directory (notmuch, f->filename);
-	if (directory) {
-	    notmuch_directory_set_mtime (directory, f->mtime);
-	    notmuch_directory_destroy (directory);
-	}
-    }
+    start_indexing (notmuch, &add_files_state,
+		    notmuch_config_get_new_jobs (config));
+
+    ret = add_files (notmuch, db_path, &add_files_state,
+		     notmuch_config_get_new_jobs (config));
+
+    stop_indexing (&add_files_state);
 
-    talloc_free (add_files_state.removed_files);
-    talloc_free (add_files_state.removed_directories);
-    talloc_free (add_files_state.directory_mtimes);
+    remove_and_record (ctx, notmuch, &add_files_state);
+
+    stop_results (&add_files_state);
 
     if (timer_is_active)
 	stop_progress_printing_timer ();
@@ -947,35 +1576,611 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
 	}
     }
 
-    if (add_files_state.added_messages) {
-	printf ("Added %d new %s to the database.",
-		add_files_state.added_messages,
-		add_files_state.added_messages == 1 ?
-		"message" : "messages");
+    print_results (&add_files_state);
+
+    status = notmuch_database_end_batch (notmuch);
+    if (ret == NOTMUCH_STATUS_SUCCESS)
+	ret = status;
+
+    if (ret) {
+	printf ("\nNote: At least one error was encountered: %s\n",
+		notmuch_status_to_string (ret));
+    }
+
+    notmuch_database_close (notmuch);
+
+    return ret || interrupted;
+}
+
+#if HAVE_INOTIFY
+
+/* How long a burst of changes to the mail store may go quiet, (in
+ * milliseconds), before "notmuch watch" applies it, and how long it
+ * may last at most. */
+#define WATCH_QUIET_MS 100
+#define WATCH_BURST_MS 500
+
+/* How long "notmuch watch" waits before trying again to open the
+ * database while another command is writing to it. */
+#define WATCH_RETRY_MS 1000
+
+/* The inotify events that "notmuch watch" asks for. */
+#define WATCH_EVENTS (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | \
+		      IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* What has happened to a path, (as far as the latest event says). */
+typedef enum {
+    WATCH_ADD_FILE = 1,
+    WATCH_WRITE_FILE,
+    WATCH_REMOVE_FILE,
+    WATCH_ADD_DIRECTORY,
+    WATCH_REMOVE_DIRECTORY
+} watch_change_t;
+
+typedef struct {
+    int fd;
+
+    /* The path of each watched directory, by watch descriptor. */
+    GHashTable *paths;
+
+    /* The changes waiting to be applied, by path. */
+    GHashTable *changes;
+
+    /* Whether events were lost, so that the whole mail store must be
+     * scanned again. */
+    notmuch_bool_t rescan;
+
+    /* A directory that couldn't be watched for lack of inotify
+     * watches, (whose changes would go unnoticed), if any. */
+    char *unwatched;
+} watch_state_t;
+
+/* Watch the directory 'path' and each of the subdirectories the walk
+ * of add_files descends into.
+ *
+ * Running out of inotify watches is recorded in watch->unwatched,
+ * (and stops "notmuch watch" rather than leaving the rest of the mail
+ * store unwatched). */
+static void
+watch_tree (watch_state_t *watch, const char *path)
+{
+    scanned_dir_t *dir;
+    unsigned int i;
+    int wd;
+
+    if (watch->unwatched)
+	return;
+
+    wd = inotify_add_watch (watch->fd, path, WATCH_EVENTS);
+    if (wd < 0) {
+	/* A directory that has gone (or isn't a directory) by now
+	 * will show up in the events instead. */
+	if (errno == ENOSPC)
+	    watch->unwatched = g_strdup (path);
+	else if (errno != ENOENT && errno != ENOTDIR)
+	    fprintf (stderr, "Error watching directory %s: %s\n",
+		     path, strerror (errno));
+	return;
+    }
+
+    g_hash_table_insert (watch->paths, GINT_TO_POINTER (wd), g_strdup (path));
+
+    dir = _scanned_dir_create (talloc_strdup (NULL, path));
+    read_directory (dir);
+
+    for (i = 0; i < dir->num_entries; i++) {
+	if (dir->entries[i].type == SCANNED_DIRECTORY &&
+	    _entry_is_walked (dir, &dir->entries[i]))
+	{
+	    char *next = talloc_asprintf (dir, "%s/%s", path,
+					  dir->entries[i].name);
+	    watch_tree (watch, next);
+	    talloc_free (next);
+	}
+    }
+
+    talloc_free (dir);
+}
+
+static gboolean
+_watch_is_within (unused (gpointer key), gpointer value, gpointer user_data)
+{
+    const char *path = value, *ancestor = user_data;
+    size_t len = strlen (ancestor);
+
+    return strncmp (path, ancestor, len) == 0 &&
+	(path[len] == '\0' || path[len] == '/');
+}
+
+/* Stop watching the directory 'path' and everything within it, (which
+ * may have been moved elsewhere, where it would still be watched). */
+static void
+unwatch_tree (watch_state_t *watch, const char *path)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, watch->paths);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+	if (_watch_is_within (key, value, (gpointer) path)) {
+	    inotify_rm_watch (watch->fd, GPOINTER_TO_INT (key));
+	    g_hash_table_iter_remove (&iter);
+	}
+    }
+}
+
+/* Is the entry 'name' of the directory 'parent' one that the walk of
+ * add_files descends into? */
+static notmuch_bool_t
+_watch_is_walked (const char *parent, const char *name)
+{
+    scanned_dir_t *dir;
+    notmuch_bool_t walked = FALSE;
+    unsigned int i;
+
+    dir = _scanned_dir_create (talloc_strdup (NULL, parent));
+    read_directory (dir);
+
+    for (i = 0; i < dir->num_entries; i++) {
+	if (strcmp (dir->entries[i].name, name) == 0) {
+	    walked = _entry_is_walked (dir, &dir->entries[i]);
+	    break;
+	}
+    }
+
+    talloc_free (dir);
+
+    return walked;
+}
+
+/* Record the change to the mail store described by 'event'.
+ *
+ * Only the latest change to each path counts, so that, say, a file
+ * that is added and then removed again is never added at all. */
+static void
+watch_handle_event (watch_state_t *watch, struct inotify_event *event)
+{
+    const char *parent;
+    watch_change_t change;
+    struct stat st;
+    char *path;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+	watch->rescan = TRUE;
+	return;
+    }
+
+    if (event->mask & IN_IGNORED) {
+	g_hash_table_remove (watch->paths, GINT_TO_POINTER (event->wd));
+	return;
+    }
+
+    parent = g_hash_table_lookup (watch->paths, GINT_TO_POINTER (event->wd));
+    if (parent == NULL || event->len == 0)
+	return;
+
+    path = g_strdup_printf ("%s/%s", parent, event->name);
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	if (event->mask & IN_ISDIR) {
+	    unwatch_tree (watch, path);
+	    change = WATCH_REMOVE_DIRECTORY;
+	} else {
+	    change = WATCH_REMOVE_FILE;
+	}
+    } else if (event->mask & IN_MODIFY) {
+	change = WATCH_WRITE_FILE;
+    } else if (event->mask & IN_CLOSE_WRITE) {
+	change = WATCH_ADD_FILE;
+    } else if (stat (path, &st) == 0 && S_ISDIR (st.st_mode)) {
+	/* A new directory, (or symlink to one). Watch it straight
+	 * away, so that nothing created within it is missed. */
+	if (! _watch_is_walked (parent, event->name)) {
+	    g_free (path);
+	    return;
+	}
+	watch_tree (watch, path);
+	change = WATCH_ADD_DIRECTORY;
+    } else if (event->mask & IN_MOVED_TO) {
+	/* A file renamed into place, (as is done in maildirs), is
+	 * complete already. */
+	change = WATCH_ADD_FILE;
+    } else if (lstat (path, &st) == 0 &&
+	       (S_ISLNK (st.st_mode) || st.st_nlink > 1))
+    {
+	/* So is a new symlink or hard link to an existing file. */
+	change = WATCH_ADD_FILE;
     } else {
-	printf ("No new mail.");
+	/* A file created by open() may not have been written yet, (and
+	 * the burst may end before its first IN_MODIFY), so it's only
+	 * added once IN_CLOSE_WRITE says it's complete. */
+	change = WATCH_WRITE_FILE;
     }
 
-    if (add_files_state.removed_messages) {
-	printf (" Removed %d %s.",
-		add_files_state.removed_messages,
-		add_files_state.removed_messages == 1 ? "message" : "messages");
+    g_hash_table_insert (watch->changes, path, GINT_TO_POINTER (change));
+}
+
+/* Read the pending events from 'watch', waiting for them for up to
+ * 'timeout' milliseconds, (or indefinitely if it's -1).
+ *
+ * Returns FALSE if no events came, (or on an error). */
+static notmuch_bool_t
+watch_read_events (watch_state_t *watch, int timeout)
+{
+    char buf[4096]
+	__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    struct inotify_event *event;
+    struct pollfd pfd;
+    ssize_t len;
+    char *p;
+
+    pfd.fd = watch->fd;
+    pfd.events = POLLIN;
+
+    if (poll (&pfd, 1, timeout) <= 0)
+	return FALSE;
+
+    len = read (watch->fd, buf, sizeof (buf));
+    if (len <= 0)
+	return FALSE;
+
+    for (p = buf; p < buf + len; p += sizeof (*event) + event->len) {
+	event = (struct inotify_event *) p;
+	watch_handle_event (watch, event);
     }
 
-    if (add_files_state.renamed_messages) {
-	printf (" Detected %d file %s.",
-		add_files_state.renamed_messages,
-		add_files_state.renamed_messages == 1 ? "rename" : "renames");
+    return TRUE;
+}
+
+/* Is 'path' within another new directory that add_files is to
+ * walk? */
+static notmuch_bool_t
+_watch_is_in_new_directory (watch_state_t *watch, const char *path)
+{
+    char *ancestor, *slash;
+    notmuch_bool_t found = FALSE;
+
+    ancestor = g_strdup (path);
+
+    while (! found && (slash = strrchr (ancestor, '/')) != NULL) {
+	*slash = '\0';
+	found = GPOINTER_TO_INT (g_hash_table_lookup (watch->changes,
+						      ancestor))
+	    == WATCH_ADD_DIRECTORY;
     }
 
-    printf ("\n");
+    g_free (ancestor);
+
+    return found;
+}
 
+static gboolean
+_watch_is_applied (unused (gpointer key), gpointer value,
+		   unused (gpointer user_data))
+{
+    return GPOINTER_TO_INT (value) != WATCH_WRITE_FILE;
+}
+
+/* Bring the database up to date with the changes recorded by
+ * watch_handle_event, in the same order as "notmuch new" does: new
+ * files and directories first, (so that renamed files keep their
+ * tags), and then removals. Files still being written are left for
+ * later.
+ *
+ * If events were lost, scan the whole mail store at 'db_path'
+ * instead. */
+static notmuch_status_t
+watch_apply_changes (void *ctx,
+		     notmuch_database_t *notmuch,
+		     watch_state_t *watch,
+		     add_files_state_t *state,
+		     const char *db_path,
+		     unsigned int jobs)
+{
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct stat st;
+
+    if (watch->rescan) {
+	watch->rescan = FALSE;
+	g_hash_table_remove_all (watch->changes);
+	watch_tree (watch, db_path);
+	ret = add_files (notmuch, db_path, state, jobs);
+	goto DONE;
+    }
+
+    g_hash_table_iter_init (&iter, watch->changes);
+    while (g_hash_table_iter_next (&iter, &key, &value) && ! interrupted) {
+	if (GPOINTER_TO_INT (value) != WATCH_ADD_DIRECTORY ||
+	    _watch_is_in_new_directory (watch, key))
+	{
+	    continue;
+	}
+	status = add_files (notmuch, key, state, jobs);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+	if (status && status != NOTMUCH_STATUS_FILE_ERROR)
+	    goto DONE;
+    }
+
+    g_hash_table_iter_init (&iter, watch->changes);
+    while (g_hash_table_iter_next (&iter, &key, &value) && ! interrupted) {
+	if (GPOINTER_TO_INT (value) != WATCH_ADD_FILE ||
+	    _watch_is_in_new_directory (watch, key))
+	{
+	    continue;
+	}
+	/* The file may have gone again already. */
+	if (stat (key, &st) || ! S_ISREG (st.st_mode))
+	    continue;
+	status = add_new_file (notmuch, key, state);
+	if (status) {
+	    ret = status;
+	    break;
+	}
+    }
+
+    /* Wait for (and add) the files still being indexed, so that
+     * renamed files get their new names before the old ones are
+     * removed. */
+    if (state->index_pool) {
+	status = add_indexed_files (notmuch, state, 0);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+    }
+
+    if (ret && ret != NOTMUCH_STATUS_FILE_ERROR)
+	goto DONE;
+
+    g_hash_table_iter_init (&iter, watch->changes);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+	if (GPOINTER_TO_INT (value) == WATCH_REMOVE_FILE)
+	    _filename_list_add (state->removed_files, key);
+	else if (GPOINTER_TO_INT (value) == WATCH_REMOVE_DIRECTORY)
+	    _filename_list_add (state->removed_directories, key);
+    }
+
+  DONE:
+    g_hash_table_foreach_remove (watch->changes, _watch_is_applied, NULL);
+
+    if (ret == NOTMUCH_STATUS_SUCCESS || ret == NOTMUCH_STATUS_FILE_ERROR)
+	remove_and_record (ctx, notmuch, state);
+
+    return ret;
+}
+
+/* Open the database at 'db_path' for writing and apply the changes
+ * gathered by 'watch' to it, (see watch_apply_changes), committing
+ * them before closing it again.
+ *
+ * The database is only held open, (and so locked against other
+ * writers), for as long as this takes. If it can't be opened, (such
+ * as while "notmuch new" or "notmuch tag" is writing to it), nothing
+ * is applied and '*busy' is set so that the caller tries again
+ * later. */
+static notmuch_status_t
+watch_apply_burst (void *ctx,
+		   notmuch_config_t *config,
+		   watch_state_t *watch,
+		   add_files_state_t *state,
+		   const char *db_path,
+		   unsigned int jobs,
+		   notmuch_bool_t *busy)
+{
+    notmuch_database_t *notmuch;
+    notmuch_status_t status, ret;
+
+    notmuch = notmuch_database_open (db_path,
+				     NOTMUCH_DATABASE_MODE_READ_WRITE);
+    if (notmuch == NULL) {
+	*busy = TRUE;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+    *busy = FALSE;
+
+    notmuch_database_set_index_limits (notmuch,
+	(size_t) notmuch_config_get_new_index_part_kilobytes (config) * 1024,
+	(size_t) notmuch_config_get_new_index_message_kilobytes (config) * 1024);
+
+    ret = notmuch_config_begin_batch (config, notmuch);
     if (ret) {
-	printf ("\nNote: At least one error was encountered: %s\n",
-		notmuch_status_to_string (ret));
+	notmuch_database_close (notmuch);
+	return ret;
     }
 
+    start_indexing (notmuch, state, jobs);
+
+    ret = watch_apply_changes (ctx, notmuch, watch, state, db_path, jobs);
+
+    stop_indexing (state);
+
+    /* Commit, so that the changes show up in searches straight
+     * away. */
+    status = notmuch_database_end_batch (notmuch);
+    if (ret == NOTMUCH_STATUS_SUCCESS || ret == NOTMUCH_STATUS_FILE_ERROR)
+	ret = status ? status : ret;
+
     notmuch_database_close (notmuch);
 
-    return ret || interrupted;
+    return ret;
+}
+
+/* Gather up the changes to the mail store for 'timeout' milliseconds,
+ * (or, with a 'timeout' of -1, from the next change until they go
+ * quiet, but for no more than WATCH_BURST_MS).
+ *
+ * Returns FALSE if no change came, (or on an error). */
+static notmuch_bool_t
+watch_gather_burst (watch_state_t *watch, int timeout)
+{
+    struct timeval tv_start, tv_now;
+    notmuch_bool_t any = FALSE;
+
+    gettimeofday (&tv_start, NULL);
+
+    if (timeout < 0) {
+	if (! watch_read_events (watch, -1))
+	    return FALSE;
+	timeout = WATCH_BURST_MS;
+	any = TRUE;
+    }
+
+    do {
+	gettimeofday (&tv_now, NULL);
+	if (notmuch_time_elapsed (tv_start, tv_now) * 1000 > timeout)
+	    break;
+    } while (! interrupted &&
+	     (watch_read_events (watch, WATCH_QUIET_MS) || ! any));
+
+    return any;
 }
+
+int
+notmuch_watch_command (void *ctx, int argc, char *argv[])
+{
+    notmuch_config_t *config;
+    notmuch_database_t *notmuch;
+    add_files_state_t add_files_state;
+    watch_state_t watch;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    const char *db_path;
+    struct sigaction action;
+    unsigned int jobs;
+    notmuch_bool_t first = TRUE, busy = FALSE;
+    int i;
+
+    add_files_state.verbose = 0;
+    add_files_state.output_is_a_tty = isatty (fileno (stdout));
+
+    for (i = 0; i < argc && argv[i][0] == '-'; i++) {
+	if (STRNCMP_LITERAL (argv[i], "--verbose") == 0) {
+	    add_files_state.verbose = 1;
+	} else {
+	    fprintf (stderr, "Unrecognized option: %s\n", argv[i]);
+	    return 1;
+	}
+    }
+
+    config = notmuch_config_open (ctx, NULL, NULL);
+    if (config == NULL)
+	return 1;
+
+    add_files_state.new_tags = notmuch_config_get_new_tags (config, &add_files_state.new_tags_length);
+    add_files_state.synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+    db_path = notmuch_config_get_database_path (config);
+    jobs = notmuch_config_get_new_jobs (config);
+
+    /* The database is only opened for writing while a burst of
+     * changes is applied, (see watch_apply_burst), so that other
+     * commands can write to it in between. */
+    notmuch = notmuch_database_open (db_path,
+				     NOTMUCH_DATABASE_MODE_READ_ONLY);
+    if (notmuch == NULL)
+	return 1;
+
+    if (notmuch_database_needs_upgrade (notmuch)) {
+	fprintf (stderr, "Error: The database needs to be upgraded first. "
+		 "Run \"notmuch new\" to do so.\n");
+	notmuch_database_close (notmuch);
+	return 1;
+    }
+
+    notmuch_database_close (notmuch);
+
+    watch.fd = inotify_init ();
+    if (watch.fd < 0) {
+	fprintf (stderr, "Error: Failed to watch the mail store: %s\n",
+		 strerror (errno));
+	return 1;
+    }
+    watch.paths = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+    watch.changes = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, NULL);
+    watch.unwatched = NULL;
+
+    memset (&action, 0, sizeof (struct sigaction));
+    action.sa_handler = handle_sigint;
+    sigemptyset (&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+
+    /* Start with a scan of the whole mail store, (after starting to
+     * watch it), to catch up with whatever changed while we weren't
+     * watching. */
+    watch.rescan = TRUE;
+
+    while (! interrupted) {
+	if (busy) {
+	    /* Another command is writing to the database. Keep
+	     * gathering changes for a while before trying again. */
+	    watch_gather_burst (&watch, WATCH_RETRY_MS);
+	} else if (! watch.rescan) {
+	    /* Wait for a burst of changes, and gather it up until it
+	     * goes quiet. */
+	    if (! watch_gather_burst (&watch, -1))
+		continue;
+	}
+
+	if (interrupted)
+	    break;
+
+	start_results (ctx, &add_files_state);
+
+	status = watch_apply_burst (ctx, config, &watch, &add_files_state,
+				    db_path, jobs, &busy);
+
+	if (! busy &&
+	    (first || add_files_state.added_messages ||
+	     add_files_state.removed_messages ||
+	     add_files_state.renamed_messages))
+	{
+	    print_results (&add_files_state);
+	    fflush (stdout);
+	    first = FALSE;
+	}
+
+	stop_results (&add_files_state);
+
+	if (status && status != NOTMUCH_STATUS_FILE_ERROR) {
+	    fprintf (stderr, "Error: %s. Stopping.\n",
+		     notmuch_status_to_string (status));
+	    break;
+	}
+	status = NOTMUCH_STATUS_SUCCESS;
+
+	/* The changes gathered so far are applied, but nothing more
+	 * can be trusted to be noticed. */
+	if (watch.unwatched && ! busy) {
+	    fprintf (stderr, "Error: Cannot watch directory %s: %s.\n"
+		     "(Raise the limit in /proc/sys/fs/inotify/max_user_watches,\n"
+		     "or run \"notmuch new\" periodically instead.) Stopping.\n",
+		     watch.unwatched, strerror (ENOSPC));
+	    status = NOTMUCH_STATUS_FILE_ERROR;
+	    break;
+	}
+    }
+
+    g_hash_table_destroy (watch.changes);
+    g_hash_table_destroy (watch.paths);
+    g_free (watch.unwatched);
+    close (watch.fd);
+
+    return status ? 1 : 0;
+}
+
+#else
+
+int
+notmuch_watch_command (unused (void *ctx),
+		       unused (int argc),
+		       unused (char *argv[]))
+{
+    fprintf (stderr, "Error: notmuch watch is not supported on this platform "
+	     "(it requires inotify).\n");
+
+    return 1;
+}
+
+#endif
@@ -20,18 +20,253 @@
 
 #include "notmuch-client.h"
 
+/* How many lines in a row must be in order of message ID before a
+ * restore walks all messages rather than looking each one up. */
+#define RESTORE_WALK_AFTER_LINES 1000
+
+/* A walk of the message IDs and tags of all messages in order of
+ * message ID, (the order in which "notmuch dump" writes them), which
+ * the lines of a dump are matched against. */
+typedef struct _restore_cursor {
+    notmuch_database_t *notmuch;
+
+    /* Whether to walk the messages at all, (which only pays off when
+     * the dump has a line for most of them), and the walk, once
+     * started. */
+    notmuch_bool_t walk;
+    notmuch_tag_dump_t *dump;
+
+    /* Until then, the message ID of the last line, and how many lines
+     * in a row were in order, (as in a full dump rather than a few
+     * hand-written lines). */
+    char *last_id;
+    unsigned int in_order;
+} restore_cursor_t;
+
+/* The input of a restore, which may be compressed, (as written by
+ * "notmuch dump --gzip"). */
+typedef struct _restore_input {
+    FILE *file;
+
+    /* For compressed input, the filter decompressing it, the
+     * decompressed input not yet read, (from 'pending_pos' on), and
+     * whether all of the input has been decompressed. */
+    GMimeFilter *gunzip_filter;
+    GByteArray *pending;
+    size_t pending_pos;
+    notmuch_bool_t complete;
+} restore_input_t;
+
+static void
+restore_input_init (restore_input_t *input, FILE *file)
+{
+    int c;
+
+    input->file = file;
+    input->gunzip_filter = NULL;
+    input->pending = NULL;
+    input->pending_pos = 0;
+    input->complete = FALSE;
+
+    /* No line of a plain dump can start with the first byte of the
+     * gzip magic number. */
+    c = getc (file);
+    if (c == 0x1f) {
+	input->gunzip_filter =
+	    g_mime_filter_gzip_new (GMIME_FILTER_GZIP_MODE_UNZIP, 0);
+	input->pending = g_byte_array_new ();
+    }
+    if (c != EOF)
+	ungetc (c, file);
+}
+
+static void
+restore_input_fini (restore_input_t *input)
+{
+    if (input->gunzip_filter)
+	g_object_unref (input->gunzip_filter);
+    if (input->pending)
+	g_byte_array_free (input->pending, TRUE);
+}
+
+/* Read the next line of 'input', without its newline, into '*line',
+ * (a buffer of '*line_size' bytes as for getline).
+ *
+ * Returns FALSE at the end of the input. */
+static notmuch_bool_t
+restore_input_read_line (restore_input_t *input,
+			 char **line, size_t *line_size)
+{
+    char buf[4096], *outbuf, *start, *newline;
+    size_t len, outlen, outprespace;
+
+    if (input->gunzip_filter == NULL) {
+	if (getline (line, line_size, input->file) == -1)
+	    return FALSE;
+	chomp_newline (*line);
+	return TRUE;
+    }
+
+    for (;;) {
+	start = (char *) input->pending->data + input->pending_pos;
+	len = input->pending->len - input->pending_pos;
+
+	newline = (char *) memchr (start, '\n', len);
+	if (newline || (input->complete && len)) {
+	    if (newline)
+		len = newline - start;
+
+	    if (*line == NULL || *line_size < len + 1) {
+		*line_size = len + 1;
+		*line = xrealloc (*line, *line_size);
+	    }
+	    memcpy (*line, start, len);
+	    (*line)[len] = '\0';
+
+	    input->pending_pos += newline ? len + 1 : len;
+	    return TRUE;
+	}
+
+	if (input->complete)
+	    return FALSE;
+
+	/* Drop the lines already read before decompressing more. */
+	g_byte_array_remove_range (input->pending, 0, input->pending_pos);
+	input->pending_pos = 0;
+
+	len = fread (buf, 1, sizeof (buf), input->file);
+	if (len) {
+	    g_mime_filter_filter (input->gunzip_filter, buf, len, 0,
+				  &outbuf, &outlen, &outprespace);
+	} else {
+	    g_mime_filter_complete (input->gunzip_filter, buf, 0, 0,
+				    &outbuf, &outlen, &outprespace);
+	    input->complete = TRUE;
+	}
+
+	g_byte_array_append (input->pending, (guint8 *) outbuf, outlen);
+    }
+}
+
+/* Parse a line of a dump, "<message-id> (<tag> <tag> ...)", in place.
+ *
+ * Returns FALSE if the line isn't of that form. */
+static notmuch_bool_t
+parse_dump_line (char *line, char **message_id, char **file_tags)
+{
+    char *space, *end;
+
+    space = strchr (line, ' ');
+    if (space == NULL || space == line || space[1] != '(')
+	return FALSE;
+
+    end = line + strlen (line) - 1;
+    if (end <= space + 1 || *end != ')')
+	return FALSE;
+
+    if (memchr (space + 2, ')', end - (space + 2)))
+	return FALSE;
+
+    *space = '\0';
+    *end = '\0';
+
+    *message_id = line;
+    *file_tags = space + 2;
+
+    return TRUE;
+}
+
+/* Move the walk of 'cursor' forward to 'message_id', (starting the
+ * walk once enough lines came in order).
+ *
+ * Returns TRUE if the walk is then on the message with 'message_id',
+ * so that its tags can be read from the walk without loading the
+ * message. For a dump in order, that is the case for every message
+ * in the database. A message ID the walk has already passed, (from a
+ * dump in some other order, or of a message that isn't in the
+ * database), gives FALSE, and must be looked up on its own. */
+static notmuch_bool_t
+restore_cursor_seek (restore_cursor_t *cursor, const char *message_id)
+{
+    int cmp;
+
+    /* The walk goes over every message in the database, so it is
+     * only started once the dump looks like a full one. */
+    if (cursor->walk && cursor->dump == NULL) {
+	if (cursor->last_id && strcmp (cursor->last_id, message_id) < 0)
+	    cursor->in_order++;
+	else
+	    cursor->in_order = 0;
+
+	free (cursor->last_id);
+	cursor->last_id = xstrdup (message_id);
+
+	if (cursor->in_order < RESTORE_WALK_AFTER_LINES)
+	    return FALSE;
+
+	cursor->dump = notmuch_database_dump_tags (cursor->notmuch);
+	if (cursor->dump == NULL)
+	    cursor->walk = FALSE;
+    }
+
+    if (cursor->dump == NULL)
+	return FALSE;
+
+    while (notmuch_tag_dump_valid (cursor->dump)) {
+	cmp = strcmp (notmuch_tag_dump_get_message_id (cursor->dump),
+		      message_id);
+	if (cmp >= 0)
+	    return cmp == 0;
+
+	notmuch_tag_dump_move_to_next (cursor->dump);
+    }
+
+    return FALSE;
+}
+
+/* Whether 'tags' are exactly the space-separated 'file_tags', (in the
+ * same order, as "notmuch dump" writes them). Destroys 'tags'. */
+static notmuch_bool_t
+tags_match (notmuch_tags_t *tags, const char *file_tags)
+{
+    const char *tag;
+    notmuch_bool_t match = TRUE;
+    size_t len;
+
+    for (; notmuch_tags_valid (tags); notmuch_tags_move_to_next (tags)) {
+	tag = notmuch_tags_get (tags);
+
+	file_tags += strspn (file_tags, " ");
+	len = strcspn (file_tags, " ");
+
+	if (len != strlen (tag) || strncmp (file_tags, tag, len)) {
+	    match = FALSE;
+	    break;
+	}
+
+	file_tags += len;
+    }
+
+    notmuch_tags_destroy (tags);
+
+    if (match && file_tags[strspn (file_tags, " ")] != '\0')
+	match = FALSE;
+
+    return match;
+}
+
 int
 notmuch_restore_command (unused (void *ctx), int argc, char *argv[])
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
     notmuch_bool_t synchronize_flags;
-    FILE *input;
+    restore_cursor_t cursor;
+    restore_input_t input;
+    FILE *file;
     char *line = NULL;
-    size_t line_size;
-    ssize_t line_len;
-    regex_t regex;
-    int rerr;
+    size_t line_size = 0;
+    int ret = 0;
 
     config = notmuch_config_open (ctx, NULL, NULL);
     if (config == NULL)
@@ -44,48 +279,67 @@ notmuch_restore_command (unused (void *ctx), int argc, char *argv[])
 
     synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
 
+    /* Commit the restored tags in batches rather than after every
+     * single message. */
+    if (notmuch_config_begin_batch (config, notmuch)) {
+	notmuch_database_close (notmuch);
+	return 1;
+    }
+
     if (argc) {
-	input = fopen (argv[0], "r");
-	if (input == NULL) {
+	file = fopen (argv[0], "r");
+	if (file == NULL) {
 	    fprintf (stderr, "Error opening %s for reading: %s\n",
 		     argv[0], strerror (errno));
 	    return 1;
 	}
     } else {
 	printf ("No filename given. Reading dump from stdin.\n");
-	input = stdin;
+	file = stdin;
     }
 
-    /* Dump output is one line per message. We match a sequence of
-     * non-space characters for the message-id, then one or more
-     * spaces, then a list of space-separated tags as a sequence of
-     * characters within literal '(' and ')'. */
-    xregcomp (&regex,
-	      "^([^ ]+) \\(([^)]*)\\)$",
-	      REG_EXTENDED);
+    restore_input_init (&input, file);
+
+    cursor.notmuch = notmuch;
+    cursor.walk = TRUE;
+    cursor.dump = NULL;
+    cursor.last_id = NULL;
+    cursor.in_order = 0;
 
-    while ((line_len = getline (&line, &line_size, input)) != -1) {
-	regmatch_t match[3];
+    while (restore_input_read_line (&input, &line, &line_size)) {
 	char *message_id, *file_tags, *tag, *next;
 	notmuch_message_t *message = NULL;
 	notmuch_status_t status;
-	notmuch_tags_t *db_tags;
-	char *db_tags_str;
+	notmuch_bool_t walked;
+	unsigned long since, revision;
 
-	chomp_newline (line);
+	/* The dump of only the messages changed since some revision,
+	 * (from "notmuch dump --since"), says so in its header. Such a
+	 * dump is applied one message at a time rather than by walking
+	 * all messages. */
+	if (line[0] == '#') {
+	    if (sscanf (line, "#notmuch-dump since:%lu revision:%lu",
+			&since, &revision) == 2 && since)
+	    {
+		cursor.walk = FALSE;
+	    }
+	    continue;
+	}
 
-	rerr = xregexec (&regex, line, 3, match, 0);
-	if (rerr == REG_NOMATCH)
-	{
+	if (! parse_dump_line (line, &message_id, &file_tags)) {
 	    fprintf (stderr, "Warning: Ignoring invalid input line: %s\n",
 		     line);
 	    continue;
 	}
 
-	message_id = xstrndup (line + match[1].rm_so,
-			       match[1].rm_eo - match[1].rm_so);
-	file_tags = xstrndup (line + match[2].rm_so,
-			      match[2].rm_eo - match[2].rm_so);
+	/* Only a message whose tags change is loaded at all, unless
+	 * the walk has already gone past it. */
+	walked = restore_cursor_seek (&cursor, message_id);
+	if (walked && tags_match (notmuch_tag_dump_get_tags (cursor.dump),
+				file_tags))
+	{
+	    continue;
+	}
 
 	message = notmuch_database_find_message (notmuch, message_id);
 	if (message == NULL) {
@@ -94,23 +348,18 @@ notmuch_restore_command (unused (void *ctx), int argc, char *argv[])
 	    goto NEXT_LINE;
 	}
 
-	db_tags_str = NULL;
-	for (db_tags = notmuch_message_get_tags (message);
-	     notmuch_tags_valid (db_tags);
-	     notmuch_tags_move_to_next (db_tags))
+	if (! walked && tags_match (notmuch_message_get_tags (message),
+				  file_tags))
 	{
-	    const char *tag = notmuch_tags_get (db_tags);
-
-	    if (db_tags_str)
-		db_tags_str = talloc_asprintf_append (db_tags_str, " %s", tag);
-	    else
-		db_tags_str = talloc_strdup (message, tag);
+	    goto NEXT_LINE;
 	}
 
-	if (((file_tags == NULL || *file_tags == '\0') &&
-	     (db_tags_str == NULL || *db_tags_str == '\0')) ||
-	    (file_tags && db_tags_str && strcmp (file_tags, db_tags_str) == 0))
-	{
+	/* Each message's tags (and maildir flags) change atomically,
+	 * which also lets the batch count messages. */
+	status = notmuch_database_begin_atomic (notmuch);
+	if (status) {
+	    fprintf (stderr, "Error restoring tags of message %s: %s\n",
+		     message_id, notmuch_status_to_string (status));
 	    goto NEXT_LINE;
 	}
 
@@ -137,22 +386,33 @@ notmuch_restore_command (unused (void *ctx), int argc, char *argv[])
 	if (synchronize_flags)
 	    notmuch_message_tags_to_maildir_flags (message);
 
+	status = notmuch_database_end_atomic (notmuch);
+	if (status) {
+	    fprintf (stderr, "Error restoring tags of message %s: %s\n",
+		     message_id, notmuch_status_to_string (status));
+	    ret = 1;
+	}
+
       NEXT_LINE:
 	if (message)
 	    notmuch_message_destroy (message);
-	message = NULL;
-	free (message_id);
-	free (file_tags);
     }
 
-    regfree (&regex);
+    if (cursor.dump)
+	notmuch_tag_dump_destroy (cursor.dump);
+    free (cursor.last_id);
 
     if (line)
 	free (line);
 
+    if (notmuch_database_end_batch (notmuch))
+	ret = 1;
+
     notmuch_database_close (notmuch);
-    if (input != stdin)
-	fclose (input);
 
-    return 0;
+    restore_input_fini (&input);
+    if (file != stdin)
+	fclose (file);
+
+    return ret;
 }
@@ -190,11 +190,46 @@ format_thread_json (const void *ctx,
     talloc_free (ctx_quote);
 }
 
+static int
+do_search_thread_ids (const search_format_t *format,
+		      notmuch_query_t *query)
+{
+    notmuch_thread_ids_t *thread_ids;
+    int first_thread = 1;
+
+    thread_ids = notmuch_query_search_thread_ids (query);
+    if (thread_ids == NULL)
+	return 1;
+
+    fputs (format->results_start, stdout);
+
+    for (;
+	 notmuch_thread_ids_valid (thread_ids);
+	 notmuch_thread_ids_move_to_next (thread_ids))
+    {
+	if (! first_thread)
+	    fputs (format->item_sep, stdout);
+
+	format->item_id (thread_ids, "thread:",
+			 notmuch_thread_ids_get (thread_ids));
+
+	first_thread = 0;
+    }
+
+    notmuch_thread_ids_destroy (thread_ids);
+
+    if (first_thread)
+	fputs (format->results_null, stdout);
+    else
+	fputs (format->results_end, stdout);
+
+    return 0;
+}
+
 static int
 do_search_threads (const search_format_t *format,
 		   notmuch_query_t *query,
-		   notmuch_sort_t sort,
-		   output_t output)
+		   notmuch_sort_t sort)
 {
     notmuch_thread_t *thread;
     notmuch_threads_t *threads;
@@ -219,41 +254,36 @@ do_search_threads (const search_format_t *format,
 
 	thread = notmuch_threads_get (threads);
 
-	if (output == OUTPUT_THREADS) {
-	    format->item_id (thread, "thread:",
-			     notmuch_thread_get_thread_id (thread));
-	} else { /* output == OUTPUT_SUMMARY */
-	    fputs (format->item_start, stdout);
-
-	    if (sort == NOTMUCH_SORT_OLDEST_FIRST)
-		date = notmuch_thread_get_oldest_date (thread);
-	    else
-		date = notmuch_thread_get_newest_date (thread);
-
-	    format->thread_summary (thread,
-				    notmuch_thread_get_thread_id (thread),
-				    date,
-				    notmuch_thread_get_matched_messages (thread),
-				    notmuch_thread_get_total_messages (thread),
-				    notmuch_thread_get_authors (thread),
-				    notmuch_thread_get_subject (thread));
-
-	    fputs (format->tag_start, stdout);
-
-	    for (tags = notmuch_thread_get_tags (thread);
-		 notmuch_tags_valid (tags);
-		 notmuch_tags_move_to_next (tags))
-	    {
-		if (! first_tag)
-		    fputs (format->tag_sep, stdout);
-		printf (format->tag, notmuch_tags_get (tags));
-		first_tag = 0;
-	    }
+	fputs (format->item_start, stdout);
+
+	if (sort == NOTMUCH_SORT_OLDEST_FIRST)
+	    date = notmuch_thread_get_oldest_date (thread);
+	else
+	    date = notmuch_thread_get_newest_date (thread);
+
+	format->thread_summary (thread,
+				notmuch_thread_get_thread_id (thread),
+				date,
+				notmuch_thread_get_matched_messages (thread),
+				notmuch_thread_get_total_messages (thread),
+				notmuch_thread_get_authors (thread),
+				notmuch_thread_get_subject (thread));
+
+	fputs (format->tag_start, stdout);
+
+	for (tags = notmuch_thread_get_tags (thread);
+	     notmuch_tags_valid (tags);
+	     notmuch_tags_move_to_next (tags))
+	{
+	    if (! first_tag)
+		fputs (format->tag_sep, stdout);
+	    printf (format->tag, notmuch_tags_get (tags));
+	    first_tag = 0;
+	}
 
-	    fputs (format->tag_end, stdout);
+	fputs (format->tag_end, stdout);
 
-	    fputs (format->item_end, stdout);
-	}
+	fputs (format->item_end, stdout);
 
 	first_thread = 0;
 
@@ -389,11 +419,14 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
     notmuch_database_t *notmuch;
     notmuch_query_t *query;
     char *query_str;
-    char *opt;
+    char *opt, *end;
     notmuch_sort_t sort = NOTMUCH_SORT_NEWEST_FIRST;
     const search_format_t *format = &format_text;
     int i, ret;
     output_t output = OUTPUT_SUMMARY;
+    unsigned int offset = 0;
+    int limit = -1;
+    unsigned long value;
 
     for (i = 0; i < argc && argv[i][0] == '-'; i++) {
 	if (strcmp (argv[i], "--") == 0) {
@@ -436,6 +469,28 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
 		fprintf (stderr, "Invalid value for --output: %s\n", opt);
 		return 1;
 	    }
+	} else if (STRNCMP_LITERAL (argv[i], "--offset=") == 0) {
+	    opt = argv[i] + sizeof ("--offset=") - 1;
+	    errno = 0;
+	    value = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *opt == '-' || *end != '\0' ||
+		errno == ERANGE || value > UINT_MAX)
+	    {
+		fprintf (stderr, "Invalid value for --offset: %s\n", opt);
+		return 1;
+	    }
+	    offset = value;
+	} else if (STRNCMP_LITERAL (argv[i], "--limit=") == 0) {
+	    opt = argv[i] + sizeof ("--limit=") - 1;
+	    errno = 0;
+	    value = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *opt == '-' || *end != '\0' ||
+		errno == ERANGE || value > INT_MAX)
+	    {
+		fprintf (stderr, "Invalid value for --limit: %s\n", opt);
+		return 1;
+	    }
+	    limit = value;
 	} else {
 	    fprintf (stderr, "Unrecognized option: %s\n", argv[i]);
 	    return 1;
@@ -471,12 +526,17 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
     }
 
     notmuch_query_set_sort (query, sort);
+    notmuch_query_set_offset (query, offset);
+    notmuch_query_set_limit (query, limit);
+    notmuch_query_set_jobs (query, notmuch_config_get_search_jobs (config));
 
     switch (output) {
     default:
     case OUTPUT_SUMMARY:
+	ret = do_search_threads (format, query, sort);
+	break;
     case OUTPUT_THREADS:
-	ret = do_search_threads (format, query, sort, output);
+	ret = do_search_thread_ids (format, query);
 	break;
     case OUTPUT_MESSAGES:
     case OUTPUT_FILES:
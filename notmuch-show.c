@@ -923,11 +923,14 @@ notmuch_show_command (void *ctx, unused (int argc), unused (char *argv[]))
     notmuch_database_t *notmuch;
     notmuch_query_t *query;
     char *query_string;
-    char *opt;
+    char *opt, *end;
     const notmuch_show_format_t *format = &format_text;
     notmuch_show_params_t params;
     int mbox = 0;
     int format_specified = 0;
+    unsigned int offset = 0;
+    int limit = -1;
+    unsigned long value;
     int i;
 
     params.entire_thread = 0;
@@ -963,6 +966,28 @@ notmuch_show_command (void *ctx, unused (int argc), unused (char *argv[]))
 	    params.part = atoi(argv[i] + sizeof ("--part=") - 1);
 	} else if (STRNCMP_LITERAL (argv[i], "--entire-thread") == 0) {
 	    params.entire_thread = 1;
+	} else if (STRNCMP_LITERAL (argv[i], "--offset=") == 0) {
+	    opt = argv[i] + sizeof ("--offset=") - 1;
+	    errno = 0;
+	    value = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *opt == '-' || *end != '\0' ||
+		errno == ERANGE || value > UINT_MAX)
+	    {
+		fprintf (stderr, "Invalid value for --offset: %s\n", opt);
+		return 1;
+	    }
+	    offset = value;
+	} else if (STRNCMP_LITERAL (argv[i], "--limit=") == 0) {
+	    opt = argv[i] + sizeof ("--limit=") - 1;
+	    errno = 0;
+	    value = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *opt == '-' || *end != '\0' ||
+		errno == ERANGE || value > INT_MAX)
+	    {
+		fprintf (stderr, "Invalid value for --limit: %s\n", opt);
+		return 1;
+	    }
+	    limit = value;
 	} else if ((STRNCMP_LITERAL (argv[i], "--verify") == 0) ||
 		   (STRNCMP_LITERAL (argv[i], "--decrypt") == 0)) {
 	    if (params.cryptoctx == NULL) {
@@ -1016,6 +1041,8 @@ notmuch_show_command (void *ctx, unused (int argc), unused (char *argv[]))
 	return 1;
     }
 
+    notmuch_query_set_jobs (query, notmuch_config_get_search_jobs (config));
+
     /* if part was requested and format was not specified, use format=raw */
     if (params.part >= 0 && !format_specified)
 	format = &format_raw;
@@ -1025,6 +1052,13 @@ notmuch_show_command (void *ctx, unused (int argc), unused (char *argv[]))
     if (params.raw && params.part < 0)
 	params.part = 0;
 
+    /* A single message is shown only if it is the one match, so
+     * there are no results to page through. */
+    if (params.part < 0) {
+	notmuch_query_set_offset (query, offset);
+	notmuch_query_set_limit (query, limit);
+    }
+
     if (params.part >= 0)
 	return do_show_single (ctx, query, format, &params);
     else
@@ -30,39 +30,39 @@ handle_sigint (unused (int sig))
     interrupted = 1;
 }
 
-int
-notmuch_tag_command (void *ctx, unused (int argc), unused (char *argv[]))
-{
-    int *add_tags, *remove_tags;
-    int add_tags_count = 0;
-    int remove_tags_count = 0;
+/* The tags to remove and to add, (without their leading '-' or '+'),
+ * for the messages matching a query. */
+typedef struct _tag_operation {
+    const char **remove_tags;
+    int remove_tags_count;
+    const char **add_tags;
+    int add_tags_count;
     char *query_string;
-    notmuch_config_t *config;
-    notmuch_database_t *notmuch;
-    notmuch_query_t *query;
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-    struct sigaction action;
-    notmuch_bool_t synchronize_flags;
-    int i;
+} tag_operation_t;
 
-    /* Setup our handler for SIGINT */
-    memset (&action, 0, sizeof (struct sigaction));
-    action.sa_handler = handle_sigint;
-    sigemptyset (&action.sa_mask);
-    action.sa_flags = SA_RESTART;
-    sigaction (SIGINT, &action, NULL);
+/* Parse the command-line syntax of a tag operation, (tags to add and
+ * remove, then search terms), from 'argc' arguments at 'argv'.
+ *
+ * Returns NULL, (after printing a message), if there's nothing to do
+ * or no search terms. */
+static tag_operation_t *
+parse_tag_operation (void *ctx, int argc, char *argv[])
+{
+    tag_operation_t *op;
+    int i;
 
-    add_tags = talloc_size (ctx, argc * sizeof (int));
-    if (add_tags == NULL) {
+    op = talloc_zero (ctx, tag_operation_t);
+    if (op == NULL) {
 	fprintf (stderr, "Out of memory.\n");
-	return 1;
+	return NULL;
     }
 
-    remove_tags = talloc_size (ctx, argc * sizeof (int));
-    if (remove_tags == NULL) {
+    op->remove_tags = talloc_array (op, const char *, argc);
+    op->add_tags = talloc_array (op, const char *, argc);
+    if (op->remove_tags == NULL || op->add_tags == NULL) {
 	fprintf (stderr, "Out of memory.\n");
-	return 1;
+	talloc_free (op);
+	return NULL;
     }
 
     for (i = 0; i < argc; i++) {
@@ -71,38 +71,165 @@ notmuch_tag_command (void *ctx, unused (int argc), unused (char *argv[]))
 	    break;
 	}
 	if (argv[i][0] == '+') {
-	    add_tags[add_tags_count++] = i;
+	    op->add_tags[op->add_tags_count++] = argv[i] + 1;
 	} else if (argv[i][0] == '-') {
-	    remove_tags[remove_tags_count++] = i;
+	    op->remove_tags[op->remove_tags_count++] = argv[i] + 1;
 	} else {
 	    break;
 	}
     }
 
-    if (add_tags_count == 0 && remove_tags_count == 0) {
+    if (op->add_tags_count == 0 && op->remove_tags_count == 0) {
 	fprintf (stderr, "Error: 'notmuch tag' requires at least one tag to add or remove.\n");
-	return 1;
+	talloc_free (op);
+	return NULL;
     }
 
-    query_string = query_string_from_args (ctx, argc - i, &argv[i]);
+    op->query_string = query_string_from_args (op, argc - i, &argv[i]);
 
-    if (*query_string == '\0') {
+    if (op->query_string == NULL || *op->query_string == '\0') {
 	fprintf (stderr, "Error: notmuch tag requires at least one search term.\n");
-	return 1;
+	talloc_free (op);
+	return NULL;
     }
 
-    config = notmuch_config_open (ctx, NULL, NULL);
-    if (config == NULL)
-	return 1;
+    return op;
+}
 
-    notmuch = notmuch_database_open (notmuch_config_get_database_path (config),
-				     NOTMUCH_DATABASE_MODE_READ_WRITE);
-    if (notmuch == NULL)
-	return 1;
+/* Whether 'tag' can be written as a tag: term of a query string
+ * without quoting. */
+static notmuch_bool_t
+_tag_is_query_safe (const char *tag)
+{
+    return *tag && strpbrk (tag, " \t()\"") == NULL;
+}
 
-    synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+/* Return the query string of 'op', narrowed down to the messages
+ * whose tags 'op' would actually change: those missing a tag to add,
+ * or having a tag to remove, (that isn't also added back). This way
+ * re-applying a tag operation doesn't even visit the messages it
+ * already applied to.
+ *
+ * Returns the query string of 'op' unchanged if one of its tags can't
+ * be written in a query. */
+static const char *
+_optimize_tag_query (void *ctx, tag_operation_t *op)
+{
+    char *unchanged;
+    const char *join = "";
+    int i, j;
+
+    for (i = 0; i < op->add_tags_count; i++)
+	if (! _tag_is_query_safe (op->add_tags[i]))
+	    return op->query_string;
+
+    for (i = 0; i < op->remove_tags_count; i++)
+	if (! _tag_is_query_safe (op->remove_tags[i]))
+	    return op->query_string;
+
+    /* The messages left unchanged have all the tags to add and none
+     * of the tags to remove. Without any tags to add, that's better
+     * written as the messages that have any of the tags to remove. */
+    unchanged = talloc_strdup (ctx, "");
+
+    for (i = 0; i < op->add_tags_count; i++) {
+	unchanged = talloc_asprintf_append (unchanged, "%stag:%s",
+					    join, op->add_tags[i]);
+	join = " and ";
+    }
+
+    if (op->add_tags_count)
+	join = " and not ";
+
+    for (i = 0; i < op->remove_tags_count; i++) {
+	for (j = 0; j < op->add_tags_count; j++)
+	    if (strcmp (op->remove_tags[i], op->add_tags[j]) == 0)
+		break;
+	if (j < op->add_tags_count)
+	    continue;
+
+	unchanged = talloc_asprintf_append (unchanged, "%stag:%s",
+					    join, op->remove_tags[i]);
+	if (! op->add_tags_count)
+	    join = " or ";
+    }
+
+    if (strcmp (op->query_string, "*") == 0)
+	return talloc_asprintf (ctx, op->add_tags_count ? "not ( %s )" : "%s",
+				unchanged);
+
+    return talloc_asprintf (ctx,
+			    op->add_tags_count ? "( %s ) and not ( %s )"
+					       : "( %s ) and ( %s )",
+			    op->query_string, unchanged);
+}
+
+/* Whether 'message' has the tag 'tag'. */
+static notmuch_bool_t
+_message_has_tag (notmuch_message_t *message, const char *tag)
+{
+    notmuch_tags_t *tags;
+    notmuch_bool_t found = FALSE;
+
+    for (tags = notmuch_message_get_tags (message);
+	 notmuch_tags_valid (tags) && ! found;
+	 notmuch_tags_move_to_next (tags))
+    {
+	found = strcmp (notmuch_tags_get (tags), tag) == 0;
+    }
+
+    notmuch_tags_destroy (tags);
+
+    return found;
+}
+
+/* Whether applying 'op' would change the tags of 'message'. */
+static notmuch_bool_t
+_tag_operation_changes (tag_operation_t *op, notmuch_message_t *message)
+{
+    int i, j;
+
+    for (i = 0; i < op->add_tags_count; i++)
+	if (! _message_has_tag (message, op->add_tags[i]))
+	    return TRUE;
+
+    for (i = 0; i < op->remove_tags_count; i++) {
+	for (j = 0; j < op->add_tags_count; j++)
+	    if (strcmp (op->remove_tags[i], op->add_tags[j]) == 0)
+		break;
+	if (j == op->add_tags_count &&
+	    _message_has_tag (message, op->remove_tags[i]))
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Apply the tag operation 'op' to each message matching its query,
+ * counting the messages whose tags changed in '*changed', (unless
+ * 'changed' is NULL).
+ *
+ * With 'synchronize_flags', every matching message is visited, (not
+ * just those whose tags change), so that its maildir flags are
+ * brought in line with its tags even when the tags are already right.
+ *
+ * Each message's tags (and maildir flags) change in an atomic
+ * section of their own, so that the caller's batch, if any, commits
+ * the changes of many messages together. */
+static int
+tag_query (notmuch_database_t *notmuch, tag_operation_t *op,
+	   notmuch_bool_t synchronize_flags, unsigned int *changed)
+{
+    notmuch_query_t *query;
+    notmuch_messages_t *messages;
+    notmuch_message_t *message;
+    notmuch_status_t status;
+    int i, ret = 0;
 
-    query = notmuch_query_create (notmuch, query_string);
+    if (synchronize_flags)
+	query = notmuch_query_create (notmuch, op->query_string);
+    else
+	query = notmuch_query_create (notmuch, _optimize_tag_query (op, op));
     if (query == NULL) {
 	fprintf (stderr, "Out of memory.\n");
 	return 1;
@@ -117,25 +244,206 @@ notmuch_tag_command (void *ctx, unused (int argc), unused (char *argv[]))
     {
 	message = notmuch_messages_get (messages);
 
+	status = notmuch_database_begin_atomic (notmuch);
+	if (status) {
+	    fprintf (stderr, "Error tagging message %s: %s\n",
+		     notmuch_message_get_message_id (message),
+		     notmuch_status_to_string (status));
+	    notmuch_message_destroy (message);
+	    ret = 1;
+	    break;
+	}
+
+	if (changed && _tag_operation_changes (op, message))
+	    (*changed)++;
+
 	notmuch_message_freeze (message);
 
-	for (i = 0; i < remove_tags_count; i++)
-	    notmuch_message_remove_tag (message,
-					argv[remove_tags[i]] + 1);
+	for (i = 0; i < op->remove_tags_count; i++)
+	    notmuch_message_remove_tag (message, op->remove_tags[i]);
 
-	for (i = 0; i < add_tags_count; i++)
-	    notmuch_message_add_tag (message, argv[add_tags[i]] + 1);
+	for (i = 0; i < op->add_tags_count; i++)
+	    notmuch_message_add_tag (message, op->add_tags[i]);
 
 	notmuch_message_thaw (message);
 
 	if (synchronize_flags)
 	    notmuch_message_tags_to_maildir_flags (message);
 
+	notmuch_database_end_atomic (notmuch);
+
 	notmuch_message_destroy (message);
     }
 
     notmuch_query_destroy (query);
+
+    return ret;
+}
+
+/* Apply the tag operation of each line of 'input', in order, (so that
+ * the query of each line sees the changes of the lines before it),
+ * printing how many messages each line changed.
+ *
+ * Each line has the same syntax as the arguments of "notmuch tag":
+ * tags to add and remove, separated by spaces, then search terms.
+ * The search terms are the rest of the line, taken as written, (with
+ * any quotes, as the query parser sees them, rather than the shell).
+ * Blank lines and lines starting with '#' are ignored. A line that
+ * can't be applied is reported, with its line number, and doesn't
+ * stop the following lines. */
+static int
+tag_batch (void *ctx, notmuch_database_t *notmuch, FILE *input,
+	   notmuch_bool_t synchronize_flags)
+{
+    char *line = NULL;
+    size_t line_size;
+    ssize_t line_len;
+    unsigned int line_number = 0;
+    int ret = 0;
+
+    while (! interrupted &&
+	   (line_len = getline (&line, &line_size, input)) != -1)
+    {
+	void *local = talloc_new (ctx);
+	tag_operation_t *op;
+	char **argv, *next, *arg;
+	unsigned int changed = 0;
+	int argc = 0;
+
+	line_number++;
+	chomp_newline (line);
+
+	/* There can't be more arguments than there are characters. */
+	argv = talloc_array (local, char *, line_len + 1);
+	if (argv == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    talloc_free (local);
+	    ret = 1;
+	    break;
+	}
+
+	/* Split off the tags, (and any "--"), and keep the rest of
+	 * the line as the search terms. */
+	next = line;
+	while (next) {
+	    next += strspn (next, " \t");
+	    if (*next == '\0')
+		break;
+	    if ((*next != '+' && *next != '-') ||
+		(argc && strcmp (argv[argc - 1], "--") == 0))
+	    {
+		argv[argc++] = next;
+		break;
+	    }
+	    arg = strsep (&next, " \t");
+	    argv[argc++] = arg;
+	}
+
+	if (argc == 0 || argv[0][0] == '#')
+	    goto NEXT_LINE;
+
+	op = parse_tag_operation (local, argc, argv);
+	if (op == NULL) {
+	    fprintf (stderr, "Error: Ignoring line %u of tag operations.\n",
+		     line_number);
+	    ret = 1;
+	    goto NEXT_LINE;
+	}
+
+	if (tag_query (notmuch, op, synchronize_flags, &changed)) {
+	    fprintf (stderr, "Error: Failed to apply line %u of tag operations.\n",
+		     line_number);
+	    ret = 1;
+	}
+
+	printf ("Line %u: Changed %u message%s.\n", line_number,
+		changed, changed == 1 ? "" : "s");
+
+      NEXT_LINE:
+	talloc_free (local);
+    }
+
+    if (line)
+	free (line);
+
+    return ret;
+}
+
+int
+notmuch_tag_command (void *ctx, int argc, char *argv[])
+{
+    tag_operation_t *op = NULL;
+    notmuch_config_t *config;
+    notmuch_database_t *notmuch;
+    struct sigaction action;
+    notmuch_bool_t synchronize_flags;
+    notmuch_bool_t batch = FALSE;
+    FILE *input = stdin;
+    int ret;
+
+    /* Setup our handler for SIGINT */
+    memset (&action, 0, sizeof (struct sigaction));
+    action.sa_handler = handle_sigint;
+    sigemptyset (&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction (SIGINT, &action, NULL);
+
+    /* Only a leading argument can ask for batch mode, (since any
+     * other argument starting with '-' names a tag to remove). */
+    if (argc && strcmp (argv[0], "--batch") == 0) {
+	batch = TRUE;
+	argc--;
+	argv++;
+
+	if (argc > 1) {
+	    fprintf (stderr, "Error: 'notmuch tag --batch' takes at most one filename.\n");
+	    return 1;
+	}
+    } else {
+	op = parse_tag_operation (ctx, argc, argv);
+	if (op == NULL)
+	    return 1;
+    }
+
+    config = notmuch_config_open (ctx, NULL, NULL);
+    if (config == NULL)
+	return 1;
+
+    if (batch && argc) {
+	input = fopen (argv[0], "r");
+	if (input == NULL) {
+	    fprintf (stderr, "Error opening %s for reading: %s\n",
+		     argv[0], strerror (errno));
+	    return 1;
+	}
+    }
+
+    notmuch = notmuch_database_open (notmuch_config_get_database_path (config),
+				     NOTMUCH_DATABASE_MODE_READ_WRITE);
+    if (notmuch == NULL)
+	return 1;
+
+    synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+
+    /* Commit the changes in batches rather than after every single
+     * message. */
+    if (notmuch_config_begin_batch (config, notmuch)) {
+	notmuch_database_close (notmuch);
+	return 1;
+    }
+
+    if (batch)
+	ret = tag_batch (ctx, notmuch, input, synchronize_flags);
+    else
+	ret = tag_query (notmuch, op, synchronize_flags, NULL);
+
+    if (notmuch_database_end_batch (notmuch))
+	ret = 1;
+
     notmuch_database_close (notmuch);
 
-    return interrupted;
+    if (input != stdin)
+	fclose (input);
+
+    return ret || interrupted;
 }
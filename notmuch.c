@@ -125,7 +125,16 @@ static const char search_terms_help[] =
     "\tfollowing syntax would specify a date range to return messages\n"
     "\tfrom 2009-10-01 until the current time:\n"
     "\n"
-    "\t\t$(date +%%s -d 2009-10-01)..$(date +%%s)\n\n";
+    "\t\t$(date +%%s -d 2009-10-01)..$(date +%%s)\n"
+    "\n"
+    "\tSimilarly, results can be restricted to only messages added\n"
+    "\tor whose tags last changed within a range of database\n"
+    "\trevisions with:\n"
+    "\n"
+    "\t\tlastmod:<initial-revision>..<final-revision>\n"
+    "\n"
+    "\tThe current revision is given in the header of the output of\n"
+    "\t\"notmuch dump --since\" (see \"notmuch help dump\").\n\n";
 
 static command_t commands[] = {
     { "setup", notmuch_setup_command,
@@ -169,6 +178,40 @@ static command_t commands[] = {
       "\tInvoking notmuch with no command argument will run new if\n"
       "\tthe setup command has previously been completed, but new has\n"
       "\tnot previously been run." },
+    { "watch", notmuch_watch_command,
+      "[--verbose]",
+      "Keep the database up to date as mail is delivered.",
+      "\tStarts by doing what \"notmuch new\" does, and then keeps\n"
+      "\trunning, watching all sub-directories of the mail directory\n"
+      "\tfor changes and applying each burst of new, removed and\n"
+      "\trenamed message files to the database as soon as it settles.\n"
+      "\tThe whole mail directory is only scanned again if the system\n"
+      "\tloses track of changes (for example when too many arrive at\n"
+      "\tonce).\n"
+      "\n"
+      "\tEach directory takes one of the inotify watches the system\n"
+      "\tallows a user (see /proc/sys/fs/inotify/max_user_watches).\n"
+      "\tIf they run out, watch applies the changes gathered so far\n"
+      "\tand then exits with an error. Either raise the limit or run\n"
+      "\t\"notmuch new\" periodically instead.\n"
+      "\n"
+      "\tAfter each burst of changes, a summary is printed just as\n"
+      "\t\"notmuch new\" does.\n"
+      "\n"
+      "\tThe database is only opened for writing while a burst of\n"
+      "\tchanges is applied, so other commands that modify the\n"
+      "\tdatabase (such as \"notmuch tag\") can run in between. While\n"
+      "\tanother command is writing to the database, changes are\n"
+      "\tgathered up and applied once it has finished.\n"
+      "\n"
+      "\tThis command is only available on systems with inotify.\n"
+      "\n"
+      "\tSupported options for watch include:\n"
+      "\n"
+      "\t--verbose\n"
+      "\n"
+      "\t\tVerbose operation. Shows paths of message files as\n"
+      "\t\tthey are being indexed." },
     { "search", notmuch_search_command,
       "[options...] <search-terms> [...]",
       "Search for messages matching the given search terms.",
@@ -222,6 +265,16 @@ static command_t commands[] = {
       "\t\t(oldest-first) or reverse chronological order\n"
       "\t\t(newest-first), which is the default.\n"
       "\n"
+      "\t--offset=<N>\n"
+      "\n"
+      "\t\tSkip the first N results. Results are threads, except\n"
+      "\t\twith --output=messages or --output=files where they are\n"
+      "\t\tmessages.\n"
+      "\n"
+      "\t--limit=<N>\n"
+      "\n"
+      "\t\tOutput at most N results (counted as for --offset).\n"
+      "\n"
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "show", notmuch_show_command,
@@ -240,6 +293,16 @@ static command_t commands[] = {
       "\t\tall messages in the same thread as any matched\n"
       "\t\tmessage will be displayed.\n"
       "\n"
+      "\t--offset=<N>\n"
+      "\n"
+      "\t\tSkip the first N matching threads, (ignored with\n"
+      "\t\t--part or --format=raw, which show a single message).\n"
+      "\n"
+      "\t--limit=<N>\n"
+      "\n"
+      "\t\tShow at most N matching threads, (likewise ignored\n"
+      "\t\twith --part or --format=raw).\n"
+      "\n"
       "\t--format=(text|json|mbox|raw)\n"
       "\n"
       "\t\ttext (default for messages)\n"
@@ -319,12 +382,25 @@ static command_t commands[] = {
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "count", notmuch_count_command,
-      "<search-terms> [...]",
+      "[options...] <search-terms> [...]",
       "Count messages matching the search terms.",
-      "\tThe number of matching messages is output to stdout.\n"
+      "\tThe number of matching messages (or threads) is output to stdout.\n"
+      "\n"
+      "\tWith no search terms, a count of all messages (or threads) in\n"
+      "\tthe database will be displayed.\n"
+      "\n"
+      "\tSupported options for count include:\n"
       "\n"
-      "\tWith no search terms, a count of all messages in the database\n"
-      "\twill be displayed.\n"
+      "\t--output=(messages|threads)\n"
+      "\n"
+      "\t\tmessages (default)\n"
+      "\n"
+      "\t\tOutput the number of matching messages.\n"
+      "\n"
+      "\t\tthreads\n"
+      "\n"
+      "\t\tOutput the number of threads containing any matching\n"
+      "\t\tmessage.\n"
       "\n"
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
@@ -357,7 +433,7 @@ static command_t commands[] = {
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "tag", notmuch_tag_command,
-      "+<tag>|-<tag> [...] [--] <search-terms> [...]",
+      "+<tag>|-<tag> [...] [--] <search-terms> [...] | --batch [<filename>]",
       "Add/remove tags for all messages matching the search terms.",
       "\tThe search terms are handled exactly as in 'search' so one\n"
       "\tcan use that command first to see what will be modified.\n"
@@ -372,12 +448,41 @@ static command_t commands[] = {
       "\tby allowing the user to specify a \"--\" argument to separate\n"
       "\tthe tags from the search terms.\n"
       "\n"
+      "\tWith --batch as the first argument, the tag operations are\n"
+      "\tread from the given file, or from stdin, one per line, each\n"
+      "\twith the same syntax as the arguments above. The tags are\n"
+      "\tseparated by spaces, (so they can't contain any), and the\n"
+      "\trest of the line is taken as the search terms just as\n"
+      "\twritten, quotes included, with no shell quoting to undo.\n"
+      "\tThe lines are applied in order, all with one open database,\n"
+      "\tso each line's search terms see the changes of the lines\n"
+      "\tbefore it. Blank lines and lines starting with '#' are\n"
+      "\tignored. The number of messages each line changed is\n"
+      "\tprinted, and lines that can't be applied are reported, both\n"
+      "\twith their line number.\n"
+      "\n"
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "dump", notmuch_dump_command,
-      "[<filename>]",
+      "[--gzip] [--since=<revision>] [<filename>]",
       "Create a plain-text dump of the tags for each message.",
       "\tOutput is to the given filename, if any, or to stdout.\n"
+      "\tWith --gzip, the output is compressed with gzip, (which\n"
+      "\t\"notmuch restore\" recognizes by itself).\n"
+      "\n"
+      "\tWith --since, only the messages added or whose tags changed\n"
+      "\tafter the given database revision are dumped, after a header\n"
+      "\tline:\n"
+      "\n"
+      "\t\t#notmuch-dump since:<revision> revision:<current>\n"
+      "\n"
+      "\tThe next incremental dump can then start from <current>.\n"
+      "\tA revision of 0 gives a full dump with this header.\n"
+      "\tMessages removed from the database are not recorded.\n"
+      "\tThe same messages can be searched for with the search term\n"
+      "\t\"lastmod:<revision+1>..<current>\", (see \"notmuch help\n"
+      "\tsearch-terms\").\n"
+      "\n"
       "\tThese tags are the only data in the notmuch database\n"
       "\tthat can't be recreated from the messages themselves.\n"
       "\tThe output of notmuch dump is therefore the only\n"
@@ -391,6 +496,17 @@ static command_t commands[] = {
       "\tSo if you've previously been using sup for mail, then the\n"
       "\t\"notmuch restore\" command provides you a way to import\n"
       "\tall of your tags (or labels as sup calls them)." },
+    { "compact-threads", notmuch_compact_threads_command,
+      NULL,
+      "Move the messages of merged threads into a single thread.",
+      "\tWhen a new message joins two threads, \"notmuch new\" only\n"
+      "\trecords that one thread was merged into the other, (which\n"
+      "\tsearches then take into account), rather than updating\n"
+      "\tevery message of the merged thread.\n"
+      "\n"
+      "\tThis command updates the messages of all merged threads,\n"
+      "\twhich keeps searches involving threads fast. It can be run\n"
+      "\tat any time, such as occasionally after \"notmuch new\"." },
     { "config", notmuch_config_command,
       "[get|set] <section>.<item> [value ...]",
       "Get or set settings in the notmuch configuration file.",